@@ -14,8 +14,8 @@ warn='-Wall -Wextra -Wno-sign-compare -Wno-unused-parameter'
 
 
 echo 'building remotefs-test'
-# gcc                     -static -o remotefs      $warn $opt $def $inc $src           || { echo error2 ; exit 1 ; } 
-gcc  -DREMOTEFS_DOTEST  -static -o remotefs-test $warn $opt $def $inc $src           || { echo error2 ; exit 1 ; } 
+# gcc                     -static -o remotefs      $warn $opt $def $inc $src -lpthread -lz || { echo error2 ; exit 1 ; } 
+gcc  -DREMOTEFS_DOTEST  -static -o remotefs-test $warn $opt $def $inc $src -lpthread -lz || { echo error2 ; exit 1 ; } 
 
 echo 'building winrand.obj'
 /usr/bin/x86_64-w64-mingw32-gcc -Wall -c -o winrand.obj -I/usr/share/mingw-w64/include/ widget/winrand.c || { echo error3 ; exit 1 ; } 
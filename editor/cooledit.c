@@ -338,6 +338,7 @@ extern int option_use_xim;
 int option_aa_font = -1;
 extern int option_rgb_order;
 extern int option_interchar_spacing;
+extern int option_font_cache_kb;
 
 int option_new_window_ask_for_file = 1;
 
@@ -415,6 +416,8 @@ void usage (void)
 	    "--blue-first                             B-G-R LCD sub-pixel order aliasing\n" \
 	    "--interchar-spacing <n>                  extra spacing between chars in pixels\n" \
 	    "                                         (anti-aliased fonts only)\n" \
+	    "--font-cache-kb <n>                      X server memory for anti-aliased glyphs\n" \
+	    "--frame-ms <n>                           shortest time between editor repaints\n" \
 	    "--interwidget-spacing <n>                spacing between widgets in pixels\n" \
 	    "--look [gtk|cool|next]                   look emulation. defaults to gtk\n" \
 	    "--[no-]bright-invert                     invert the brightness of all colours\n" \
@@ -497,6 +500,8 @@ struct prog_options cooledit_options[] =
     {0, "", "--anti-aliasing", ARG_SET, 0, 0, &option_aa_font},
     {0, "", "--no-anti-aliasing", ARG_CLEAR, 0, 0, &option_aa_font},
     {0, "", "--interchar-spacing", ARG_INT, 0, 0, &option_interchar_spacing},
+    {0, "", "--font-cache-kb", ARG_INT, 0, 0, &option_font_cache_kb},
+    {0, "", "--frame-ms", ARG_INT, 0, 0, &option_frame_ms},
     {0, "", "--edit-bg", ARG_INT, 0, 0, &option_editor_bg_normal},
     {0, "", "--interwidget-spacing", ARG_INT, 0, 0, &option_interwidget_spacing},
     {0, "", "--look", ARG_STRING, &option_look, 0, 0},
@@ -1271,11 +1276,14 @@ void exit_app (unsigned long save)
     free_all_lists ();
     load_setup (0);
     catstrs_clean ();
-    edit_free_cache_lines ();
     postscript_clean ();
     get_cmdline_options_free_list (&cmdline_fl);
     inspect_clean_exit ();
+    if (option_verbose)
+	CFramePrintStats ();
 #ifndef NO_TTF
+    if (option_verbose)
+	XAaCachePrintStats ();
     XAaCacheClean ();
 #endif
     exit (0);
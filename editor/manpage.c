@@ -343,7 +343,7 @@ void Ctextboxsearch (CWidget * w, int again)
    the stripped text */
 	    search_start = strmovelines (s.data, w->current, 1, 32000);
 	    t = str_strip_nroff (s.data + search_start, &l);
-	    search_start = edit_find (0, exp, &len, l, (int (*)(void *, long)) text_get_byte, (void *) t, 0);
+	    search_start = edit_find (0, exp, &len, l, (int (*)(void *, long)) text_get_byte, 0, (void *) t, 0);
 	    if (search_start == -3) {
 		CErrorDialog (w->mainid, 20, 20, _(" Error "), _(" Invalid regular expression. "));
 	    } else if (search_start >= 0) {
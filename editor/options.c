@@ -42,6 +42,7 @@ extern int option_locale_encoding;
 extern int option_reverse_levant;
 extern int option_rgb_order;
 extern int option_interchar_spacing;
+extern int option_font_cache_kb;
 extern int option_file_browser_width;
 extern int option_file_browser_height;
 extern int option_shell_command_line_sticky;
@@ -66,8 +67,10 @@ extern int option_mouse_double_click;
 extern int option_middle_button_pastes;
 extern int option_syntax_highlighting;
 extern int option_auto_spellcheck;
+extern int option_syntax_background;
 
 extern int option_smooth_scrolling;
+extern int option_copy_scrolling;
 
 extern int option_new_window_ask_for_file;
 
@@ -177,6 +180,9 @@ static struct {
 	{"last_unichar_right", &last_unichar_right, 0, TYPE_HIDDEN_VALUE},
 	{"option_rgb_order", &option_rgb_order, 0, TYPE_HIDDEN_VALUE},
 	{"option_interchar_spacing", &option_interchar_spacing, 0, TYPE_HIDDEN_VALUE},
+	{"option_font_cache_kb", &option_font_cache_kb, 0, TYPE_HIDDEN_VALUE},
+	{"option_copy_scrolling", &option_copy_scrolling, 0, TYPE_HIDDEN_VALUE},
+	{"option_frame_ms", &option_frame_ms, 0, TYPE_HIDDEN_VALUE},
 	{"option_file_browser_width", &option_file_browser_width, 0, TYPE_HIDDEN_VALUE},
 	{"option_file_browser_height", &option_file_browser_height, 0, TYPE_HIDDEN_VALUE},
 	{"option_shell_command_line_sticky", &option_shell_command_line_sticky, 0, TYPE_HIDDEN_VALUE},
@@ -215,6 +221,7 @@ static struct {
 	{"option_color_26", &option_color_26, 0, TYPE_HIDDEN_HEX_VALUE},
 	{"option_syntax_highlighting", &option_syntax_highlighting, 0, 0},
 	{"option_auto_spellcheck", &option_auto_spellcheck, 0, 0},
+	{"option_syntax_background", &option_syntax_background, 0, 0},
 	{0, 0}
 };
 
@@ -23,6 +23,7 @@
 /* #ifndef NO_TTF command-line options are dummy in this case */
 int option_rgb_order = RedFirst;
 int option_interchar_spacing = 0;
+int option_font_cache_kb = 32768;
 /* #endif */
 
 #ifndef NO_TTF
@@ -48,9 +49,14 @@ void _ZSt20__throw_system_errori(void)
  *
  * Situation is a list of aa fonts:
  * Each font is uniquified by a fg colour, a bg colour and a fontid.
- * Each font has FONT_LAST_UNICHAR pixmap glyphs.
- * The FONT_LAST_UNICHAR pixmaps are divided into 256 blocks.
+ * Each font has FONT_LAST_UNICHAR glyphs.
+ * The FONT_LAST_UNICHAR glyphs are divided into 256 blocks.
  * Each block is allocated on demand only.
+ * Glyphs are packed side by side into a few atlas pixmaps per font,
+ *                             rather than each having a pixmap of its own.
+ * FreeType glyphs are rasterised once per fontid into a grey-level
+ *                             coverage list. A new fg/bg pair only blends that
+ *                             coverage into pixels.
  * We *ImageString* only i.e. no DrawString - since requires knowledge
  *                             of the background which is complicated.
  */
@@ -89,48 +95,133 @@ void XAaCacheClean (void)
 }
 
 struct aa_glyph_cache {
-    Pixmap pixmap;
+    short x, y;			/* position within atlas[atlas] */
+    short atlas;
     short width;
     short descent;
+    char rendered;
+    char solid;			/* all background, so drawn as a filled rectangle */
 };
 
 #define NUM_GLYPH_BLOCKS        ((FONT_LAST_UNICHAR + 257) / 256)
 
+/* atlases grow by doubling their height up to this many pixels */
+#define AA_ATLAS_WIDTH          1024
+#define AA_ATLAS_MAX_HEIGHT     512
+#define AA_BYTES_PER_PIXEL      (aa_depth > 16 ? 4 : aa_depth > 8 ? 2 : 1)
+
 struct aa_font_cache {
     const struct aa_font *f;
     GC gc;
     unsigned long fg;
     unsigned long bg;
+    unsigned long bg_pixel;	/* bg as it comes out of blending, for solid glyphs */
     struct aa_glyph_cache *glyph[NUM_GLYPH_BLOCKS];
-    int num_pixmaps;
+    Pixmap *atlas;
+    int n_atlas;
+    int atlas_height;		/* of the last atlas */
+    int atlas_x, atlas_y;	/* where the next glyph goes in the last atlas */
+    long pixmap_bytes;
     int scale;
-    struct aa_font_cache *next;
-} *font_cache_list = 0;
+    struct aa_font_cache *prev, *next;	/* most recently drawn first */
+    struct aa_font_cache *hash_next;	/* same hash of load_id, fg and bg */
+    struct aa_font_cache *id_next;	/* same hash of load_id */
+};
+
+#define AA_HASH_SIZE            509
+#define AA_HASH(load_id, fg, bg) (((unsigned long) (load_id) * 7919UL + (fg) * 31UL + (bg)) % AA_HASH_SIZE)
+
+static struct aa_font_cache *font_cache_first = 0, *font_cache_last = 0;
+static struct aa_font_cache *font_cache_hash[AA_HASH_SIZE];
+static struct aa_font_cache *font_cache_id_hash[AA_HASH_SIZE];
+
+struct aa_cache_stats aa_cache_stats;
+
+/* the rasterised glyph before it is given a colour */
+struct aa_glyph_coverage {
+    short width;
+    short descent;
+    short height;
+    short grey_max;		/* grey levels run from 0 to this */
+    char loaded;
+    char color;			/* four bytes per pixel, r, g, b and grey, rather than one */
+    unsigned char *data;
+};
+
+struct aa_coverage_cache {
+    int load_id;
+    struct aa_glyph_coverage *glyph[NUM_GLYPH_BLOCKS];
+    struct aa_coverage_cache *next;
+} *coverage_cache_list = 0;
 
-static void aa_insert (void)
+static struct aa_glyph_coverage *aa_coverage_find (int load_id, unsigned long the_chr)
 {E_
-    struct aa_font_cache *p;
-    p = malloc (sizeof (*font_cache_list));
-    memset (p, 0, sizeof (*font_cache_list));
-    if (!font_cache_list) {
-	font_cache_list = p;
-    } else {
-	p->next = font_cache_list;
-	font_cache_list = p;
+    struct aa_coverage_cache *p;
+    int i;
+    for (p = coverage_cache_list; p; p = p->next)
+	if (p->load_id == load_id)
+	    break;
+    if (!p) {
+	p = malloc (sizeof (*p));
+	memset (p, 0, sizeof (*p));
+	p->load_id = load_id;
+	p->next = coverage_cache_list;
+	coverage_cache_list = p;
+    }
+    i = the_chr >> 8;
+    if (!p->glyph[i]) {
+	p->glyph[i] = malloc (256 * sizeof (struct aa_glyph_coverage));
+	memset (p->glyph[i], 0, 256 * sizeof (struct aa_glyph_coverage));
     }
+    return &p->glyph[i][the_chr & 0xFF];
 }
 
-static void aa_free (struct aa_font_cache *f)
+static void aa_coverage_remove (int load_id)
 {E_
+    struct aa_coverage_cache *p, **q;
     int i, j;
+    for (q = &coverage_cache_list; (p = *q); q = &p->next) {
+	if (p->load_id != load_id)
+	    continue;
+	*q = p->next;
+	for (i = 0; i < NUM_GLYPH_BLOCKS; i++) {
+	    if (p->glyph[i]) {
+		for (j = 0; j < 256; j++)
+		    if (p->glyph[i][j].data)
+			free (p->glyph[i][j].data);
+		free (p->glyph[i]);
+	    }
+	}
+	free (p);
+	return;
+    }
+}
+
+/* frees the atlases only. the glyph metrics stay, and glyphs are put back into new atlases when next drawn */
+static void aa_free_atlas (struct aa_font_cache *f)
+{E_
+    int i, j;
+    for (i = 0; i < f->n_atlas; i++)
+	XFreePixmap (aa_display, f->atlas[i]);
+    if (f->atlas)
+	free (f->atlas);
+    f->atlas = 0;
+    f->n_atlas = 0;
+    f->atlas_height = f->atlas_x = f->atlas_y = 0;
+    aa_cache_stats.pixmap_bytes -= f->pixmap_bytes;
+    f->pixmap_bytes = 0;
+    for (i = 0; i < NUM_GLYPH_BLOCKS; i++)
+	if (f->glyph[i])
+	    for (j = 0; j < 256; j++)
+		f->glyph[i][j].rendered = 0;
+}
+
+static void aa_free (struct aa_font_cache *f)
+{E_
+    int i;
+    aa_free_atlas (f);
     for (i = 0; i < NUM_GLYPH_BLOCKS; i++) {
 	if (f->glyph[i]) {
-	    for (j = 0; j < 256; j++) {
-		if (f->glyph[i][j].pixmap) {
-		    XFreePixmap (aa_display, f->glyph[i][j].pixmap);
-                    f->glyph[i][j].pixmap = 0;
-                }
-            }
 	    memset (f->glyph[i], 0, 256 * sizeof (struct aa_glyph_cache));
 	    free (f->glyph[i]);
             f->glyph[i] = NULL;
@@ -140,55 +231,177 @@ static void aa_free (struct aa_font_cache *f)
     free (f);
 }
 
-/* passing fg == bg == 0 finds any load_id */
+static void aa_lru_unlink (struct aa_font_cache *p)
+{E_
+    if (p->prev)
+	p->prev->next = p->next;
+    else
+	font_cache_first = p->next;
+    if (p->next)
+	p->next->prev = p->prev;
+    else
+	font_cache_last = p->prev;
+    p->prev = p->next = 0;
+}
+
+static void aa_lru_push (struct aa_font_cache *p)
+{E_
+    p->next = font_cache_first;
+    if (font_cache_first)
+	font_cache_first->prev = p;
+    else
+	font_cache_last = p;
+    font_cache_first = p;
+}
+
+static void aa_lru_touch (struct aa_font_cache *p)
+{E_
+    if (font_cache_first == p)
+	return;
+    aa_lru_unlink (p);
+    aa_lru_push (p);
+}
+
+/* frees the atlases of the least recently drawn fonts until X server memory is back within limit bytes */
+static void aa_evict_to (struct aa_font_cache *keep, long limit)
+{E_
+    struct aa_font_cache *p;
+    for (p = font_cache_last; p && aa_cache_stats.pixmap_bytes > limit; p = p->prev) {
+	if (p == keep || !p->n_atlas)
+	    continue;
+	aa_free_atlas (p);
+	aa_cache_stats.evictions++;
+    }
+}
+
+static void aa_evict (struct aa_font_cache *keep)
+{E_
+    if (option_font_cache_kb <= 0)
+	return;
+    aa_evict_to (keep, (long) option_font_cache_kb * 1024);
+}
+
+static void aa_atlas_bytes (struct aa_font_cache *f, long bytes)
+{E_
+    f->pixmap_bytes += bytes;
+    aa_cache_stats.pixmap_bytes += bytes;
+    if (aa_cache_stats.pixmap_bytes_peak < aa_cache_stats.pixmap_bytes)
+	aa_cache_stats.pixmap_bytes_peak = aa_cache_stats.pixmap_bytes;
+    aa_evict (f);
+}
+
+/* copies a rendered glyph image into the atlas, starting a new row, or a bigger or new atlas, when it does not fit */
+static void aa_atlas_put (struct aa_font_cache *f, XImage *image, int w, int h, struct aa_glyph_cache *glyph)
+{E_
+    Pixmap p;
+    int height;
+    if (w > AA_ATLAS_WIDTH)
+	w = AA_ATLAS_WIDTH;
+    if (f->n_atlas && f->atlas_x + w > AA_ATLAS_WIDTH) {
+	f->atlas_x = 0;
+	f->atlas_y += h;
+    }
+    if (!f->n_atlas || f->atlas_y + h > f->atlas_height) {
+	if (f->n_atlas && f->atlas_height * 2 <= AA_ATLAS_MAX_HEIGHT && f->atlas_y + h <= f->atlas_height * 2) {
+	    height = f->atlas_height * 2;
+	    p = XCreatePixmap (aa_display, aa_root, AA_ATLAS_WIDTH, height, aa_depth);
+	    XCopyArea (aa_display, f->atlas[f->n_atlas - 1], p, f->gc, 0, 0, AA_ATLAS_WIDTH, f->atlas_height, 0, 0);
+	    XFreePixmap (aa_display, f->atlas[f->n_atlas - 1]);
+	    f->atlas[f->n_atlas - 1] = p;
+	    aa_atlas_bytes (f, (long) AA_ATLAS_WIDTH * (height - f->atlas_height) * AA_BYTES_PER_PIXEL);
+	} else {
+	    Pixmap *t;
+	    height = h;
+	    if (!(t = realloc (f->atlas, (f->n_atlas + 1) * sizeof (Pixmap)))) {
+/* out of memory: the other fonts give up their atlases, and failing that
+   the glyph is left blank until it is next drawn */
+		aa_evict_to (f, 0);
+		if (!(t = realloc (f->atlas, (f->n_atlas + 1) * sizeof (Pixmap)))) {
+		    glyph->rendered = 0;
+		    glyph->solid = 1;
+		    return;
+		}
+	    }
+	    f->atlas = t;
+	    f->atlas[f->n_atlas++] = XCreatePixmap (aa_display, aa_root, AA_ATLAS_WIDTH, height, aa_depth);
+	    f->atlas_x = f->atlas_y = 0;
+	    aa_atlas_bytes (f, (long) AA_ATLAS_WIDTH * height * AA_BYTES_PER_PIXEL);
+	}
+	f->atlas_height = height;
+    }
+    XPutImage (aa_display, f->atlas[f->n_atlas - 1], f->gc, image, 0, 0, f->atlas_x, f->atlas_y, w, h);
+    glyph->atlas = f->n_atlas - 1;
+    glyph->x = f->atlas_x;
+    glyph->y = f->atlas_y;
+    glyph->rendered = 1;
+    glyph->solid = 0;
+    f->atlas_x += w;
+}
+
+static struct aa_font_cache *aa_insert (const struct aa_font *font, unsigned long fg, unsigned long bg)
+{E_
+    struct aa_font_cache *p;
+    unsigned long h;
+    p = malloc (sizeof (*p));
+    memset (p, 0, sizeof (*p));
+    p->f = font;
+    p->fg = fg;
+    p->bg = bg;
+    h = AA_HASH (font->load_id, fg, bg);
+    p->hash_next = font_cache_hash[h];
+    font_cache_hash[h] = p;
+    h = AA_HASH (font->load_id, 0, 0);
+    p->id_next = font_cache_id_hash[h];
+    font_cache_id_hash[h] = p;
+    aa_lru_push (p);
+    return p;
+}
+
 static struct aa_font_cache *aa_find (int load_id, unsigned long fg, unsigned long bg)
 {E_
     struct aa_font_cache *p;
-    for (p = font_cache_list; p; p = p->next)
-	if (load_id && p->f->load_id == load_id && p->fg == fg && p->bg == bg)
+    if (!load_id)
+	return 0;
+    for (p = font_cache_hash[AA_HASH (load_id, fg, bg)]; p; p = p->hash_next)
+	if (p->f->load_id == load_id && p->fg == fg && p->bg == bg)
 	    return p;
     return 0;
 }
 
-/* passing fg == bg == 0 finds any load_id */
+/* finds any colour of load_id */
 static struct aa_font_cache *aa_find_metrics_only (int load_id)
 {E_
     struct aa_font_cache *p;
-    for (p = font_cache_list; p; p = p->next)
-	if (load_id && p->f->load_id == load_id)
+    if (!load_id)
+	return 0;
+    for (p = font_cache_id_hash[AA_HASH (load_id, 0, 0)]; p; p = p->id_next)
+	if (p->f->load_id == load_id)
 	    return p;
     return 0;
 }
 
-/* returns zero on not found */
-static int _aa_remove (int load_id)
+static void aa_remove (int load_id)
 {E_
-    struct aa_font_cache *p, *q = 0;
-    for (p = font_cache_list; p; p = p->next) {
-	if (load_id && p->f->load_id == load_id) {
-	    if (p == font_cache_list) {
-		struct aa_font_cache *t;
-		t = font_cache_list->next;
-		aa_free (font_cache_list);
-		font_cache_list = t;
-		return 1;
-	    } else {
-		q->next = p->next;
-		aa_free (p);
-		return 1;
-	    }
+    struct aa_font_cache *p, **q;
+    int h;
+    for (h = 0; h < AA_HASH_SIZE; h++)
+	for (q = &font_cache_hash[h]; (p = *q);)
+	    if (p->f->load_id == load_id)
+		*q = p->hash_next;
+	    else
+		q = &p->hash_next;
+    for (q = &font_cache_id_hash[AA_HASH (load_id, 0, 0)]; (p = *q);) {
+	if (p->f->load_id == load_id) {
+	    *q = p->id_next;
+	    aa_lru_unlink (p);
+	    aa_free (p);
+	} else {
+	    q = &p->id_next;
 	}
-	q = p;
     }
-    return 0;
-}
-
-static void aa_remove (int load_id)
-{E_
-    while (_aa_remove (load_id));
+    aa_coverage_remove (load_id);
 }
 
-
 /* fifth level */
 /* 5 by 9/3 guassian convolution */
 static unsigned long aa_convolve_3 (int i, int j, unsigned char *source, int source_bytes_per_line,
@@ -235,7 +448,7 @@ static unsigned long aa_convolve_1 (int i, int j, unsigned char *source,
 }
 
 /* fourth level */
-static Pixmap aa_shrink_pixmap (struct aa_font_cache *f, Pixmap pixmap, int width, int height)
+static void aa_shrink_pixmap (struct aa_font_cache *f, Pixmap pixmap, int width, int height, struct aa_glyph_cache *glyph)
 {E_
     XImage *image, *shrunk;
     int i, j, w, h, bytes_per_pixel;
@@ -301,15 +514,13 @@ static Pixmap aa_shrink_pixmap (struct aa_font_cache *f, Pixmap pixmap, int widt
         }
     }
 
-    pixmap = XCreatePixmap (aa_display, aa_root, w, h, aa_depth);
-    XPutImage (aa_display, pixmap, f->gc, shrunk, 0, 0, 0, 0, w, h);
+    aa_atlas_put (f, shrunk, w, h, glyph);
     free (image->data);
     image->data = 0;
     XDestroyImage (image);
     free (shrunk->data);
     shrunk->data = 0;
     XDestroyImage (shrunk);
-    return pixmap;
 }
 
 /* third level */
@@ -333,7 +544,7 @@ static void aa_create_pixmap (struct aa_font_cache *f, int j, int i, struct aa_g
     XDrawImageString (aa_display, w, f->gc, 0, f->f->font_struct->ascent, "     ", 5);
 /* needed to clear the background if the function fails on non-existing chars */
     XDrawImageString16 (aa_display, w, f->gc, 0, f->f->font_struct->ascent, &c, 1);
-    glyph->pixmap = aa_shrink_pixmap (f, w, ch.width, height);
+    aa_shrink_pixmap (f, w, ch.width, height, glyph);
     XFreePixmap (aa_display, w);
 }
 
@@ -532,7 +743,8 @@ static const char *hex_chars[16][7] = {
 }};
 #endif
 
-static Pixmap aa_render_glyph (GC fgc, long font_fg, long font_bg, int dx, int dy, FT_Bitmap *bitmap, FT_Glyph_Metrics *metrics, int u_, int U_, int u, int U, int w, int h, int W, int H, int blank);
+static void aa_render_glyph (struct aa_glyph_coverage *cov, int dx, int dy, FT_Bitmap *bitmap, FT_Glyph_Metrics *metrics, int u_, int U_, int u, int U, int w, int h, int W, int H, int blank);
+static void aa_colorize_glyph (struct aa_font_cache *f, struct aa_glyph_coverage *cov, struct aa_glyph_cache *glyph);
 int load_one_freetype_font (FT_Face *face, const char *filename, int *desired_height, int *loaded_height);
 
 /* third level */
@@ -546,9 +758,21 @@ static void aa_create_pixmap_freetype (struct aa_font_cache *f, unsigned long th
 
     FT_Face face;
     FT_Glyph_Metrics *metrics;
+    struct aa_glyph_coverage *cov = 0;
 
     int error, dx = 0, dy = 0;
 
+/* rasterised already for some other colour? */
+    if (!metrics_only) {
+        cov = aa_coverage_find (f->f->load_id, the_chr);
+        if (cov->loaded) {
+            glyph->width = cov->width;
+            glyph->descent = cov->descent;
+            aa_colorize_glyph (f, cov, glyph);
+            return;
+        }
+    }
+
 #ifdef MAP_WINDOWS
   retry_with_windows_mapping:
 #endif
@@ -647,6 +871,10 @@ u = 1000000000;
 #endif
         glyph->width = 0;
         glyph->descent = 0;
+        if (cov) {
+            cov->loaded = 1;
+            glyph->rendered = glyph->solid = 1;
+        }
 
 #ifdef AA_LOG_LOAD_FONT
         assert (aa_log_nessage);
@@ -707,48 +935,28 @@ u = 1000000000;
     glyph->descent = (metrics->height - metrics->horiBearingY) * u / U / 64;
     dy = f->f->font_freetype.measured_ascent * U / u - metrics->horiBearingY / 64;
 
-    if (!metrics_only)
-        glyph->pixmap = aa_render_glyph (f->gc, f->fg, f->bg, dx, dy, &face->glyph->bitmap, metrics, u_, U_, u, U, w, h, W, H, the_chr == ' ');
+    if (!metrics_only) {
+        cov->width = glyph->width;
+        cov->descent = glyph->descent;
+        cov->loaded = 1;
+        aa_render_glyph (cov, dx, dy, &face->glyph->bitmap, metrics, u_, U_, u, U, w, h, W, H, the_chr == ' ');
+        aa_colorize_glyph (f, cov, glyph);
+    }
 }
 
 
-static Pixmap aa_render_glyph (GC fgc, long font_fg, long font_bg, int dx, int dy, FT_Bitmap *bitmap, FT_Glyph_Metrics *metrics, int u_, int U_, int u, int U, int w, int h, int W, int H, int blank)
+/* rasterises into grey levels only, so that the result serves every fg/bg pair */
+static void aa_render_glyph (struct aa_glyph_coverage *cov, int dx, int dy, FT_Bitmap *bitmap, FT_Glyph_Metrics *metrics, int u_, int U_, int u, int U, int w, int h, int W, int H, int blank)
 {E_
-    XImage *shrunk;
-    Pixmap pixmap;
+    unsigned char *p;
     int i, j;
-    int inverse = 0;
-    int red_shift, green_shift, blue_shift;
-    unsigned long red_mask, green_mask, blue_mask;
-    unsigned long r_bg, g_bg, b_bg;
-    unsigned long r_fg, g_fg, b_fg;
-
-/* create an image to put the reduced glyph into. round w and h up */
-    shrunk = XCreateImage (aa_display, aa_visual, aa_depth, ZPixmap, 0, 0, w, h, 8, 0);
-    shrunk->data = (char *) malloc (shrunk->bytes_per_line * h);
-    memset(shrunk->data, 0, shrunk->bytes_per_line * h);
-
-    for (red_mask = shrunk->red_mask, red_shift = 0; red_shift < 32 && !(red_mask & 1);
-        red_shift++, red_mask >>= 1);
-    for (green_mask = shrunk->green_mask, green_shift = 0; green_shift < 32 && !(green_mask & 1);
-        green_shift++, green_mask >>= 1);
-    for (blue_mask = shrunk->blue_mask, blue_shift = 0; blue_shift < 32 && !(blue_mask & 1);
-        blue_shift++, blue_mask >>= 1);
-
-    if (inverse) {
-        long sw;
-        sw = font_fg;
-        font_fg = font_bg;
-        font_bg = sw;
-    }
 
-    r_fg = ((font_fg >> red_shift) & red_mask);
-    g_fg = ((font_fg >> green_shift) & green_mask);
-    b_fg = ((font_fg >> blue_shift) & blue_mask);
-
-    r_bg = ((font_bg >> red_shift) & red_mask);;
-    g_bg = ((font_bg >> green_shift) & green_mask);
-    b_bg = ((font_bg >> blue_shift) & blue_mask);
+#ifdef FT_LOAD_COLOR
+    cov->color = (bitmap->pixel_mode == FT_PIXEL_MODE_BGRA);
+#endif
+    cov->height = h;
+    cov->grey_max = 1;
+    cov->data = (unsigned char *) malloc (w * h * (cov->color ? 4 : 1) + 1);
 
 /* if the glyph is trying to draw itself outside the bounds of the XImage then we constrain it to the furthest edge */
     if (dy > h * U / u - bitmap->rows)
@@ -763,22 +971,19 @@ static Pixmap aa_render_glyph (GC fgc, long font_fg, long font_bg, int dx, int d
 #define DECLM \
     unsigned long grey = 0; \
     unsigned long r, g, b; \
-    unsigned long pixel; \
     int ii, jj
 
 #define RGB(s) \
-    r = (r_fg * grey / (s)) + (r_bg * ((s) - grey) / (s)); \
-    g = (g_fg * grey / (s)) + (g_bg * ((s) - grey) / (s)); \
-    b = (b_fg * grey / (s)) + (b_bg * ((s) - grey) / (s)); \
-    pixel = (r << red_shift) | (g << green_shift) | (b << blue_shift); \
-    XPutPixel (shrunk, i, j, pixel)
+    (void) r; (void) g; (void) b; \
+    cov->grey_max = (s); \
+    cov->data[j * w + i] = grey
 
 #define RGBC \
-    r = (r * red_mask   + (255 - grey) * r_bg) / 255; \
-    g = (g * green_mask + (255 - grey) * g_bg) / 255; \
-    b = (b * blue_mask  + (255 - grey) * b_bg) / 255; \
-    pixel = (r << red_shift) | (g << green_shift) | (b << blue_shift); \
-    XPutPixel (shrunk, i, j, pixel)
+    p = &cov->data[(j * w + i) * 4]; \
+    p[0] = r; \
+    p[1] = g; \
+    p[2] = b; \
+    p[3] = grey
 
 #define BITM(s1,s7,s8) \
     do { \
@@ -1130,14 +1335,88 @@ for (j = 0; j < w; j++) {
         }
     }
 
-    pixmap = XCreatePixmap (aa_display, aa_root, w, h, aa_depth);
-    XPutImage (aa_display, pixmap, fgc, shrunk, 0, 0, 0, 0, w, h);
+    (void) p;
+}
+
+/* blends the grey levels between fg and bg and puts the result into the atlas */
+static void aa_colorize_glyph (struct aa_font_cache *f, struct aa_glyph_coverage *cov, struct aa_glyph_cache *glyph)
+{E_
+    XImage *shrunk;
+    unsigned char *p;
+    int i, j, w, h;
+    int red_shift, green_shift, blue_shift;
+    unsigned long red_mask, green_mask, blue_mask;
+    unsigned long r_bg, g_bg, b_bg;
+    unsigned long r_fg, g_fg, b_fg;
+    unsigned long r, g, b, grey, s, pixel[256];
+
+    w = cov->width;
+    h = cov->height;
+    if (!w || !cov->data) {
+	glyph->rendered = glyph->solid = 1;
+	return;
+    }
+
+/* create an image to put the reduced glyph into. round w and h up */
+    shrunk = XCreateImage (aa_display, aa_visual, aa_depth, ZPixmap, 0, 0, w, h, 8, 0);
+    shrunk->data = (char *) malloc (shrunk->bytes_per_line * h);
+    memset(shrunk->data, 0, shrunk->bytes_per_line * h);
+
+    for (red_mask = shrunk->red_mask, red_shift = 0; red_shift < 32 && !(red_mask & 1);
+        red_shift++, red_mask >>= 1);
+    for (green_mask = shrunk->green_mask, green_shift = 0; green_shift < 32 && !(green_mask & 1);
+        green_shift++, green_mask >>= 1);
+    for (blue_mask = shrunk->blue_mask, blue_shift = 0; blue_shift < 32 && !(blue_mask & 1);
+        blue_shift++, blue_mask >>= 1);
+
+    r_fg = ((f->fg >> red_shift) & red_mask);
+    g_fg = ((f->fg >> green_shift) & green_mask);
+    b_fg = ((f->fg >> blue_shift) & blue_mask);
+
+    r_bg = ((f->bg >> red_shift) & red_mask);;
+    g_bg = ((f->bg >> green_shift) & green_mask);
+    b_bg = ((f->bg >> blue_shift) & blue_mask);
+
+    f->bg_pixel = (r_bg << red_shift) | (g_bg << green_shift) | (b_bg << blue_shift);
+
+    if (cov->color) {
+	for (j = 0; j < h; j++) {
+	    for (i = 0; i < w; i++) {
+		p = &cov->data[(j * w + i) * 4];
+		grey = p[3];
+		r = (p[0] * red_mask   + (255 - grey) * r_bg) / 255;
+		g = (p[1] * green_mask + (255 - grey) * g_bg) / 255;
+		b = (p[2] * blue_mask  + (255 - grey) * b_bg) / 255;
+		XPutPixel (shrunk, i, j, (r << red_shift) | (g << green_shift) | (b << blue_shift));
+	    }
+	}
+    } else {
+	for (i = 0; i < w * h && !cov->data[i]; i++);
+	if (i == w * h) {
+/* all background, e.g. a space */
+	    glyph->rendered = glyph->solid = 1;
+	    free (shrunk->data);
+	    shrunk->data = 0;
+	    XDestroyImage (shrunk);
+	    return;
+	}
+	s = cov->grey_max;
+	for (grey = 0; grey <= s; grey++) {
+	    r = (r_fg * grey / s) + (r_bg * (s - grey) / s);
+	    g = (g_fg * grey / s) + (g_bg * (s - grey) / s);
+	    b = (b_fg * grey / s) + (b_bg * (s - grey) / s);
+	    pixel[grey] = (r << red_shift) | (g << green_shift) | (b << blue_shift);
+	}
+	for (j = 0; j < h; j++)
+	    for (i = 0; i < w; i++)
+		XPutPixel (shrunk, i, j, pixel[cov->data[j * w + i]]);
+    }
+
+    aa_atlas_put (f, shrunk, w, h, glyph);
 
     free (shrunk->data);
     shrunk->data = 0;
     XDestroyImage (shrunk);
-
-    return pixmap;
 }
 
 /* second level */
@@ -1159,7 +1438,7 @@ static void aa_create_pixmap_ (struct aa_font_cache *f, int j, int i, int metric
                 aa_create_pixmap (f, j, i, &f->glyph[j][i], 1);
         }
     } else {
-        if (!f->glyph[j][i].pixmap || f->glyph[j][i].width == -1) {
+        if (!f->glyph[j][i].rendered || f->glyph[j][i].width == -1) {
             if (f->f->font_freetype.n_fonts)
                 aa_create_pixmap_freetype (f, (j << 8) | i, &f->glyph[j][i], 0);
             else
@@ -1173,24 +1452,29 @@ int _XAaDrawImageStringWC (Display * display, Drawable d, GC gc, const struct aa
 {E_
     int i, x_start = x;
     int descent = -10240;
+    int height = 0, run_x = 0, run_width = 0, run_solid = 0, run_atlas = 0, run_src_x = 0, run_src_y = 0;
     struct aa_font_cache *f;
     XGCValues values_return;
 
     if (metrics_only) {
         f = aa_find_metrics_only(aa_font->load_id);
+        if (!f)
+            f = aa_insert (aa_font, 0, 0);
     } else {
         XGetGCValues (display, gc, GCForeground | GCBackground, &values_return);
         f = aa_find (aa_font->load_id, values_return.foreground, values_return.background);
+        if (f) {
+            aa_cache_stats.hits++;
+        } else {
+            aa_cache_stats.misses++;
+            f = aa_insert (aa_font, values_return.foreground, values_return.background);
+	    aa_display = display;
+        }
+        aa_lru_touch (f);
     }
 
-    if (!f) {
-	aa_insert ();
-	f = font_cache_list;
-	f->f = aa_font;
+    if (!f->scale)
         f->scale = scale;
-        if (!metrics_only)
-	    aa_display = display;
-    }
 
     if (!metrics_only) {
         assert(!f->gc || f->gc == gc);
@@ -1201,11 +1485,35 @@ int _XAaDrawImageStringWC (Display * display, Drawable d, GC gc, const struct aa
         f->bg = values_return.background;
     }
 
-    if (swc) {
+    if (!metrics_only) {
+        if (f->f->font_struct) {
+            height = SHRINK_HEIGHT (f->f->font_struct->ascent + f->f->font_struct->descent, scale);
+            y -= f->f->font_struct->ascent / scale;
+        } else {
+            height = f->f->font_freetype.measured_height;
+            y -= f->f->font_freetype.measured_ascent;
+        }
+    }
+
+/* glyphs that lie side by side in the same atlas, or that are all
+   background, are drawn together with one request */
+#define FLUSH_RUN \
+        do { \
+            if (run_width > 0) { \
+                if (run_solid) { \
+                    XSetForeground (display, gc, f->bg_pixel); \
+                    XFillRectangle (display, d, gc, run_x, y, run_width, height); \
+                    XSetForeground (display, gc, f->fg); \
+                } else { \
+	            XCopyArea (display, f->atlas[run_atlas], d, gc, run_src_x, run_src_y, run_width, height, run_x, y); \
+                } \
+            } \
+            run_width = 0; \
+        } while (0)
 
 #define XCOPYAREA_GLYPH(X,Y) \
         do { \
-            int page, width, height; \
+            int page, width; \
             unsigned char chr; \
             struct aa_glyph_cache *gl; \
             page = X; \
@@ -1215,19 +1523,25 @@ int _XAaDrawImageStringWC (Display * display, Drawable d, GC gc, const struct aa
             width = gl->width; \
             if (descent < (int) gl->descent) \
                 descent = (int) gl->descent; \
-            if (f->f->font_struct) \
-                height = SHRINK_HEIGHT (f->f->font_struct->ascent + f->f->font_struct->descent, scale); \
-            else \
-                height = f->f->font_freetype.measured_height; \
             if (width && !metrics_only) { \
-                if (f->f->font_struct) \
-	            XCopyArea (display, gl->pixmap, d, gc, 0, 0, width, height, x, y - f->f->font_struct->ascent / scale); \
-                else \
-	            XCopyArea (display, gl->pixmap, d, gc, 0, 0, width, height, x, y - f->f->font_freetype.measured_ascent); \
+                if (width > AA_ATLAS_WIDTH) \
+                    width = AA_ATLAS_WIDTH; \
+                if (!(run_width > 0 && run_x + run_width == x && run_solid == gl->solid \
+                      && (gl->solid || (run_atlas == gl->atlas && run_src_y == gl->y && run_src_x + run_width == gl->x)))) { \
+                    FLUSH_RUN; \
+                    run_x = x; \
+                    run_solid = gl->solid; \
+                    run_atlas = gl->atlas; \
+                    run_src_x = gl->x; \
+                    run_src_y = gl->y; \
+                } \
+                run_width += width; \
+                width = gl->width; \
             } \
 	    x += width; \
         } while (0)
 
+    if (swc) {
 	for (i = 0; i < length; i++) {
             unsigned int c = swc[i];
             if (c <= FONT_LAST_UNICHAR) {
@@ -1243,6 +1557,8 @@ int _XAaDrawImageStringWC (Display * display, Drawable d, GC gc, const struct aa
             XCOPYAREA_GLYPH(0, (unsigned char) s[i]);
 	}
     }
+    if (!metrics_only)
+        FLUSH_RUN;
     if (descent_r)
         *descent_r = descent;
     return x - x_start;
@@ -1274,6 +1590,13 @@ void XAaFree (int load_id)
     aa_remove (load_id);
 }
 
+void XAaCachePrintStats (void)
+{E_
+    printf ("font cache: %lu hits, %lu misses, %lu evictions, %ld pixmap bytes (peak %ld, limit %dkB)\n",
+	    aa_cache_stats.hits, aa_cache_stats.misses, aa_cache_stats.evictions,
+	    aa_cache_stats.pixmap_bytes, aa_cache_stats.pixmap_bytes_peak, option_font_cache_kb);
+}
+
 #endif
 
 
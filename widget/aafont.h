@@ -11,6 +11,17 @@ void XAaFree (int load_id);
 
 void XAaInit (Display * display, Visual * visual, int depth, Window root);
 void XAaCacheClean (void);
+void XAaCachePrintStats (void);
+
+struct aa_cache_stats {
+    unsigned long hits;		/* string draws that found their font and colours cached */
+    unsigned long misses;
+    unsigned long evictions;	/* atlases freed to stay within option_font_cache_kb */
+    long pixmap_bytes;		/* X server memory held by atlases */
+    long pixmap_bytes_peak;
+};
+
+extern struct aa_cache_stats aa_cache_stats;
 
 int XAaTextWidth (const struct aa_font *f, const char *s, int length, int *descent, int scale);
 
@@ -26,6 +37,7 @@ int XAaDrawImageString16 (Display * display, Drawable d, GC gc, const struct aa_
 #define BlueFirst 1
 
 extern int option_interchar_spacing;
+extern int option_font_cache_kb;
 extern int option_rgb_order;
 
 
@@ -243,5 +243,23 @@ void book_mark_dec (WEdit * edit, int line)
 #endif
 }
 
+/* same as n calls to book_mark_inc(), or -n calls to book_mark_dec() */
+void book_mark_shift (WEdit * edit, int line, long n)
+{E_
+    int rend = 0;
+    if (edit->book_mark && n) {
+	struct _book_mark *p;
+	p = book_mark_find (edit, line);
+	for (p = p->next; p; p = p->next) {
+	    p->line = n > 0 ? p->line + n : max (line, p->line + n);
+	    rend = 1;
+	}
+    }
+#if !defined (GTK) && !defined (MIDNIGHT)
+    if (rend)
+	render_scrollbar (edit->widget->vert_scrollbar);
+#endif
+}
+
 
 
@@ -112,7 +112,7 @@ int edit_draw_proportional (void *data,
 	                        converttext_cb_t converttext,
 	                        calctextpos_cb_t calctextpos,
 				int scroll_right,
-				Window win,
+				CWidget * w,
 				int x_max,
 				long b,
 				int row,
@@ -121,6 +121,9 @@ int edit_draw_proportional (void *data,
 				int tabwidth,
                                 struct _book_mark **book_marks,
                                 int n_book_marks);
+void edit_draw_proportional_invalidate (CWidget * w, int row_start, int row_end, int x_max);
+int edit_draw_proportional_shift (CWidget * w, int rows, int h, int x_max);
+void edit_free_line_cache (CWidget * w);
 
 
 #endif				/* ! COOLLOCAL_H */
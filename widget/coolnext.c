@@ -490,6 +490,93 @@ static void pop_all_regions (Window w)
 /* }}} end expose amalgamation stack system */
 
 
+/* {{{ frame scheduler */
+
+/*
+   Widgets that have changed ask for a repaint with CScheduleRender ()
+   instead of drawing straight away. Pending repaints are done together
+   just before the event loop would wait, or on the next tick if events
+   keep coming, and never sooner than option_frame_ms after the last
+   frame. Key repeat or fast shell output then paints one frame for
+   many events.
+ */
+
+int option_frame_ms = 16;
+
+#define MAX_PENDING_FRAMES	64
+
+static struct pending_frame {
+    Window win;
+    void (*render) (CWidget *);
+} pending_frames[MAX_PENDING_FRAMES];
+static int n_pending_frames = 0;
+static struct timeval last_frame;
+
+/* painting time of each frame, bucket i counts frames of less than 2^i milliseconds */
+#define FRAME_HISTOGRAM_BUCKETS	12
+static unsigned long frame_histogram[FRAME_HISTOGRAM_BUCKETS];
+
+static long frame_ms_since (struct timeval *t)
+{E_
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_usec - t->tv_usec) / 1000;
+}
+
+void CRenderFrames (void)
+{E_
+    struct pending_frame f[MAX_PENDING_FRAMES];
+    CWidget *w;
+    int i, n;
+    long ms;
+    if (!n_pending_frames)
+	return;
+    gettimeofday (&last_frame, 0);
+/* a render may ask for another frame */
+    n = n_pending_frames;
+    memcpy (f, pending_frames, n * sizeof (struct pending_frame));
+    n_pending_frames = 0;
+    for (i = 0; i < n; i++)
+	if ((w = CWidgetOfWindow (f[i].win)))
+	    (*f[i].render) (w);
+    ms = frame_ms_since (&last_frame);
+    for (i = 0; i < FRAME_HISTOGRAM_BUCKETS - 1 && ms >= (1L << i); i++);
+    frame_histogram[i]++;
+}
+
+/* w is repainted by render at the next frame, once however often this is called before then */
+void CScheduleRender (CWidget * w, void (*render) (CWidget *))
+{E_
+    int i;
+    for (i = 0; i < n_pending_frames; i++)
+	if (pending_frames[i].win == w->winid && pending_frames[i].render == render)
+	    return;
+    if (n_pending_frames == MAX_PENDING_FRAMES)
+	CRenderFrames ();
+    pending_frames[n_pending_frames].win = w->winid;
+    pending_frames[n_pending_frames].render = render;
+    n_pending_frames++;
+}
+
+static void render_frames_when_due (void)
+{E_
+    if (n_pending_frames && frame_ms_since (&last_frame) >= option_frame_ms)
+	CRenderFrames ();
+}
+
+void CFramePrintStats (void)
+{E_
+    int i;
+    printf ("frame times:");
+    for (i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++)
+	if (frame_histogram[i])
+	    printf (" %s%ldms:%lu", i == FRAME_HISTOGRAM_BUCKETS - 1 ? ">=" : "<", i == FRAME_HISTOGRAM_BUCKETS - 1 ? (1L << (i - 1)) : (1L << i), frame_histogram[i]);
+    printf ("\n");
+}
+
+/* }}} end frame scheduler */
+
+
 /* {{{ key conversion utilities */
 
 /* xim.c */
@@ -1182,8 +1269,10 @@ void CNextEvent_check_font (XEvent * xevent, CEvent * cwevent)
 	cwevent = &private_cwevent;
     }
 
-    if (!CPending ())		/* flush output; check if events */
+    if (!CPending ()) {		/* flush output; check if events */
+	render_frames_when_due ();
 	pop_all_regions (0);	/* just make sure not outstanding exposes */
+    }
     while (!pop_event (xevent)) {	/* first check our own events, if none of our own coming, _then_ we look at the server */
 	if (QLength (CDisplay)) {
 	    memset (xevent, 0, sizeof (XEvent));
@@ -1231,6 +1320,7 @@ printf("event type=%d\n", type);
 
     switch (type) {
     case TickEvent:
+	render_frames_when_due ();
 	if (idle == 1)		/* this will XSync at the end of a burst of events */
 	    XSync (CDisplay, 0);	/* this, dnd.c and CKeyPending above are the only places in the library where XSync is called */
 	if (button_repeat_count++ > 10)
@@ -1244,6 +1334,7 @@ printf("event type=%d\n", type);
 		toolhint_window = 0;
 	    }
 	}
+	edit_syntax_tick ();
 	idle++;
 	return;
     case AlarmEvent:
@@ -1263,6 +1354,16 @@ printf("event type=%d\n", type);
     case MappingNotify:
 	XRefreshKeyboardMapping (&(xevent->xmapping));
 	break;
+    case GraphicsExpose:
+/* the part of a scroll-by-copy whose source was obscured: the same fields as an Expose, in destination coordinates */
+	xevent->type = Expose;
+	xevent->xexpose.window = xevent->xgraphicsexpose.drawable;
+	xevent->xexpose.x = xevent->xgraphicsexpose.x;
+	xevent->xexpose.y = xevent->xgraphicsexpose.y;
+	xevent->xexpose.width = xevent->xgraphicsexpose.width;
+	xevent->xexpose.height = xevent->xgraphicsexpose.height;
+	xevent->xexpose.count = xevent->xgraphicsexpose.count;
+	/* fall through */
     case Expose:{
 	    XEvent eev;
 	    memset(&eev, '\0', sizeof(eev));
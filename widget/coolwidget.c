@@ -1024,6 +1024,7 @@ and the one before last is Merp: */
 	    free (w->graphic);
 	if (w->tab)
 	    free (w->tab);
+	edit_free_line_cache (w);
 	if (w->destroy)
 	    (*(w->destroy)) (CIndex (i));
 	CStr_free (&(w->text));    /* for input history, this must come 
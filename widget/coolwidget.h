@@ -465,6 +465,7 @@ struct cool_widget {
     XIC input_context;
     void *rxvt;
     Pixmap pixmap_mask;
+    struct line_cache *line_cache;	/* rows as last drawn by edit_draw_proportional() */
 
 /* for debugging */
     u_32bit_t magic_end;
@@ -801,6 +802,13 @@ void CNextEvent (XEvent * xevent, CEvent * cwevent);
 
 int CExposePending (Window w, XEvent * ev);
 
+/* repaint w with render at the next frame, see coolnext.c */
+void CScheduleRender (CWidget * w, void (*render) (CWidget *));
+/* do all scheduled repaints now */
+void CRenderFrames (void);
+void CFramePrintStats (void);
+extern int option_frame_ms;
+
 /* Any events left? */
 int CPending (void);
 
@@ -21,6 +21,13 @@
 #	include <sys/timeb.h>
 #endif /* SCO_FLAVOR */
 #include <time.h>	/* for ctime() */
+#ifndef MSWIN
+#	include <sys/mman.h>
+#	include <signal.h>
+#endif
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
 
 /*
  *
@@ -77,6 +84,145 @@ int edit_get_byte (WEdit * edit, long byte_index)
 
 #endif
 
+/*
+   Block-aware access: returns a pointer to the byte at offset and sets
+   *len to the number of bytes from there to the end of the file that
+   are contiguous in memory. Lets scanning loops run memchr() and friends
+   over whole blocks instead of calling edit_get_byte() per byte. offset
+   must be within 0 .. last_byte - 1.
+ */
+unsigned char *edit_get_span (WEdit * edit, long offset, long *len)
+{E_
+    unsigned long p;
+    if (offset >= edit->curs1) {
+	p = edit->curs1 + edit->curs2 - offset - 1;
+	*len = (p & M_EDIT_BUF_SIZE) + 1;
+	return edit->buffers2[p >> S_EDIT_BUF_SIZE] + EDIT_BUF_SIZE - (p & M_EDIT_BUF_SIZE) - 1;
+    }
+    *len = EDIT_BUF_SIZE - (offset & M_EDIT_BUF_SIZE);
+    if (*len > edit->curs1 - offset)
+	*len = edit->curs1 - offset;
+    return edit->buffers1[offset >> S_EDIT_BUF_SIZE] + (offset & M_EDIT_BUF_SIZE);
+}
+
+/* same as edit_get_span but *len counts the contiguous bytes going backward, from offset down */
+unsigned char *edit_get_span_back (WEdit * edit, long offset, long *len)
+{E_
+    unsigned long p;
+    if (offset >= edit->curs1) {
+	p = edit->curs1 + edit->curs2 - offset - 1;
+	*len = EDIT_BUF_SIZE - (p & M_EDIT_BUF_SIZE);
+	if (*len > offset - edit->curs1 + 1)
+	    *len = offset - edit->curs1 + 1;
+	return edit->buffers2[p >> S_EDIT_BUF_SIZE] + EDIT_BUF_SIZE - (p & M_EDIT_BUF_SIZE) - 1;
+    }
+    *len = (offset & M_EDIT_BUF_SIZE) + 1;
+    return edit->buffers1[offset >> S_EDIT_BUF_SIZE] + (offset & M_EDIT_BUF_SIZE);
+}
+
+/* copies the bytes from start up to but not including finish into text */
+void edit_get_text (WEdit * edit, long start, long finish, unsigned char *text)
+{E_
+    unsigned char *p;
+    long len;
+    while (start < finish) {
+	p = edit_get_span (edit, start, &len);
+	if (len > finish - start)
+	    len = finish - start;
+	memcpy (text, p, len);
+	text += len;
+	start += len;
+    }
+}
+
+/* counts the newlines in len contiguous bytes */
+static long count_newlines (const unsigned char *p, long len)
+{E_
+    long n = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8 ('\n');
+    while (len >= 16) {
+	__m128i acc = _mm_setzero_si128 ();
+	int i;
+/* each byte lane of acc can count up to 255 before it must be summed */
+	for (i = 0; i < 255 && len >= 16; i++, p += 16, len -= 16)
+	    acc = _mm_sub_epi8 (acc, _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) p), nl));
+	acc = _mm_sad_epu8 (acc, _mm_setzero_si128 ());
+	n += _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+    }
+#endif
+    while (len-- > 0)
+	n += (*p++ == '\n');
+    return n;
+}
+
+/* returns the number of newlines from offset current up to but not including upto */
+long edit_count_newlines (WEdit * edit, long current, long upto)
+{E_
+    long lines = 0, len;
+    unsigned char *p;
+    while (current < upto) {
+	p = edit_get_span (edit, current, &len);
+	if (len > upto - current)
+	    len = upto - current;
+	lines += count_newlines (p, len);
+	current += len;
+    }
+    return lines;
+}
+
+#if defined(__GLIBC__)
+#define edit_memrchr memrchr
+#else
+static void *edit_memrchr (const void *s, int c, size_t n)
+{E_
+    const unsigned char *p = (const unsigned char *) s + n;
+    while (n--)
+	if (*--p == (unsigned char) c)
+	    return (void *) p;
+    return NULL;
+}
+#endif
+
+/* returns the offset of the n'th newline at or after current, or last_byte if there are fewer */
+static long edit_find_newline (WEdit * edit, long current, long n)
+{E_
+    unsigned char *p, *q;
+    long len;
+    while (current < edit->last_byte) {
+	p = edit_get_span (edit, current, &len);
+	while ((q = memchr (p, '\n', len))) {
+	    if (!--n)
+		return current + (q - p);
+	    q++;
+	    len -= q - p;
+	    current += q - p;
+	    p = q;
+	}
+	current += len;
+    }
+    return edit->last_byte;
+}
+
+/* returns the offset of the n'th newline before current, or -1 if there are fewer */
+static long edit_find_newline_back (WEdit * edit, long current, long n)
+{E_
+    unsigned char *p, *q;
+    long len;
+    while (current > 0) {
+	p = edit_get_span_back (edit, current - 1, &len);
+	p -= len - 1;
+	while ((q = edit_memrchr (p, '\n', len))) {
+	    if (!--n)
+		return current - len + (q - p);
+	    current -= len - (q - p);
+	    len = q - p;
+	}
+	current -= len;
+    }
+    return -1;
+}
+
 char *edit_get_buffer_as_text (WEdit * e)
 {E_
     int l, i;
@@ -127,24 +273,236 @@ char *edit_get_current_line_as_text (WEdit * e, long *length, long *cursor)
    CRLF->LF translation or if we were reading from a pipe.
  */
 
+/* Buffer table routines */
+
+/* makes sure that slot i exists in a buffers1[] or buffers2[] table and its line
+   index. The old tables are only freed once the new ones are filled in. */
+static void edit_extend_buffers (unsigned char ***buffers, long **lines, long *n_buffers, long i)
+{E_
+    unsigned char **b;
+    long n, *l;
+    if (i < *n_buffers)
+	return;
+    for (n = *n_buffers ? *n_buffers : 16; n <= i; n <<= 1);
+    b = (unsigned char **) CMalloc (n * sizeof (unsigned char *));
+    l = (long *) CMalloc (n * sizeof (long));
+    if (*n_buffers) {
+	memcpy (b, *buffers, *n_buffers * sizeof (unsigned char *));
+	memcpy (l, *lines, *n_buffers * sizeof (long));
+    }
+    memset (b + *n_buffers, '\0', (n - *n_buffers) * sizeof (unsigned char *));
+    memset (l + *n_buffers, '\0', (n - *n_buffers) * sizeof (long));
+    if (*buffers)
+	free (*buffers);
+    if (*lines)
+	free (*lines);
+    *buffers = b;
+    *lines = l;
+    *n_buffers = n;
+}
+
+static inline unsigned char *edit_new_buffer1 (WEdit * edit, long i)
+{E_
+    edit_extend_buffers (&edit->buffers1, &edit->lines1, &edit->n_buffers1, i);
+    return edit->buffers1[i] = CMalloc (EDIT_BUF_SIZE);
+}
+
+static inline unsigned char *edit_new_buffer2 (WEdit * edit, long i)
+{E_
+    edit_extend_buffers (&edit->buffers2, &edit->lines2, &edit->n_buffers2, i);
+    return edit->buffers2[i] = CMalloc (EDIT_BUF_SIZE);
+}
+
+/*
+   Line index: lines1[j] is the number of newlines before offset
+   j * EDIT_BUF_SIZE and is valid for j <= (curs1 >> S_EDIT_BUF_SIZE).
+   lines2[j] is the number of newlines in the last j * EDIT_BUF_SIZE
+   bytes of the file and is valid for j <= (curs2 >> S_EDIT_BUF_SIZE).
+   Since text only ever changes at the cursor, the entries need only be
+   recorded when the cursor crosses a block boundary, which is done by
+   these two:
+ */
+static inline void edit_index_lines1 (WEdit * edit)
+{E_
+    if (!(edit->curs1 & M_EDIT_BUF_SIZE)) {
+	edit_extend_buffers (&edit->buffers1, &edit->lines1, &edit->n_buffers1, edit->curs1 >> S_EDIT_BUF_SIZE);
+	edit->lines1[edit->curs1 >> S_EDIT_BUF_SIZE] = edit->curs_line;
+    }
+}
+
+static inline void edit_index_lines2 (WEdit * edit)
+{E_
+    if (!(edit->curs2 & M_EDIT_BUF_SIZE)) {
+	edit_extend_buffers (&edit->buffers2, &edit->lines2, &edit->n_buffers2, edit->curs2 >> S_EDIT_BUF_SIZE);
+	edit->lines2[edit->curs2 >> S_EDIT_BUF_SIZE] = edit->total_lines - edit->curs_line;
+    }
+}
+
+/* counts all the lines of a freshly loaded file and fills in lines2[] */
+static long edit_index_all_lines (WEdit * edit)
+{E_
+    long j, top, lines = 0;
+    top = edit->curs2 >> S_EDIT_BUF_SIZE;
+    for (j = 0; j < top; j++) {
+	edit->lines2[j] = lines;
+	lines += count_newlines (edit->buffers2[j], EDIT_BUF_SIZE);
+    }
+    edit->lines2[top] = lines;
+    edit->lines1[0] = 0;
+    return lines + edit_count_newlines (edit, edit->curs1, edit->curs1 + (edit->curs2 & M_EDIT_BUF_SIZE));
+}
+
+#define BUFFER_IS_MAPPED(edit,b)	((edit)->mapped && (b) >= (edit)->mapped && (b) < (edit)->mapped + (edit)->mapped_len)
+
+/* buffers2[] blocks may point into the file mapping, so free through here */
+static inline void edit_free_buffer2 (WEdit * edit, long i)
+{E_
+    if (!BUFFER_IS_MAPPED (edit, edit->buffers2[i]))
+	free (edit->buffers2[i]);
+    edit->buffers2[i] = NULL;
+}
+
+#if !defined(MSWIN) && defined(MAP_ANONYMOUS) && defined(SA_SIGINFO)
+#define EDIT_MMAP
+
+/*
+   Another process may truncate a file while it is mapped, and the next
+   read of a block past the new end would then kill the editor with
+   SIGBUS. Instead the handler backs the faulting page with zeros, so
+   the lost text reads as nulls and the editor carries on, and marks the
+   edit stale so that it cannot be saved over the file. Faults outside
+   of the mappings listed here go to the previous handler.
+ */
+#define EDIT_MAX_MAPPINGS	64
+
+static struct edit_mapping {
+    unsigned char *p;
+    long len;
+    WEdit *edit;
+} edit_mappings[EDIT_MAX_MAPPINGS];
+static struct sigaction edit_old_sigbus;
+static long edit_page_size = 0;
+
+static void edit_sigbus (int sig, siginfo_t * info, void *context)
+{
+    unsigned char *a;
+    int i;
+    a = (unsigned char *) info->si_addr;
+    for (i = 0; i < EDIT_MAX_MAPPINGS; i++)
+	if (a >= edit_mappings[i].p && a < edit_mappings[i].p + edit_mappings[i].len)
+	    if (mmap ((void *) ((unsigned long) a & ~(edit_page_size - 1)), edit_page_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+		edit_mappings[i].edit->mapped_stale = 1;
+		return;
+	    }
+/* not ours: the instruction faults again under the old handler */
+    sigaction (SIGBUS, &edit_old_sigbus, NULL);
+}
+
+/* returns -1 if there are already too many files mapped */
+static int edit_mapping_add (WEdit * edit, unsigned char *p, long len)
+{E_
+    int i;
+    if (!edit_page_size) {
+	struct sigaction sa;
+	edit_page_size = sysconf (_SC_PAGESIZE);
+	memset (&sa, '\0', sizeof (sa));
+	sa.sa_sigaction = edit_sigbus;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset (&sa.sa_mask);
+	if (sigaction (SIGBUS, &sa, &edit_old_sigbus)) {
+	    edit_page_size = 0;
+	    return -1;
+	}
+    }
+    for (i = 0; i < EDIT_MAX_MAPPINGS; i++)
+	if (!edit_mappings[i].p) {
+	    edit_mappings[i].len = len;
+	    edit_mappings[i].edit = edit;
+	    edit_mappings[i].p = p;
+	    return 0;
+	}
+    return -1;
+}
+
+static void edit_mapping_remove (unsigned char *p)
+{E_
+    int i;
+    for (i = 0; i < EDIT_MAX_MAPPINGS; i++)
+	if (edit_mappings[i].p == p) {
+	    edit_mappings[i].p = NULL;
+	    edit_mappings[i].len = 0;
+	    edit_mappings[i].edit = NULL;
+	}
+}
+
+static void edit_munmap (WEdit * edit)
+{E_
+    edit_mapping_remove (edit->mapped);
+    munmap (edit->mapped, edit->mapped_len);
+    close (edit->mapped_fd);
+    edit->mapped = NULL;
+    edit->mapped_len = 0;
+}
+#endif
+
+/* gives every block still backed by the file mapping its own private copy
+   and drops the mapping. Must be called before the file is truncated or
+   overwritten in place. Returns -1, with the mapping kept, if memory
+   ran out, in which case the file must not be written in place. */
+int edit_unmap_file (WEdit * edit)
+{E_
+#ifdef EDIT_MMAP
+    long i;
+    if (!edit->mapped)
+	return 0;
+    for (i = 0; i < edit->n_buffers2; i++) {
+	if (BUFFER_IS_MAPPED (edit, edit->buffers2[i])) {
+	    unsigned char *b;
+	    if (!(b = malloc (EDIT_BUF_SIZE)))
+		return -1;
+	    memcpy (b, edit->buffers2[i], EDIT_BUF_SIZE);
+	    edit->buffers2[i] = b;
+	}
+    }
+    edit_munmap (edit);
+#endif
+    return 0;
+}
+
+/* returns 1 if the text may no longer be what was loaded: a page of the
+   mapping went missing, or another program wrote to the mapped file in
+   place, which unmodified pages of a private mapping still see. Saving
+   such text would put nulls or the other program's bytes into the file */
+int edit_mapped_file_changed (WEdit * edit)
+{E_
+#ifdef EDIT_MMAP
+    struct stat st;
+    if (edit->mapped && !fstat (edit->mapped_fd, &st)
+	&& (st.st_size != edit->mapped_stat.st_size || st.st_mtime != edit->mapped_stat.st_mtime))
+	edit->mapped_stale = 1;
+#endif
+    return edit->mapped_stale;
+}
+
 /* Initialisation routines */
 
 static int init_dynamic_edit_buffers_text (WEdit * edit, const char *host, const char *text)
 {E_
     long buf;
-    int buf2;
+    long buf2;
 
     edit->curs2 = edit->last_byte;
 
     buf2 = edit->curs2 >> S_EDIT_BUF_SIZE;
 
-    edit->buffers2[buf2] = CMalloc (EDIT_BUF_SIZE);
+    edit_new_buffer2 (edit, buf2);
 
     memcpy (edit->buffers2[buf2] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE), text, edit->curs2 & M_EDIT_BUF_SIZE);
     text += edit->curs2 & M_EDIT_BUF_SIZE;
 
     for (buf = buf2 - 1; buf >= 0; buf--) {
-        edit->buffers2[buf] = CMalloc (EDIT_BUF_SIZE);
+        edit_new_buffer2 (edit, buf);
         memcpy (edit->buffers2[buf], text, EDIT_BUF_SIZE);
         text += EDIT_BUF_SIZE;
     }
@@ -162,6 +520,7 @@ struct loader_data {
     long buf2;
     unsigned char *p;
     int done;
+    int opened;
 };
 
 static int edit_sock_reader (struct action_callbacks *o, const unsigned char *buf, int buflen, long long filelen, char *errmsg)
@@ -187,7 +546,7 @@ static int edit_sock_reader (struct action_callbacks *o, const unsigned char *bu
                 break;
             }
             ld->buf--;
-            ld->p = ld->edit->buffers2[ld->buf] = CMalloc (EDIT_BUF_SIZE);
+            ld->p = edit_new_buffer2 (ld->edit, ld->buf);
             ld->chunklen = 0;
         }
         *ld->p++ = *buf++;
@@ -199,6 +558,84 @@ static int edit_sock_reader (struct action_callbacks *o, const unsigned char *bu
     return 0;
 }
 
+/* only map files large enough that copying them in is noticeable */
+#define EDIT_MMAP_THRESHOLD	(16 * EDIT_BUF_SIZE)
+/* seconds a file must have gone unmodified to be mapped */
+#define EDIT_MMAP_SETTLE	2
+
+/*
+   For large local files, buffers2[] is pointed straight into a private
+   (copy-on-write) mapping of the file, so loading costs nothing and pages
+   are only copied when the cursor passes over them or they are edited.
+   The layout of buffers2[] is such that each full block is just a
+   contiguous piece of the file, the partial top block holding the first
+   bytes of the file is still copied into its own block since text gets
+   inserted before it. Returns -1 if the file could not be mapped, in
+   which case the caller falls back to reading it.
+ */
+static int init_dynamic_edit_buffers_mmap (WEdit * edit, const char *host, const char *filename)
+{E_
+#ifndef EDIT_MMAP
+    return -1;
+#else
+    struct stat st, st2;
+    long buf, top;
+    void *m;
+    int fd;
+
+    if (strcmp (host, REMOTEFS_LOCAL) || edit->last_byte < EDIT_MMAP_THRESHOLD)
+	return -1;
+    if ((fd = open (filename, O_RDONLY)) == -1)
+	return -1;
+/* a file that is still being written to, a log say, is read in instead */
+    if (fstat (fd, &st) || !S_ISREG (st.st_mode) || st.st_size != edit->last_byte || st.st_mtime + EDIT_MMAP_SETTLE > time (NULL)) {
+	close (fd);
+	return -1;
+    }
+    m = mmap (NULL, edit->last_byte, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED && (fstat (fd, &st2) || st2.st_size != st.st_size || st2.st_mtime != st.st_mtime || edit_mapping_add (edit, (unsigned char *) m, edit->last_byte))) {
+	munmap (m, edit->last_byte);
+	m = MAP_FAILED;
+    }
+    if (m == MAP_FAILED) {
+	close (fd);
+	return -1;
+    }
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    edit->mapped = (unsigned char *) m;
+    edit->mapped_fd = fd;
+    edit->mapped_len = edit->last_byte;
+    edit->mapped_stat = st;
+
+    edit->curs2 = edit->last_byte;
+    top = edit->curs2 >> S_EDIT_BUF_SIZE;
+
+    edit_new_buffer2 (edit, top);
+    memcpy (edit->buffers2[top] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE), edit->mapped, edit->curs2 & M_EDIT_BUF_SIZE);
+
+    for (buf = top - 1; buf >= 0; buf--)
+	edit->buffers2[buf] = edit->mapped + edit->last_byte - (buf + 1) * EDIT_BUF_SIZE;
+
+    edit->curs1 = 0;
+    return 0;
+#endif
+}
+
+/* readies the buffers to be filled by edit_sock_reader() */
+static void loader_init (struct loader_data *ld, WEdit * edit)
+{E_
+    edit->curs2 = edit->last_byte;
+
+    ld->edit = edit;
+    ld->buf2 = edit->curs2 >> S_EDIT_BUF_SIZE;
+    ld->buf = ld->buf2;
+
+    edit_new_buffer2 (edit, ld->buf);
+
+    ld->p = edit->buffers2[ld->buf2] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE);
+}
+
 static int init_dynamic_edit_buffers_file (WEdit * edit, const char *host, const char *filename)
 {E_
     char errmsg[REMOTEFS_ERR_MSG_LEN];
@@ -206,18 +643,13 @@ static int init_dynamic_edit_buffers_file (WEdit * edit, const char *host, const
     struct action_callbacks o;
     struct remotefs *u;
 
+    if (!init_dynamic_edit_buffers_mmap (edit, host, filename))
+	return 0;
+
     memset (&ld, '\0', sizeof (ld));
     memset (&o, '\0', sizeof (o));
 
-    edit->curs2 = edit->last_byte;
-
-    ld.edit = edit;
-    ld.buf2 = edit->curs2 >> S_EDIT_BUF_SIZE;
-    ld.buf = ld.buf2;
-
-    edit->buffers2[ld.buf] = CMalloc (EDIT_BUF_SIZE);
-
-    ld.p = edit->buffers2[ld.buf2] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE);
+    loader_init (&ld, edit);
 
     o.hook = (void *) &ld;
     o.sock_reader = edit_sock_reader;
@@ -237,14 +669,23 @@ static int init_dynamic_edit_buffers_file (WEdit * edit, const char *host, const
     return 0;
 }
 
-static int init_dynamic_edit_buffers (WEdit * edit, const char *host, const char *filename, const char *text)
+static void init_dynamic_edit_buffers_tables (WEdit * edit)
 {E_
-    int j;
+    edit->buffers1 = edit->buffers2 = NULL;
+    edit->lines1 = edit->lines2 = NULL;
+    edit->n_buffers1 = edit->n_buffers2 = 0;
+    edit->mapped = NULL;
+    edit->mapped_len = 0;
+    edit->mapped_stale = 0;
 
-    for (j = 0; j <= MAXBUFF; j++) {
-        edit->buffers1[j] = NULL;
-        edit->buffers2[j] = NULL;
-    }
+/* size the tables for the whole file up front */
+    edit_extend_buffers (&edit->buffers1, &edit->lines1, &edit->n_buffers1, edit->last_byte >> S_EDIT_BUF_SIZE);
+    edit_extend_buffers (&edit->buffers2, &edit->lines2, &edit->n_buffers2, edit->last_byte >> S_EDIT_BUF_SIZE);
+}
+
+static int init_dynamic_edit_buffers (WEdit * edit, const char *host, const char *filename, const char *text)
+{E_
+    init_dynamic_edit_buffers_tables (edit);
 
     if (filename)
         return init_dynamic_edit_buffers_file (edit, host, filename);
@@ -414,10 +855,65 @@ static int check_file_access (WEdit *edit, const char *host, const char *filenam
     return 0;
 }
 
+static int edit_sock_opened (struct action_callbacks *o, const struct portable_stat *st, char *errmsg)
+{E_
+    struct loader_data *ld;
+    WEdit *edit;
+
+    ld = (struct loader_data *) o->hook;
+    edit = ld->edit;
+
+    edit->stat = *st;
+    edit->test_file_on_disk_for_changes_m_time = edit->stat.ustat.st_mtime;
+    edit->last_byte = st->ustat.st_size;
+    init_dynamic_edit_buffers_tables (edit);
+    loader_init (ld, edit);
+    ld->opened = 1;
+    return 0;
+}
+
+/* A remote file is checked, stat'ed and read in one exchange with the
+   remote rather than three. */
+static int edit_open_remote_file (WEdit * edit, const char *host, const char *filename)
+{E_
+    char errmsg[REMOTEFS_ERR_MSG_LEN] = "";
+    struct loader_data ld;
+    struct action_callbacks o;
+    struct portable_stat st;
+    struct remotefs *u;
+
+    memset (&ld, '\0', sizeof (ld));
+    memset (&o, '\0', sizeof (o));
+
+    ld.edit = edit;
+    o.hook = (void *) &ld;
+    o.sock_reader = edit_sock_reader;
+    o.sock_opened = edit_sock_opened;
+
+    u = remotefs_lookup (host, NULL);
+    if ((*u->remotefs_openfile) (u, &o, filename, SIZE_LIMIT, &st, errmsg)) {
+        if (!ld.opened)
+            edit_error_dialog (_ (" Error "), errmsg);
+        else
+            edit_error_dialog (_(" Error "), catstrs (_(" Failed trying to open file for reading: "), filename, " \n [", errmsg, "]", NULL));
+        return 1;
+    }
+
+    if (ld.total != edit->last_byte) {
+        edit_error_dialog (_(" Error "), catstrs (_(" Failed trying to open file for reading: "), filename, " \n [", "File size changed while loading", "]", NULL));
+        return 1;
+    }
+
+    edit->curs1 = 0;
+    return 0;
+}
+
 /* returns 1 on error */
 static int edit_open_file (WEdit * edit, const char *host, const char *filename, const char *text, unsigned long text_size)
 {E_
     struct portable_stat st;
+    if (!text && strcmp (host, REMOTEFS_LOCAL))
+        return edit_open_remote_file (edit, host, filename);
     if (text) {
 	edit->last_byte = text_size;
 	filename = 0;
@@ -480,6 +976,9 @@ WEdit *edit_init (WEdit * edit, int lines, int columns, const char *filename, co
     edit->stat.ustat.st_gid = getgid ();
     edit->bracket = -1;
     edit->last_get_mb_rule = -2;
+    edit->last_get_rule = -1;
+    edit->syntax_dirty = LONG_MAX;
+    edit->syntax_plain = LONG_MAX;
     if (!dir)
 	dir = "";
     if (!host || !*host)
@@ -534,7 +1033,7 @@ WEdit *edit_init (WEdit * edit, int lines, int columns, const char *filename, co
     edit->stack_size_mask = START_STACK_SIZE - 1;
     edit->undo_stack = (struct undo_element *) malloc ((edit->stack_size + 10) * sizeof (struct undo_element));
     memset (edit->undo_stack, '\0', (edit->stack_size + 10) * sizeof (struct undo_element));
-    edit->total_lines = edit_count_lines (edit, 0, edit->last_byte);
+    edit->total_lines = edit_index_all_lines (edit);
     if (use_filter) {
 	struct portable_stat st;
 	push_action_disabled = 1;
@@ -564,23 +1063,50 @@ WEdit *edit_init (WEdit * edit, int lines, int columns, const char *filename, co
     return edit;
 }
 
+static void column_cache_free (WEdit * edit)
+{E_
+    int i;
+    for (i = 0; i < N_COLUMN_CACHES; i++) {
+	if (edit->column_cache[i].mark)
+	    free (edit->column_cache[i].mark);
+	if (edit->column_cache[i].x)
+	    free (edit->column_cache[i].x);
+    }
+}
+
 /* clear the edit struct, freeing everything in it. returns 1 on success */
 int edit_clean (WEdit * edit)
 {E_
     if (edit) {
-	int j = 0;
+	long j;
 	edit_free_syntax_rules (edit);
-	edit_get_wide_byte (edit, -1);
 	book_mark_flush (edit, -1);
-	for (; j <= MAXBUFF; j++) {
+	for (j = 0; j < edit->n_buffers1; j++)
 	    if (edit->buffers1[j] != NULL)
 		free (edit->buffers1[j]);
+	for (j = 0; j < edit->n_buffers2; j++)
 	    if (edit->buffers2[j] != NULL)
-		free (edit->buffers2[j]);
-	}
+		edit_free_buffer2 (edit, j);
+#ifdef EDIT_MMAP
+	if (edit->mapped)
+	    edit_munmap (edit);
+#endif
+	if (edit->buffers1)
+	    free (edit->buffers1);
+	if (edit->buffers2)
+	    free (edit->buffers2);
+	if (edit->lines1)
+	    free (edit->lines1);
+	if (edit->lines2)
+	    free (edit->lines2);
 
 	if (edit->undo_stack)
 	    free (edit->undo_stack);
+	if (edit->undo_text)
+	    free (edit->undo_text);
+	if (edit->mb_marker)
+	    free (edit->mb_marker);
+	column_cache_free (edit);
 	if (edit->filename)
 	    free (edit->filename);
 	if (edit->dir)
@@ -753,20 +1279,110 @@ void edit_push_action (WEdit * edit, int command, long param)
                 break;
             if (edit->stack_bottom == edit->stack_pointer) {
                 edit->stack_bottom = edit->stack_pointer = 0;
+                edit->undo_text_len = 0;
                 break;
             }
 	}
     }
 
 /*If a single key produced enough pushes to wrap all the way round then we would notice that the [stack_bottom] does not contain KEY_PRESS. The stack is then initialised: */
-    if (edit->undo_stack[edit->stack_bottom].command != KEY_PRESS)
+    if (edit->undo_stack[edit->stack_bottom].command != KEY_PRESS) {
 	edit->stack_bottom = edit->stack_pointer = 0;
+	edit->undo_text_len = 0;
+    }
 
   out:
     show_undo_stack (edit, "PUSH");
     return;
 }
 
+#define IS_RUN(c)	((c) == INSERT_AHEAD_RUN || (c) == INSERT_BEHIND_RUN)
+
+/* makes room in undo_text for n more bytes, first dropping the text of
+   runs that have fallen off the bottom of the stack. returns -1 if out of memory */
+static int edit_grow_undo_text (WEdit * edit, long n)
+{E_
+    unsigned long i;
+    long lo = edit->undo_text_len;
+
+    for (i = edit->stack_bottom; i != edit->stack_pointer; i = WMOD (i + 1))
+	if (IS_RUN (edit->undo_stack[i].command)) {
+	    lo = edit->undo_stack[i].param;
+	    break;
+	}
+    if (lo > 0) {
+	memmove (edit->undo_text, edit->undo_text + lo, edit->undo_text_len - lo);
+	edit->undo_text_len -= lo;
+	for (; i != edit->stack_pointer; i = WMOD (i + 1))
+	    if (IS_RUN (edit->undo_stack[i].command))
+		edit->undo_stack[i].param -= lo;
+    }
+    if (edit->undo_text_len + n > edit->undo_text_alloc / 2) {
+	unsigned char *t;
+	long alloc;
+	alloc = max (max (edit->undo_text_alloc, edit->undo_text_len + n) * 2, 4096);
+	t = realloc (edit->undo_text, alloc);
+	if (!t)
+	    return edit->undo_text_len + n > edit->undo_text_alloc ? -1 : 0;
+	edit->undo_text = t;
+	edit->undo_text_alloc = alloc;
+    }
+    return 0;
+}
+
+/*
+   Deleted characters are appended to a run in undo_text rather than
+   pushed as one INSERT_AHEAD/INSERT_BEHIND each, so deleting a large
+   block costs one undo element. A run extends from its param to the
+   start of the run above it, or to undo_text_len for the topmost run.
+ */
+static void edit_push_deleted_text (WEdit * edit, int command, const unsigned char *text, long n)
+{E_
+    unsigned long sp = edit->stack_pointer;
+    if (push_action_disabled)
+	return;
+    if (sp == edit->stack_bottom || edit->undo_stack[WMOD (sp - 1)].command != command) {
+	edit_push_action (edit, command, edit->undo_text_len);
+	if (edit->stack_pointer == edit->stack_bottom)
+	    return;
+    }
+    if (edit->undo_text_len + n > edit->undo_text_alloc && edit_grow_undo_text (edit, n)) {
+/* out of memory: the run cannot be undone, so neither can anything before it */
+	edit->stack_bottom = edit->stack_pointer = 0;
+	edit->undo_text_len = 0;
+	return;
+    }
+    memcpy (edit->undo_text + edit->undo_text_len, text, n);
+    edit->undo_text_len += n;
+}
+
+static inline void edit_push_deleted (WEdit * edit, int command, int c)
+{E_
+    unsigned char t = c;
+    edit_push_deleted_text (edit, command, &t, 1);
+}
+
+/* same as n calls to edit_push_action(), but adds to a REPEAT_COMMAND in one go */
+static void edit_push_actions (WEdit * edit, int command, long param, long n)
+{E_
+    struct undo_element *r, *c;
+    unsigned long sp;
+    if (push_action_disabled)
+	return;
+    for (; n > 0; n--) {
+	sp = edit->stack_pointer;
+	if (!push_action_disabled && n > 1 && sp != edit->stack_bottom && WMOD (sp - 1) != edit->stack_bottom) {
+	    r = &edit->undo_stack[WMOD (sp - 1)];
+	    c = &edit->undo_stack[WMOD (sp - 2)];
+	    if (r->command == REPEAT_COMMAND && c->command == command && c->param == param) {
+		r->param += n;
+		return;
+	    }
+	}
+	edit_push_action (edit, command, param);
+    }
+}
+
 /*
    TODO: if the user undos until the stack bottom, and the stack has not wrapped,
    then the file should be as it was when he loaded up. Then set edit->modified to 0.
@@ -799,31 +1415,154 @@ static struct undo_element pop_action (WEdit * edit)
     return c;
 }
 
+/* same as pop_action(), but takes all of a REPEAT_COMMAND at once, returning the count in *n */
+static struct undo_element pop_actions (WEdit * edit, long *n)
+{E_
+    unsigned long sp = edit->stack_pointer;
+    *n = 1;
+    if (sp != edit->stack_bottom && WMOD (sp - 1) != edit->stack_bottom
+	&& edit->undo_stack[WMOD (sp - 1)].command == REPEAT_COMMAND) {
+	*n = edit->undo_stack[WMOD (sp - 1)].param;
+	edit->stack_pointer = WMOD (sp - 2);
+        show_undo_stack (edit, "POP");
+	return edit->undo_stack[WMOD (sp - 2)];
+    }
+    return pop_action (edit);
+}
+
+static struct column_cache *column_cache_find (WEdit * edit, long bol, void *font, int tab)
+{E_
+    int i;
+    struct column_cache *c;
+    for (i = 0; i < N_COLUMN_CACHES; i++) {
+	c = &edit->column_cache[i];
+	if ((c->n_marks || c->n_x) && c->bol == bol) {
+	    if (c->font != font || c->tab != tab)
+		c->n_marks = c->n_x = 0;
+	    return c;
+	}
+    }
+    return 0;
+}
+
+/* returns the cache of the line at bol, taking over the oldest one if there is none */
+struct column_cache *edit_column_cache (WEdit * edit, long bol, void *font, int tab)
+{E_
+    struct column_cache *c;
+    c = column_cache_find (edit, bol, font, tab);
+    if (!c) {
+	c = &edit->column_cache[edit->column_cache_next];
+	edit->column_cache_next = (edit->column_cache_next + 1) % N_COLUMN_CACHES;
+	c->n_marks = c->n_x = 0;
+    }
+    c->bol = bol;
+    c->font = font;
+    c->tab = tab;
+    return c;
+}
+
+/* returns the last mark on the line at bol that is at or before both offset and x */
+struct column_mark *edit_column_mark (WEdit * edit, long bol, long offset, int x, void *font, int tab)
+{E_
+    struct column_cache *c;
+    int i, j, k;
+    c = column_cache_find (edit, bol, font, tab);
+    if (!c || !c->n_marks)
+	return 0;
+    for (i = -1, j = c->n_marks; j - i > 1;) {
+	k = (i + j) / 2;
+	if (c->mark[k].offset <= offset && c->mark[k].x <= x)
+	    i = k;
+	else
+	    j = k;
+    }
+    return i < 0 ? 0 : &c->mark[i];
+}
+
+/* marks must be added in order of offset along the line */
+void edit_column_mark_add (WEdit * edit, long bol, long offset, int x, void *font, int tab)
+{E_
+    struct column_cache *c;
+    c = edit_column_cache (edit, bol, font, tab);
+    if (c->n_marks && c->mark[c->n_marks - 1].offset >= offset)
+	return;
+    if (c->n_marks == c->marks_alloc) {
+	struct column_mark *t;
+/* without the mark the line is just measured from further back */
+	t = realloc (c->mark, (c->marks_alloc * 2 + 64) * sizeof (struct column_mark));
+	if (!t)
+	    return;
+	c->mark = t;
+	c->marks_alloc = c->marks_alloc * 2 + 64;
+    }
+    c->mark[c->n_marks].offset = offset;
+    c->mark[c->n_marks].x = x;
+    c->n_marks++;
+}
+
+/*
+   Only the line holding the change needs measuring again: lines after it
+   just move by delta bytes. Lines whose start was deleted are gone. A
+   multibyte character just before p may decode differently, so a line
+   ending within 8 bytes of p counts as holding it.
+ */
+static void column_cache_modification (WEdit * edit, long p, long delta)
+{E_
+    int i, j;
+    struct column_cache *c;
+    for (i = 0; i < N_COLUMN_CACHES; i++) {
+	c = &edit->column_cache[i];
+	if (!c->n_marks && !c->n_x)
+	    continue;
+	if (c->bol > p) {
+	    if (delta < 0 && c->bol <= p - delta) {
+		c->n_marks = c->n_x = 0;
+	    } else {
+		c->bol += delta;
+		for (j = 0; j < c->n_marks; j++)
+		    c->mark[j].offset += delta;
+	    }
+	    continue;
+	}
+	if (c->n_x > 0 && c->bol + c->n_x - 1 < p - 8)
+	    continue;
+/* the end of the line may have moved, so x[] is remeasured rather than trimmed */
+	c->n_x = 0;
+	while (c->n_marks && c->mark[c->n_marks - 1].offset > p - 8)
+	    c->n_marks--;
+    }
+}
+
 /* is called whenever a modification is made by one of the four routines below */
-static inline void appearance_modification (WEdit * edit, long p)
+static inline void appearance_modification (WEdit * edit, long p, long delta)
 {E_
     edit->screen_modified = 1;
-    if (edit->last_get_mb_rule > p - 1) {
-	edit->last_get_mb_rule = p - 1;
+    column_cache_modification (edit, p, delta);
+/* the decoder looks ahead up to six bytes, so states just before p may change too */
+    if (edit->last_get_mb_rule > p - 8 || (edit->n_mb_markers && edit->mb_marker[edit->n_mb_markers - 1].offset > p - 8)) {
+/* an invalidation still pending from an earlier modification may already reach lower */
+	if (!edit->mb_invalidate || edit->last_get_mb_rule > p - 8)
+	    edit->last_get_mb_rule = p - 8;
 	edit->mb_invalidate = 1;
     }
-    if (edit->last_get_mb_rule > p - 1) {
-	edit->last_get_rule = p - 1;
-	edit->syntax_invalidate = 1;
-    }
+    edit_syntax_modification (edit, p, delta);
 }
 
 /* is called whenever a modification is made by one of the four routines below */
-static inline void edit_modification (WEdit * edit, long p)
+static inline void edit_modification (WEdit * edit, long p, long delta)
 {E_
     edit->caches_valid = 0;
     edit->modified = 1;
-    appearance_modification (edit, p);
+    appearance_modification (edit, p, delta);
 }
 
 void edit_appearance_modification (WEdit * edit)
 {E_
-    appearance_modification (edit, 0);
+    int i;
+/* fonts and tab widths are checked on lookup, but other options may change the widths too */
+    for (i = 0; i < N_COLUMN_CACHES; i++)
+	edit->column_cache[i].n_marks = edit->column_cache[i].n_x = 0;
+    appearance_modification (edit, 0, 0);
 }
 
 /*
@@ -857,7 +1596,7 @@ void edit_insert (WEdit * edit, int c)
 	edit->force |= REDRAW_LINE_ABOVE | REDRAW_AFTER_CURSOR;
     }
 /* tell that we've modified the file */
-    edit_modification (edit, edit->curs1);
+    edit_modification (edit, edit->curs1, 1);
 
 /* save the reverse command onto the undo stack */
     edit_push_action (edit, BACKSPACE, 0);
@@ -868,7 +1607,7 @@ void edit_insert (WEdit * edit, int c)
 
 /* add a new buffer if we've reached the end of the last one */
     if (!(edit->curs1 & M_EDIT_BUF_SIZE))
-	edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE] = malloc (EDIT_BUF_SIZE);
+	edit_new_buffer1 (edit, edit->curs1 >> S_EDIT_BUF_SIZE);
 
 /* perfprm the insertion */
     edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE][edit->curs1 & M_EDIT_BUF_SIZE] = (unsigned char) c;
@@ -878,6 +1617,7 @@ void edit_insert (WEdit * edit, int c)
 
 /* update cursor position */
     edit->curs1++;
+    edit_index_lines1 (edit);
 }
 
 
@@ -902,18 +1642,19 @@ void edit_insert_ahead (WEdit * edit, int c)
 	edit->total_lines++;
 	edit->force |= REDRAW_AFTER_CURSOR;
     }
-    edit_modification (edit, edit->curs1);
+    edit_modification (edit, edit->curs1, 1);
     edit_push_action (edit, ACT_DELETE, 0);
 
     edit->mark1 += (edit->mark1 >= edit->curs1);
     edit->mark2 += (edit->mark2 >= edit->curs1);
 
     if (!((edit->curs2 + 1) & M_EDIT_BUF_SIZE))
-	edit->buffers2[(edit->curs2 + 1) >> S_EDIT_BUF_SIZE] = malloc (EDIT_BUF_SIZE);
+	edit_new_buffer2 (edit, (edit->curs2 + 1) >> S_EDIT_BUF_SIZE);
     edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE][EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE) - 1] = c;
 
     edit->last_byte++;
     edit->curs2++;
+    edit_index_lines2 (edit);
 }
 
 
@@ -928,10 +1669,8 @@ int edit_delete (WEdit * edit)
 
     p = edit->buffers2[(edit->curs2 - 1) >> S_EDIT_BUF_SIZE][EDIT_BUF_SIZE - ((edit->curs2 - 1) & M_EDIT_BUF_SIZE) - 1];
 
-    if (!(edit->curs2 & M_EDIT_BUF_SIZE)) {
-	free (edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE]);
-	edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE] = NULL;
-    }
+    if (!(edit->curs2 & M_EDIT_BUF_SIZE))
+	edit_free_buffer2 (edit, edit->curs2 >> S_EDIT_BUF_SIZE);
     edit->last_byte--;
     edit->curs2--;
 
@@ -946,18 +1685,115 @@ int edit_delete (WEdit * edit)
 	edit->total_lines--;
 	edit->force |= REDRAW_AFTER_CURSOR;
     }
-    edit_push_action (edit, INSERT_AHEAD, p);
+    edit_push_deleted (edit, INSERT_AHEAD_RUN, p);
     if (edit->curs1 < edit->start_display) {
 	edit->start_display--;
 	if (p == '\n')
 	    edit->start_line--;
     }
-    edit_modification (edit, edit->curs1);
+    edit_modification (edit, edit->curs1, -1);
 
     return p;
 }
 
 
+/*
+   Bulk versions of edit_insert_ahead() and edit_delete(): these copy
+   whole blocks with memcpy and update the markers, bookmarks, line
+   counts and undo stack once per call instead of once per byte.
+ */
+
+/* inserts len bytes ahead of the cursor, leaving the cursor before them */
+void edit_insert_ahead_text (WEdit * edit, const unsigned char *text, long len)
+{E_
+    long n, k, c, nl = 0, line;
+
+    if (len > SIZE_LIMIT - edit->last_byte)
+	len = SIZE_LIMIT - edit->last_byte;
+    if (len <= 0)
+	return;
+    line = edit->curs_line;
+    if (edit->curs1 < 1 || edit->buffers1[(edit->curs1 - 1) >> S_EDIT_BUF_SIZE][(edit->curs1 - 1) & M_EDIT_BUF_SIZE] == '\n')
+	line--;
+    edit_modification (edit, edit->curs1, len);
+    edit_push_actions (edit, ACT_DELETE, 0, len);
+
+    edit->mark1 += (edit->mark1 >= edit->curs1) ? len : 0;
+    edit->mark2 += (edit->mark2 >= edit->curs1) ? len : 0;
+
+/* fill buffers2[] from the end of the text backward, a block at a time */
+    for (n = len; n > 0; n -= k) {
+	k = min (n, EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE));
+	memcpy (edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE) - k, text + n - k, k);
+	c = count_newlines (text + n - k, k);
+	nl += c;
+	edit->total_lines += c;
+	edit->last_byte += k;
+	edit->curs2 += k;
+	if (!(edit->curs2 & M_EDIT_BUF_SIZE))
+	    edit_new_buffer2 (edit, edit->curs2 >> S_EDIT_BUF_SIZE);
+	edit_index_lines2 (edit);
+    }
+
+    if (edit->curs1 < edit->start_display) {
+	edit->start_display += len;
+	edit->start_line += nl;
+    }
+    if (nl) {
+	if (edit->book_mark) {
+	    book_mark_shift (edit, line, nl);
+	    edit->force |= REDRAW_LINE_ABOVE;
+	}
+	edit->force |= REDRAW_AFTER_CURSOR;
+    }
+}
+
+/* deletes len bytes ahead of the cursor */
+void edit_delete_text (WEdit * edit, long len)
+{E_
+    unsigned char *p;
+    long n, k, nl = 0, nl_display = 0, before_display, line;
+
+    if (len > edit->curs2)
+	len = edit->curs2;
+    if (len <= 0)
+	return;
+    line = edit->curs_line;
+    if (!(edit->curs1 < 1 || edit->buffers1[(edit->curs1 - 1) >> S_EDIT_BUF_SIZE][(edit->curs1 - 1) & M_EDIT_BUF_SIZE] == '\n'))
+	line++;
+    before_display = edit->start_display - edit->curs1;
+
+    edit->mark1 -= (edit->mark1 > edit->curs1) ? min (len, edit->mark1 - edit->curs1) : 0;
+    edit->mark2 -= (edit->mark2 > edit->curs1) ? min (len, edit->mark2 - edit->curs1) : 0;
+
+    for (n = 0; n < len; n += k) {
+	p = edit_get_span (edit, edit->curs1, &k);
+	k = min (k, len - n);
+	edit_push_deleted_text (edit, INSERT_AHEAD_RUN, p, k);
+	nl += count_newlines (p, k);
+	if (before_display > n)
+	    nl_display += count_newlines (p, min (k, before_display - n));
+	if (!(edit->curs2 & M_EDIT_BUF_SIZE))
+	    edit_free_buffer2 (edit, edit->curs2 >> S_EDIT_BUF_SIZE);
+	edit->last_byte -= k;
+	edit->curs2 -= k;
+    }
+
+    if (nl) {
+	if (edit->book_mark) {
+	    book_mark_shift (edit, line, -nl);
+	    edit->force |= REDRAW_LINE_ABOVE;
+	}
+	edit->total_lines -= nl;
+	edit->force |= REDRAW_AFTER_CURSOR;
+    }
+    if (before_display > 0) {
+	edit->start_display -= min (len, before_display);
+	edit->start_line -= nl_display;
+    }
+    edit_modification (edit, edit->curs1, -len);
+}
+
 int edit_backspace (WEdit * edit)
 {E_
     int p;
@@ -987,14 +1823,14 @@ int edit_backspace (WEdit * edit)
 	edit->total_lines--;
 	edit->force |= REDRAW_AFTER_CURSOR;
     }
-    edit_push_action (edit, INSERT_BEHIND, p);
+    edit_push_deleted (edit, INSERT_BEHIND_RUN, p);
 
     if (edit->curs1 < edit->start_display) {
 	edit->start_display--;
 	if (p == '\n')
 	    edit->start_line--;
     }
-    edit_modification (edit, edit->curs1);
+    edit_modification (edit, edit->curs1, -1);
 
     return p;
 }
@@ -1081,60 +1917,67 @@ void edit_wide_char_align_left (WEdit * edit)
 /* moves the cursor right or left: increment positive or negative respectively */
 int edit_cursor_move (WEdit * edit, long increment)
 {E_
-/* this is the same as a combination of two of the above routines, with only one push onto the undo stack */
-    int c;
-
-    if (increment < 0) {
-	for (; increment < 0; increment++) {
-	    if (!edit->curs1)
-		return -1;
-
-	    edit_push_action (edit, CURS_RIGHT, 0);
+/* this is the same as a combination of two of the above routines, with only one push onto the undo stack.
+   bytes are moved between buffers1[] and buffers2[] a block at a time */
+    unsigned char *p;
+    long k, nl;
+    int c = -3;
 
-	    c = edit_get_byte (edit, edit->curs1 - 1);
-	    if (!((edit->curs2 + 1) & M_EDIT_BUF_SIZE))
-		edit->buffers2[(edit->curs2 + 1) >> S_EDIT_BUF_SIZE] = malloc (EDIT_BUF_SIZE);
-	    edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE][EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE) - 1] = c;
-	    edit->curs2++;
-	    c = edit->buffers1[(edit->curs1 - 1) >> S_EDIT_BUF_SIZE][(edit->curs1 - 1) & M_EDIT_BUF_SIZE];
-	    if (!((edit->curs1 - 1) & M_EDIT_BUF_SIZE)) {
-		free (edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE]);
-		edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE] = NULL;
-	    }
-	    edit->curs1--;
-	    if (c == '\n') {
-		edit->curs_line--;
-		edit->force |= REDRAW_LINE_BELOW;
-	    }
+    while (increment < 0) {
+	if (!edit->curs1)
+	    return -1;
+	k = min (-increment, ((edit->curs1 - 1) & M_EDIT_BUF_SIZE) + 1);
+	k = min (k, EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE));
+
+	edit_push_actions (edit, CURS_RIGHT, 0, k);
+
+	p = edit->buffers1[(edit->curs1 - 1) >> S_EDIT_BUF_SIZE] + ((edit->curs1 - 1) & M_EDIT_BUF_SIZE) - k + 1;
+	memcpy (edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE] + EDIT_BUF_SIZE - (edit->curs2 & M_EDIT_BUF_SIZE) - k, p, k);
+	c = *p;
+	nl = count_newlines (p, k);
+	edit->curs2 += k;
+	if (!(edit->curs2 & M_EDIT_BUF_SIZE))
+	    edit_new_buffer2 (edit, edit->curs2 >> S_EDIT_BUF_SIZE);
+	edit->curs1 -= k;
+	if (!(edit->curs1 & M_EDIT_BUF_SIZE)) {
+	    free (edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE]);
+	    edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE] = NULL;
 	}
+	if (nl) {
+	    edit->curs_line -= nl;
+	    edit->force |= REDRAW_LINE_BELOW;
+	}
+	edit_index_lines2 (edit);
+	increment += k;
+    }
 
-	return c;
-    } else if (increment > 0) {
-	for (; increment > 0; increment--) {
-	    if (!edit->curs2)
-		return -2;
-
-	    edit_push_action (edit, CURS_LEFT, 0);
-
-	    c = edit_get_byte (edit, edit->curs1);
-	    if (!(edit->curs1 & M_EDIT_BUF_SIZE))
-		edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE] = malloc (EDIT_BUF_SIZE);
-	    edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE][edit->curs1 & M_EDIT_BUF_SIZE] = c;
-	    edit->curs1++;
-	    c = edit->buffers2[(edit->curs2 - 1) >> S_EDIT_BUF_SIZE][EDIT_BUF_SIZE - ((edit->curs2 - 1) & M_EDIT_BUF_SIZE) - 1];
-	    if (!(edit->curs2 & M_EDIT_BUF_SIZE)) {
-		free (edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE]);
-		edit->buffers2[edit->curs2 >> S_EDIT_BUF_SIZE] = 0;
-	    }
-	    edit->curs2--;
-	    if (c == '\n') {
-		edit->curs_line++;
-		edit->force |= REDRAW_LINE_ABOVE;
-	    }
+    while (increment > 0) {
+	if (!edit->curs2)
+	    return -2;
+	k = min (increment, ((edit->curs2 - 1) & M_EDIT_BUF_SIZE) + 1);
+	k = min (k, EDIT_BUF_SIZE - (edit->curs1 & M_EDIT_BUF_SIZE));
+
+	edit_push_actions (edit, CURS_LEFT, 0, k);
+
+	p = edit->buffers2[(edit->curs2 - 1) >> S_EDIT_BUF_SIZE] + EDIT_BUF_SIZE - ((edit->curs2 - 1) & M_EDIT_BUF_SIZE) - 1;
+	if (!(edit->curs1 & M_EDIT_BUF_SIZE))
+	    edit_new_buffer1 (edit, edit->curs1 >> S_EDIT_BUF_SIZE);
+	memcpy (edit->buffers1[edit->curs1 >> S_EDIT_BUF_SIZE] + (edit->curs1 & M_EDIT_BUF_SIZE), p, k);
+	c = p[k - 1];
+	nl = count_newlines (p, k);
+	edit->curs1 += k;
+	if (!(edit->curs2 & M_EDIT_BUF_SIZE))
+	    edit_free_buffer2 (edit, edit->curs2 >> S_EDIT_BUF_SIZE);
+	edit->curs2 -= k;
+	if (nl) {
+	    edit->curs_line += nl;
+	    edit->force |= REDRAW_LINE_ABOVE;
 	}
-	return c;
-    } else
-	return -3;
+	edit_index_lines1 (edit);
+	increment -= k;
+    }
+
+    return c;
 }
 
 /* These functions return positions relative to lines */
@@ -1142,39 +1985,75 @@ int edit_cursor_move (WEdit * edit, long increment)
 /* returns index of last char on line + 1 */
 long edit_eol (WEdit * edit, long current)
 {E_
-    if (current < edit->last_byte) {
-	for (;; current++)
-	    if (edit_get_byte (edit, current) == '\n')
-		break;
-    } else
-	return edit->last_byte;
-    return current;
+    if (current < 0)		/* out of bounds counts as a newline, as with edit_get_byte() */
+	return current;
+    return edit_find_newline (edit, current, 1);
 }
 
 /* returns index of first char on line */
 long edit_bol (WEdit * edit, long current)
 {E_
-    if (current > 0) {
-	for (;; current--)
-	    if (edit_get_byte (edit, current - 1) == '\n')
-		break;
-    } else
-	return 0;
-    return current;
+    if (current > edit->last_byte)
+	return current;
+    return edit_find_newline_back (edit, current, 1) + 1;
+}
+
+/* beyond this many lines (or bytes) we go to the line index rather than scanning */
+#define LINE_INDEX_MIN_LINES	1024
+#define LINE_INDEX_MIN_BYTES	(2 * EDIT_BUF_SIZE)
+
+/* returns the line number at offset, scanning at most one block */
+static long edit_line_at_offset (WEdit * edit, long offset)
+{E_
+    long j;
+    if (offset <= edit->curs1) {
+	j = offset >> S_EDIT_BUF_SIZE;
+	return edit->lines1[j] + edit_count_newlines (edit, j << S_EDIT_BUF_SIZE, offset);
+    }
+    j = (edit->last_byte - offset) >> S_EDIT_BUF_SIZE;
+    return edit->total_lines - edit->lines2[j] - edit_count_newlines (edit, offset, edit->last_byte - (j << S_EDIT_BUF_SIZE));
 }
 
+/* returns the offset of the first char of line, scanning at most one block */
+static long edit_line_offset (WEdit * edit, long line)
+{E_
+    long lo, hi, mid, n;
+    if (line > edit->total_lines)
+	line = edit->total_lines;
+    if (line <= 0)
+	return 0;
+    if (line <= edit->curs_line) {
+/* find the last block that starts before the newline ending line - 1 */
+	for (lo = 0, hi = edit->curs1 >> S_EDIT_BUF_SIZE; lo < hi;) {
+	    mid = (lo + hi + 1) / 2;
+	    if (edit->lines1[mid] < line)
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+	return edit_find_newline (edit, lo << S_EDIT_BUF_SIZE, line - edit->lines1[lo]) + 1;
+    }
+/* that same newline counted backward from the end of the file */
+    n = edit->total_lines - line + 1;
+    for (lo = 0, hi = edit->curs2 >> S_EDIT_BUF_SIZE; lo < hi;) {
+	mid = (lo + hi + 1) / 2;
+	if (edit->lines2[mid] < n)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return edit_find_newline_back (edit, edit->last_byte - (lo << S_EDIT_BUF_SIZE), n - edit->lines2[lo]) + 1;
+}
 
-int edit_count_lines (WEdit * edit, long current, int upto)
+long edit_count_lines (WEdit * edit, long current, long upto)
 {E_
-    int lines = 0;
     if (upto > edit->last_byte)
 	upto = edit->last_byte;
     if (current < 0)
 	current = 0;
-    while (current < upto)
-	if (edit_get_byte (edit, current++) == '\n')
-	    lines++;
-    return lines;
+    if (upto - current < LINE_INDEX_MIN_BYTES)
+	return edit_count_newlines (edit, current, upto);
+    return edit_line_at_offset (edit, upto) - edit_line_at_offset (edit, current);
 }
 
 
@@ -1188,6 +2067,8 @@ long edit_move_forward (WEdit * edit, long current, int lines, long upto)
 	int next;
 	if (lines < 0)
 	    lines = 0;
+	if (lines > LINE_INDEX_MIN_LINES)
+	    return edit_line_offset (edit, edit_line_at_offset (edit, current) + lines);
 	while (lines--) {
 	    next = edit_eol (edit, current) + 1;
 	    if (next > edit->last_byte)
@@ -1205,6 +2086,8 @@ long edit_move_backward (WEdit * edit, long current, int lines)
 {E_
     if (lines < 0)
 	lines = 0;
+    if (lines > LINE_INDEX_MIN_LINES)
+	return edit_line_offset (edit, edit_line_at_offset (edit, current) - lines);
     current = edit_bol (edit, current);
     while((lines--) && current != 0)
 	current = edit_bol (edit, current - 1);
@@ -1420,10 +2303,10 @@ int is_blank (WEdit * edit, long offset)
 
 
 /* returns the offset of line i */
-long edit_find_line (WEdit * edit, int line)
+long edit_find_line (WEdit * edit, long line)
 {E_
     int i, j = 0;
-    int m = 2000000000;
+    long m = LONG_MAX;
     if (!edit->caches_valid) {
 	for (i = 0; i < N_LINE_CACHES; i++)
 	    edit->line_numbers[i] = edit->line_offsets[i] = 0;
@@ -1440,8 +2323,8 @@ long edit_find_line (WEdit * edit, int line)
 	return 0;
 /* find the closest known point */
     for (i = 0; i < N_LINE_CACHES; i++) {
-	int n;
-	n = abs (edit->line_numbers[i] - line);
+	long n;
+	n = labs (edit->line_numbers[i] - line);
 	if (n < m) {
 	    m = n;
 	    j = i;
@@ -1453,7 +2336,9 @@ long edit_find_line (WEdit * edit, int line)
 	i = j;			/* one line different - caller might be looping, so stay in this cache */
     else
 	i = 3 + (rand () % (N_LINE_CACHES - 3));
-    if (line > edit->line_numbers[j])
+    if (m > LINE_INDEX_MIN_LINES)
+	edit->line_offsets[i] = edit_line_offset (edit, line);
+    else if (line > edit->line_numbers[j])
 	edit->line_offsets[i] = edit_move_forward (edit, edit->line_offsets[j], line - edit->line_numbers[j], 0);
     else
 	edit->line_offsets[i] = edit_move_backward (edit, edit->line_offsets[j], edit->line_numbers[j] - line);
@@ -1719,27 +2604,30 @@ static unsigned long my_type_of (int c)
     return r;
 }
 
+/* finds where the word move ends first, then moves the cursor there in one go */
 void edit_left_word_move (WEdit * edit, int s)
 {E_
+    long q = edit->curs1;
 #warning do proper unicode interpretation of whole words
-    if (edit_get_byte (edit, edit->curs1 - 1) >= 0x80) {
+    if (edit_get_byte (edit, q - 1) >= 0x80) {
         /* until we have unicode support here, skip over unicode character and then consider the word move done */
-        for (;;) {
+        while (q > 0) {
             int c;
-	    edit_cursor_move (edit, -1);
-            c = edit_get_byte (edit, edit->curs1);
+            c = edit_get_byte (edit, --q);
             if (c >= 0xC0 || c < 0x80)
                 break;
         }
+        edit_cursor_move (edit, q - edit->curs1);
         return;
     }
     for (;;) {
 	int c1, c2;
-	edit_cursor_move (edit, -1);
-	if (!edit->curs1)
+	if (q > 0)
+	    q--;
+	if (!q)
 	    break;
-	c1 = edit_get_byte (edit, edit->curs1 - 1);
-	c2 = edit_get_byte (edit, edit->curs1);
+	c1 = edit_get_byte (edit, q - 1);
+	c2 = edit_get_byte (edit, q);
 	if (!(my_type_of (c1) & my_type_of (c2)))
 	    break;
 	if (isspace (c1) && !isspace (c2))
@@ -1748,6 +2636,7 @@ void edit_left_word_move (WEdit * edit, int s)
 	    if (!isspace (c1) && isspace (c2))
 		break;
     }
+    edit_cursor_move (edit, q - edit->curs1);
 }
 
 static void edit_left_word_move_cmd (WEdit * edit)
@@ -1758,25 +2647,28 @@ static void edit_left_word_move_cmd (WEdit * edit)
 
 void edit_right_word_move (WEdit * edit, int s)
 {E_
+    long q = edit->curs1;
 #warning do proper unicode interpretation of whole words
-    if (edit_get_byte (edit, edit->curs1) >= 0x80) {
+    if (edit_get_byte (edit, q) >= 0x80) {
         /* until we have unicode support here, skip over unicode character and then consider the word move done */
-        for (;;) {
+        while (q < edit->last_byte) {
             int c;
-	    edit_cursor_move (edit, 1);
-            c = edit_get_byte (edit, edit->curs1 + 1);
+            q++;
+            c = edit_get_byte (edit, q + 1);
             if (c >= 0xC0 || c < 0x80)
                 break;
         }
+        edit_cursor_move (edit, q - edit->curs1);
         return;
     }
     for (;;) {
 	int c1, c2;
-	edit_cursor_move (edit, 1);
-	if (edit->curs1 >= edit->last_byte)
+	if (q < edit->last_byte)
+	    q++;
+	if (q >= edit->last_byte)
 	    break;
-	c1 = edit_get_byte (edit, edit->curs1 - 1);
-	c2 = edit_get_byte (edit, edit->curs1);
+	c1 = edit_get_byte (edit, q - 1);
+	c2 = edit_get_byte (edit, q);
 	if (!(my_type_of (c1) & my_type_of (c2)))
 	    break;
 	if (isspace (c1) && !isspace (c2))
@@ -1785,6 +2677,7 @@ void edit_right_word_move (WEdit * edit, int s)
 	    if (!isspace (c1) && isspace (c2))
 		break;
     }
+    edit_cursor_move (edit, q - edit->curs1);
 }
 
 static void edit_right_word_move_cmd (WEdit * edit)
@@ -1836,23 +2729,27 @@ void edit_do_undo (WEdit * edit)
 
     for (;;) {
         struct undo_element ac;
+	long n;
 
-        ac = pop_action (edit);
+/* a repeated command, such as the BACKSPACE of each byte of a paste, is undone in one go */
+        ac = pop_actions (edit, &n);
 
 	switch (ac.command) {
 	case STACK_BOTTOM:
 	    goto done_undo;
 	case CURS_RIGHT:
-	    edit_cursor_move (edit, 1);
+	    edit_cursor_move (edit, n);
 	    break;
 	case CURS_LEFT:
-	    edit_cursor_move (edit, -1);
+	    edit_cursor_move (edit, -n);
 	    break;
 	case BACKSPACE:
-	    edit_backspace (edit);
+	    n = min (n, edit->curs1);
+	    edit_cursor_move (edit, -n);
+	    edit_delete_text (edit, n);
 	    break;
 	case ACT_DELETE:
-	    edit_delete (edit);
+	    edit_delete_text (edit, n);
 	    break;
 	case COLUMN_ON:
 	    column_highlighting = 1;
@@ -1861,11 +2758,31 @@ void edit_do_undo (WEdit * edit)
 	    column_highlighting = 0;
 	    break;
         case INSERT_BEHIND:
-	    edit_insert (edit, ac.param);
+	    while (n--)
+		edit_insert (edit, ac.param);
 	    break;
         case INSERT_AHEAD:
-	    edit_insert_ahead (edit, ac.param);
+	    while (n--)
+		edit_insert_ahead (edit, ac.param);
             break;
+        case INSERT_BEHIND_RUN:
+        case INSERT_AHEAD_RUN: {
+	    unsigned char *p, *q, t;
+	    n = edit->undo_text_len - ac.param;
+	    p = edit->undo_text + ac.param;
+/* backspaced text went in last character first */
+	    if (ac.command == INSERT_BEHIND_RUN)
+		for (q = p + n - 1; p < q; p++, q--) {
+		    t = *p;
+		    *p = *q;
+		    *q = t;
+		}
+	    edit_insert_ahead_text (edit, edit->undo_text + ac.param, n);
+	    if (ac.command == INSERT_BEHIND_RUN)
+		edit_cursor_move (edit, n);
+	    edit->undo_text_len = ac.param;
+	    break;
+	}
         case MARK_1:
 	    edit->mark1 = ac.param;
 	    edit->column1 = edit_move_forward3 (edit, edit_bol (edit, edit->mark1), 0, edit->mark1);
@@ -2111,6 +3028,42 @@ void edit_push_key_press (WEdit * edit)
 	edit_push_action (edit, MARK_1, edit->mark1);
 }
 
+/* returns the count of leading bytes of p, up to len, that are none of a, b or c */
+static long span_skip (const unsigned char *p, long len, int a, int b, int c)
+{E_
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8 (a), vb = _mm_set1_epi8 (b), vc = _mm_set1_epi8 (c);
+    while (len - i >= 16) {
+	__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+	if (_mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, va), _mm_cmpeq_epi8 (v, vb)), _mm_cmpeq_epi8 (v, vc))))
+	    break;
+	i += 16;
+    }
+#endif
+    while (i < len && p[i] != a && p[i] != b && p[i] != c)
+	i++;
+    return i;
+}
+
+/* as span_skip() but going backward from p[0] to p[1 - len] */
+static long span_skip_back (const unsigned char *p, long len, int a, int b)
+{E_
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8 (a), vb = _mm_set1_epi8 (b);
+    while (len - i >= 16) {
+	__m128i v = _mm_loadu_si128 ((const __m128i *) (p - i - 15));
+	if (_mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, va), _mm_cmpeq_epi8 (v, vb))))
+	    break;
+	i += 16;
+    }
+#endif
+    while (i < len && p[-i] != a && p[-i] != b)
+	i++;
+    return i;
+}
+
 /* this find the matching bracket in either direction, and sets edit->bracket */
 static long edit_get_bracket (WEdit * edit, int in_screen, unsigned long furthest_bracket_search)
 {E_
@@ -2134,9 +3087,30 @@ static long edit_get_bracket (WEdit * edit, int in_screen, unsigned long furthes
     if (strchr ("{[(", c))
 	inc = 1;
     for (q = edit->curs1 + inc;; q += inc) {
+	unsigned char *s;
+	long k, len;
 /* out of buffer? */
 	if (q >= edit->last_byte || q < 0)
 	    break;
+/* skip past bytes that can change neither the depth nor the line count */
+	if (inc > 0) {
+	    s = edit_get_span (edit, q, &len);
+	    k = span_skip (s, len, c, d, in_screen ? '\n' : d);
+	} else {
+	    s = edit_get_span_back (edit, q, &len);
+	    k = span_skip_back (s, len, c, d);
+	}
+	if (j >= furthest_bracket_search)
+	    k = 0;
+	else if ((unsigned long) k > furthest_bracket_search - j)
+	    k = furthest_bracket_search - j;
+	if (in_screen && inc < 0 && k > q - edit->start_display + 1)
+	    k = max (q - edit->start_display + 1, 0);
+	if (k) {
+	    j += k;
+	    q += (k - 1) * inc;
+	    continue;
+	}
 	a = edit_get_byte (edit, q);
 /* don't want to eat CPU */
 	if (j++ > furthest_bracket_search)
@@ -30,6 +30,7 @@
 
 #    include <stdlib.h>
 #    include <malloc.h>
+#    include <limits.h>
 
 #else       /* ! MIDNIGHT */
 
@@ -60,6 +61,7 @@
      
 #    include <stdlib.h>
 #    include <stdarg.h>
+#    include <limits.h>
 
 #    if TIME_WITH_SYS_TIME
 #    	 include <sys/time.h>
@@ -220,18 +222,18 @@
 
 #define S_EDIT_BUF_SIZE 18
 
-/*there are a maximum of ... */
-#define MAXBUFF 4096
-/*... edit buffers, each of which is ... */
+/* the file is held in edit buffers, each of which is ... */
 #define EDIT_BUF_SIZE (1<<S_EDIT_BUF_SIZE)
-/* ...bytes in size. */
+/* ...bytes in size. The tables of pointers to these (buffers1[]
+and buffers2[]) are grown as the file grows. */
 
 /*x / EDIT_BUF_SIZE equals x >> ... */
 
 /* x % EDIT_BUF_SIZE is equal to x && ... */
 #define M_EDIT_BUF_SIZE (EDIT_BUF_SIZE - 1)
 
-#define SIZE_LIMIT (EDIT_BUF_SIZE * (MAXBUFF - 2))
+/* the only limit is that offsets must fit in a long */
+#define SIZE_LIMIT (LONG_MAX - EDIT_BUF_SIZE)
 
 /* undo stack */
 #define START_STACK_SIZE 32
@@ -260,7 +262,6 @@ struct mb_rule {
 struct _mb_marker {
     long offset;
     struct mb_rule rule;
-    struct _mb_marker *next;
 };
 
 #define NUM_SELECTION_HISTORY 64
@@ -313,12 +314,31 @@ struct context_rule {
     int spelling;
 /* first word is word[1] */
     struct key_word **keyword;
+    struct keyword_trie *keyword_trie;	/* built from keyword[] when first needed */
 };
 
 struct _syntax_marker {
     long offset;
     struct syntax_rule rule;
-    struct _syntax_marker *next;
+};
+
+/* x position of offset, counted from the start of its line */
+struct column_mark {
+    long offset;
+    int x;
+};
+
+/* x positions along one line: of every offset if the line is short, else of sparse marks */
+struct column_cache {
+    long bol;
+    void *font;			/* font and tab settings the x positions were measured with */
+    int tab;
+    int *x;			/* x of each offset up to and including the newline */
+    int n_x;			/* -1 if the line is too long to keep x[] */
+    int x_alloc;
+    struct column_mark *mark;
+    int n_marks;
+    int marks_alloc;
 };
 
 /* some codes that may be pushed onto or returned from the undo stack: */
@@ -330,6 +350,8 @@ enum undo_command {
     STACK_BOTTOM = '|',
     INSERT_BEHIND = 'A',
     INSERT_AHEAD = 'I',
+    INSERT_BEHIND_RUN = 'a',	/* param is the offset of the run in undo_text */
+    INSERT_AHEAD_RUN = 'i',
     COLUMN_ON = 'C',
     COLUMN_OFF = 'c',
     MARK_1 = 'M',
@@ -386,13 +408,23 @@ struct editor_widget {
 /* dynamic buffers and cursor position for editor: */
     long curs1;			/*position of the cursor from the beginning of the file. */
     long curs2;			/*position from the end of the file */
-    unsigned char *buffers1[MAXBUFF + 1];	/*all data up to curs1 */
-    unsigned char *buffers2[MAXBUFF + 1];	/*all data from end of file down to curs2 */
+    unsigned char **buffers1;	/*all data up to curs1 */
+    unsigned char **buffers2;	/*all data from end of file down to curs2 */
+    long n_buffers1;		/* allocated length of buffers1[] and lines1[] */
+    long n_buffers2;		/* allocated length of buffers2[] and lines2[] */
+    long *lines1;		/* newline count before the start of each buffers1[] block */
+    long *lines2;		/* newline count from the end of each buffers2[] block to the end of file */
+    unsigned char *mapped;	/* copy-on-write map of the file backing untouched buffers2[] blocks */
+    long mapped_len;
+    int mapped_fd;		/* kept open to notice writes to the mapped file under any name */
+    struct stat mapped_stat;	/* the file as it was when mapped */
+    int mapped_stale;		/* the mapped file was truncated or written to by another program */
 
 /* search variables */
     long search_start;		/* First character to start searching from */
     int found_len;		/* Length of found string or 0 if none was found */
     long found_start;		/* the found word from a search - start position */
+    char *progress;		/* shown on the status line while a long search runs */
 
 /* display information */
     long last_byte;		/* Last byte of file */
@@ -428,12 +460,17 @@ struct editor_widget {
     int column2;			/*position of column highlight end */
     long bracket;		/*position of a matching bracket */
 
-/* cache speedup for line lookups */
+/* cache speedup for lookups of nearby lines, far lookups go through lines1[] and lines2[] */
 #define N_LINE_CACHES	32
     int caches_valid;
-    int line_numbers[N_LINE_CACHES];
+    long line_numbers[N_LINE_CACHES];
     long line_offsets[N_LINE_CACHES];
 
+/* x positions on the most recently measured lines */
+#define N_COLUMN_CACHES	16
+    struct column_cache column_cache[N_COLUMN_CACHES];
+    int column_cache_next;
+
     struct _book_mark *book_mark;
 
 /* undo stack and pointers */
@@ -442,10 +479,20 @@ struct editor_widget {
     unsigned long stack_size;
     unsigned long stack_size_mask;
     unsigned long stack_bottom;
+    unsigned char *undo_text;	/* text of deleted runs, in stack order */
+    long undo_text_len;
+    long undo_text_alloc;
     struct portable_stat stat;
 
 /* syntax higlighting */
-    struct _syntax_marker *syntax_marker;
+    struct _syntax_marker *syntax_marker;	/* checkpoints, sorted by offset */
+    long n_syntax_markers;
+    long syntax_markers_alloc;
+    long syntax_shift_index;	/* markers from here on still have to move by syntax_shift bytes */
+    long syntax_shift;
+    long syntax_dirty;		/* markers at or after this offset are unverified */
+    long syntax_dirty_end;	/* the text from here on is unchanged since they were made */
+    long syntax_plain;		/* text from here on was drawn without colour while still unlexed */
     struct context_rule **rules;
     struct defin *defin;
     int is_case_insensitive;
@@ -455,7 +502,9 @@ struct editor_widget {
     char *syntax_type;		/* description of syntax highlighting type being used */
     int explicit_syntax;	/* have we forced the syntax hi. type in spite of the filename? */
 
-    struct _mb_marker *mb_marker;
+    struct _mb_marker *mb_marker;	/* decoder states, sorted by offset */
+    long n_mb_markers;
+    long mb_markers_alloc;
     long last_get_mb_rule;
     struct mb_rule mb_rule;
     int mb_invalidate;
@@ -497,7 +546,7 @@ void edit_change_directory (void);
 int edit_man_page_cmd (WEdit * edit);
 int edit_search_replace_dialog (Window parent, int x, int y, CStr *search_text, CStr *replace_text, CStr *arg_order, const char *heading, int option);
 int edit_search_dialog (WEdit * edit, CStr *search_text);
-long edit_find (long search_start, CStr expr, int *len, long last_byte, int (*get_byte) (void *, long), void *data, void *d);
+long edit_find (long search_start, CStr expr, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, void *d);
 void edit_set_foreground_colors (unsigned long normal, unsigned long bold, unsigned long italic);
 void edit_set_background_colors (unsigned long normal, unsigned long abnormal, unsigned long marked, unsigned long marked_abnormal, unsigned long highlighted);
 void edit_set_cursor_color (unsigned long c);
@@ -535,6 +584,7 @@ int edit_translate_key (WEdit * edit, unsigned int x_keycode, long x_key, int x_
 #endif
 
 long edit_get_wide_byte (WEdit * edit, long byte_index);
+long edit_get_wide_text (WEdit * edit, long start, long finish, C_wchar_t * ch);
 struct mb_rule get_mb_rule (WEdit * edit, long byte_index);
 #ifdef NO_INLINE_GETBYTE
 int edit_get_byte (WEdit * edit, long byte_index);
@@ -554,16 +604,22 @@ static inline int edit_get_byte (WEdit * edit, long byte_index)
 }
 #endif
 
+unsigned char *edit_get_span (WEdit * edit, long offset, long *len);
+unsigned char *edit_get_span_back (WEdit * edit, long offset, long *len);
+long edit_count_newlines (WEdit * edit, long current, long upto);
+void edit_get_text (WEdit * edit, long start, long finish, unsigned char *text);
+
 typedef int (*edit_file_is_open_fn_t) (const char *host, const char *, int);
 extern edit_file_is_open_fn_t edit_file_is_open;
 
 int edit_backspace (WEdit * edit);
 char *edit_get_buffer_as_text (WEdit * edit);
 char *edit_get_current_line_as_text (WEdit * e, long *length, long *cursor);
-int edit_count_lines (WEdit * edit, long current, int upto);
+long edit_count_lines (WEdit * edit, long current, long upto);
 long edit_move_forward (WEdit * edit, long current, int lines, long upto);
 long edit_move_forward3 (WEdit * edit, long current, int cols, long upto);
 long edit_move_backward (WEdit * edit, long current, int lines);
+long edit_find_line (WEdit * edit, long line);
 void edit_scroll_screen_over_cursor (WEdit * edit);
 void edit_render_keypress (WEdit * edit);
 void edit_render_event (WEdit * edit, int event_type);
@@ -572,6 +628,9 @@ void edit_scroll_downward (WEdit * edit, int i);
 void edit_scroll_right (WEdit * edit, int i);
 void edit_scroll_left (WEdit * edit, int i);
 int edit_get_col (WEdit * edit);
+struct column_cache *edit_column_cache (WEdit * edit, long bol, void *font, int tab);
+struct column_mark *edit_column_mark (WEdit * edit, long bol, long offset, int x, void *font, int tab);
+void edit_column_mark_add (WEdit * edit, long bol, long offset, int x, void *font, int tab);
 long edit_bol (WEdit * edit, long current);
 long edit_eol (WEdit * edit, long current);
 void edit_update_curs_row (WEdit * edit);
@@ -590,6 +649,8 @@ int edit_cursor_move (WEdit * edit, long increment);
 void edit_push_action (WEdit * edit, int command, long param);
 void edit_push_key_press (WEdit * edit);
 void edit_insert_ahead (WEdit * edit, int c);
+void edit_insert_ahead_text (WEdit * edit, const unsigned char *text, long len);
+void edit_delete_text (WEdit * edit, long len);
 #define EDIT_CHANGE_ON_DISK__ON_KEYPRESS        0
 #define EDIT_CHANGE_ON_DISK__ON_SAVE            1
 #define EDIT_CHANGE_ON_DISK__ON_COMMAND         2
@@ -601,6 +662,8 @@ int edit_save_confirm_cmd (WEdit * edit);
 int edit_save_as_cmd (WEdit * edit);
 WEdit *edit_init (WEdit * edit, int lines, int columns, const char *filename, const char *text, const char *starting_host, const char *dir, unsigned long text_size, int new_window);
 int edit_clean (WEdit * edit);
+int edit_unmap_file (WEdit * edit);
+int edit_mapped_file_changed (WEdit * edit);
 int edit_renew (WEdit * edit);
 int edit_new_cmd (WEdit * edit);
 int edit_reload (WEdit * edit, const char *filename, const char *text, const char *host, const char *dir, unsigned long text_size);
@@ -640,7 +703,6 @@ void edit_get_selection (WEdit * edit);
 void selection_replace (CStr new_selection);
 void selection_clear (void);
 int edit_get_text_from_selection_history (Window parent, int x, int y, int cols, int lines, CStr *r);
-void edit_free_cache_lines (void);
 
 int edit_save_macro_cmd (WEdit * edit, struct macro_rec *macro);
 int edit_load_macro_cmd (WEdit * edit, struct macro_rec *macro, int k);
@@ -663,6 +725,9 @@ int edit_split_filename (WEdit * edit, const char *host, const char *name);
 void edit_set_syntax_change_callback (void (*callback) (CWidget *));
 int edit_load_syntax (WEdit * edit, char **names, char *type);
 void edit_free_syntax_rules (WEdit * edit);
+void edit_syntax_modification (WEdit * edit, long p, long delta);
+int edit_syntax_prelex (WEdit * edit);
+void edit_syntax_tick (void);
 void edit_get_syntax_color (WEdit * edit, long byte_index, int *fg, int *bg);
 int edit_check_spelling (WEdit * edit);
 
@@ -675,6 +740,7 @@ int book_mark_clear (WEdit * edit, int line, int c);
 void book_mark_flush (WEdit * edit, int c);
 void book_mark_inc (WEdit * edit, int line);
 void book_mark_dec (WEdit * edit, int line);
+void book_mark_shift (WEdit * edit, int line, long n);
 
 
 #ifdef MIDNIGHT
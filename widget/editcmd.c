@@ -314,11 +314,16 @@ int edit_save_file (WEdit * edit, const char *host, const char *filename)
     struct action_callbacks o;
     struct portable_stat st;
     struct remotefs *u;
+    int save_mode;
 
     if (!filename)
 	return 0;
     if (!*filename)
 	return 0;
+    if (edit_mapped_file_changed (edit) && !strcmp (host, edit->host) && edit->filename && !strcmp (filename, catstrs (edit->dir, edit->filename, NULL))) {
+	edit_error_dialog (_(" Error "), catstrs (_(" File was modified on disk while it was open, reload it before saving: "), filename, NULL));
+	return 0;
+    }
 
     memset (&sd, '\0', sizeof (sd));
     memset (&o, '\0', sizeof (o));
@@ -330,8 +335,14 @@ int edit_save_file (WEdit * edit, const char *host, const char *filename)
     o.hook = (void *) &sd;
     o.sock_writer = edit_sock_writer;
 
+/* writing in place truncates the file, which would pull pages out from under a mapping,
+   so if there is not the memory to copy them out the file is replaced instead */
+    save_mode = option_save_mode;
+    if (save_mode == REMOTEFS_WRITEFILE_OVERWRITEMODE_QUICK && edit_unmap_file (edit))
+	save_mode = REMOTEFS_WRITEFILE_OVERWRITEMODE_SAFE;
+
     u = remotefs_lookup (host, NULL);
-    if ((*u->remotefs_writefile) (u, &o, filename, edit->last_byte, option_save_mode, DEFAULT_CREATE_MODE, option_backup_ext, &st, errmsg)) {
+    if ((*u->remotefs_writefile) (u, &o, filename, edit->last_byte, save_mode, DEFAULT_CREATE_MODE, option_backup_ext, &st, errmsg)) {
         edit_error_dialog (_(" Error "), catstrs (_(" Failed trying to write file: "), filename, " \n [", errmsg, "]", NULL));
         return 0;
     }
@@ -360,6 +371,12 @@ int edit_check_change_on_disk (WEdit * edit, int save_mode)
     memset(&st, '\0', sizeof(st));
     if (!edit->filename || !*edit->filename || !edit->dir || !*edit->dir)
         return 0;
+/* there is no ignoring this one: the text itself has changed under the editor */
+    if (edit_mapped_file_changed (edit)) {
+        if (!edit_query_dialog2 (_(" Warning "), _(" File was truncated or modified on disk by another program \n while it was open. The text may now hold nulls or the other \n program's changes and cannot be saved over the file. "), _("Open"), _("Cancel")))
+            edit_load_cmd (edit);
+        return 1;
+    }
     fullname = (char *) strdup(catstrs (edit->dir, edit->filename, NULL));
     u = remotefs_lookup (edit->host, NULL);
 #warning should abort on network error
@@ -1124,8 +1141,7 @@ void edit_block_copy_cmd (WEdit * edit)
     if (column_highlighting) {
 	edit_insert_column_of_text (edit, copy_buf, size, abs (edit->column2 - edit->column1));
     } else {
-	while (size--)
-	    edit_insert_ahead (edit, copy_buf[size]);
+	edit_insert_ahead_text (edit, copy_buf, size);
     }
 
     free (copy_buf);
@@ -1162,7 +1178,7 @@ void edit_block_move_cmd (WEdit * edit)
     } else if (start_mark <= edit->curs1 && end_mark >= edit->curs1)
 	return;
 
-    if ((end_mark - start_mark) > option_max_undo / 2)
+    if (column_highlighting && (end_mark - start_mark) > option_max_undo / 2)
 	if (edit_query_dialog2 (_ (" Warning "), _ (" Block is large, you may not be able to undo this action. "), _ ("Continue"), _ ("Cancel")))
 	    return;
 
@@ -1196,19 +1212,16 @@ void edit_block_move_cmd (WEdit * edit)
 	column_highlighting = 0;
     } else {
 #warning backport this fix
-	copy_buf = malloc (end_mark - start_mark + 1);
+	count = end_mark - start_mark;
+	copy_buf = malloc (count + 1);
+	edit_get_text (edit, start_mark, end_mark, copy_buf);
 	edit_cursor_move (edit, start_mark - edit->curs1);
 	edit_scroll_screen_over_cursor (edit);
-	count = start_mark;
-	while (count < end_mark) {
-	    copy_buf[end_mark - count - 1] = edit_delete (edit);
-	    count++;
-	}
+	edit_delete_text (edit, count);
 	edit_scroll_screen_over_cursor (edit);
-	edit_cursor_move (edit, current - edit->curs1 - (((current - edit->curs1) > 0) ? end_mark - start_mark : 0));
+	edit_cursor_move (edit, current - edit->curs1 - (((current - edit->curs1) > 0) ? count : 0));
 	edit_scroll_screen_over_cursor (edit);
-	while (count-- > start_mark)
-	    edit_insert_ahead (edit, copy_buf[end_mark - count - 1]);
+	edit_insert_ahead_text (edit, copy_buf, count);
 	edit_set_markers (edit, edit->curs1, edit->curs1 + end_mark - start_mark, 0, 0);
     }
     edit_scroll_screen_over_cursor (edit);
@@ -1259,7 +1272,7 @@ int edit_block_delete (WEdit * edit)
 	return 0;
     if (column_highlighting && edit->mark2 < 0)
 	edit_mark_cmd (edit, 0);
-    if ((end_mark - start_mark) > option_max_undo / 2)
+    if (column_highlighting && (end_mark - start_mark) > option_max_undo / 2)
 /* Warning message with a query to continue or cancel the operation */
 	if (edit_query_dialog2 (_ (" Warning "), _ (" Block is large, you may not be able to undo this action. "), _ (" Continue "), _ (" Cancel ")))
 	    return 1;
@@ -1273,10 +1286,7 @@ int edit_block_delete (WEdit * edit)
 		edit_mark_cmd (edit, 0);
 	    edit_delete_column_of_text (edit);
 	} else {
-	    while (count < end_mark) {
-		edit_delete (edit);
-		count++;
-	    }
+	    edit_delete_text (edit, end_mark - count);
 	}
     }
     edit_set_markers (edit, 0, 0, 0, 0);
@@ -1759,9 +1769,287 @@ int string_regexp_search (char *pattern, char *string, int len, int match_type,
     return (pmatch[0].rm_so);
 }
 
+/* Long searches poll between buffer spans so that they can show their
+   progress on the status line and be aborted with a key press. Only the
+   interactive search and replace commands set search_edit. */
+static WEdit *search_edit = 0;
+static const char *search_what;
+static long search_from, search_to, search_count;
+static struct timeval search_time;
+
+#define SEARCH_POLL_MSEC	200
+
+static void edit_search_progress_start (WEdit * edit, const char *what, long from, long to)
+{E_
+    search_edit = edit;
+    search_what = what;
+    search_from = from;
+    search_to = to;
+    search_count = 0;
+    gettimeofday (&search_time, 0);
+}
+
+static void edit_search_progress_stop (void)
+{E_
+    if (search_edit && search_edit->progress) {
+	search_edit->progress = 0;
+	edit_status (search_edit);
+    }
+    search_edit = 0;
+}
+
+/* returns nonzero if the user pressed a key to abort the search. The
+   key is taken off the X queue and dropped, so it does not go on to be
+   inserted or run as an editing command */
+static int edit_search_poll (long p)
+{E_
+    static char s[80];
+#if !defined(MIDNIGHT) && !defined(GTK)
+    XEvent e;
+#endif
+    struct timeval tv;
+    long t, done, total;
+
+    if (!search_edit)
+	return 0;
+    gettimeofday (&tv, 0);
+    t = (tv.tv_sec - search_time.tv_sec) * 1000L + (tv.tv_usec - search_time.tv_usec) / 1000L;
+    if (t < SEARCH_POLL_MSEC)
+	return 0;
+    search_time = tv;
+    done = labs (p - search_from);
+    total = max (labs (search_to - search_from), 1);
+    snprintf (s, sizeof (s), _(" %s %d%%, %ld found  -  press any key to abort "), search_what,
+	      (int) ((double) done * 100.0 / total), search_count);
+    search_edit->progress = s;
+#if !defined(MIDNIGHT) && !defined(GTK)
+    edit_status (search_edit);
+    XSync (CDisplay, 0);
+    return XCheckMaskEvent (CDisplay, KeyPressMask, &e);
+#else
+    return 0;
+#endif
+}
+
+#ifndef MIDNIGHT
+
+/* first size of the copy of a line that straddles two spans */
+#define REGEXP_LINE	1024
+
+/* compiled as for the per line search, with a fastmap so that
+   re_search can skip quickly over impossible starts */
+static regex_t *edit_regexp_compile (char *pattern, int icase)
+{E_
+    static regex_t r;
+    static char *old_pattern = NULL;
+    static int old_icase;
+
+    if (old_pattern && !strcmp (old_pattern, pattern) && old_icase == icase)
+	return &r;
+    if (old_pattern) {
+	regfree (&r);
+	free (old_pattern);
+	old_pattern = 0;
+    }
+    memset (&r, '\0', sizeof (r));
+    if (regcomp (&r, pattern, REG_EXTENDED | (icase ? REG_ICASE : 0)))
+	return 0;
+    r.fastmap = (char *) malloc (256);
+    old_pattern = (char *) strdup (pattern);
+    old_icase = icase;
+    return &r;
+}
+
+/* copies the line at p, which runs past the end of its span, into the
+   work space and returns its length including the newline */
+static long edit_regexp_line (unsigned char **work_space, long *alloced, long p, long last_byte, unsigned char *(*get_span) (void *, long, long *), void *data)
+{E_
+    unsigned char *s, *e;
+    long n = 0, k;
+
+    while (p < last_byte) {
+	s = (*get_span) (data, p, &k);
+	k = min (k, last_byte - p);
+	if ((e = (unsigned char *) memchr (s, '\n', k)))
+	    k = e - s + 1;
+	if (n + k > *alloced) {
+	    while (n + k > *alloced)
+		*alloced = *alloced ? *alloced * 2 : REGEXP_LINE;
+	    *work_space = (unsigned char *) realloc (*work_space, *alloced);
+	}
+	memcpy (*work_space + n, s, k);
+	n += k;
+	p += k;
+	if (e)
+	    break;
+    }
+    return n;
+}
+
+/* runs the compiled pattern with re_search on each line where it lies
+   in the buffer. A line is the same string the per line search would
+   build, newline included, so ^, $ and . behave as they always have.
+   Only lines that straddle two spans are copied */
+static long edit_find_regexp (unsigned char **work_space, long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only, void *d)
+{E_
+    regmatch_t *pmatch = (regmatch_t *) d;
+    regoff_t starts[NUM_REPL_ARGS], ends[NUM_REPL_ARGS];
+    struct re_registers regs;
+    regex_t *r;
+    unsigned char *s, *line, *e;
+    long p, n, span_end, alloced = 0;
+    int i, c, from, found;
+
+    *len = 0;
+    r = edit_regexp_compile ((char *) exp.data, !replace_case);
+    if (!r)
+	return -3;
+    regs.num_regs = pmatch ? NUM_REPL_ARGS : 1;
+    regs.start = starts;
+    regs.end = ends;
+    r->regs_allocated = REGS_FIXED;
+    r->not_eol = 0;
+
+    if (start < 0)
+	start = 0;
+    for (p = start; p < last_byte;) {
+	s = (*get_span) (data, p, &n);
+	span_end = p + min (n, last_byte - p);
+	if (once_only && r->fastmap_accurate && !r->can_be_null) {
+	    c = r->translate ? (unsigned char) r->translate[*s] : *s;
+	    if (!r->fastmap[c])
+		return -2;
+	}
+	r->not_bol = (p > 0 && (*get_byte) (data, p - 1) != '\n');
+	while (p < span_end) {
+	    if ((e = (unsigned char *) memchr (s, '\n', span_end - p))) {
+		line = s;
+		n = e - s + 1;
+	    } else if (span_end == last_byte) {
+		line = s;
+		n = span_end - p;
+	    } else {
+		n = edit_regexp_line (work_space, &alloced, p, last_byte, get_span, data);
+		line = *work_space;
+	    }
+	    for (from = 0; from < n;) {
+		found = re_search (r, (char *) line, n, from, once_only ? 0 : n - from, &regs);
+		if (found <= -2)
+		    return -3;
+		if (found < 0)
+		    break;
+		if (ends[0] == starts[0]) {	/* null pattern: try again at next character */
+		    if (once_only)
+			break;
+		    from = found + 1;
+		    continue;
+		}
+		*len = ends[0] - starts[0];
+		if (pmatch)
+		    for (i = 0; i < NUM_REPL_ARGS; i++) {
+			pmatch[i].rm_so = starts[i];
+			pmatch[i].rm_eo = ends[i];
+		    }
+		return p + found;
+	    }
+	    if (once_only)
+		return -2;
+	    p += n;
+	    s += n;
+	    r->not_bol = 0;
+	}
+	if (edit_search_poll (p))
+	    return -4;
+    }
+    return -2;
+}
+
+#endif
+
+/* compares a window of the text with the (already case folded) pattern
+   byte by byte, for windows that straddle a block or the cursor gap */
+static int edit_literal_match_at (long p, const unsigned char *pat, long l, int (*get_byte) (void *, long), void *data)
+{E_
+    long q;
+    int c;
+    for (q = 0; q < l; q++) {
+	c = (*get_byte) (data, p + q) & 0xFF;
+	if ((replace_case ? c : my_lower_case (c)) != pat[q])
+	    return 0;
+    }
+    return 1;
+}
+
+/* literal search over the contiguous spans of the buffer using
+   Boyer-Moore-Horspool with a case folding table. Only windows that
+   cross a span boundary are compared through get_byte */
+static long edit_find_literal (long start, CStr exp, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only)
+{E_
+    unsigned char fold[256];
+    long shift[256];
+    const unsigned char *pat = (const unsigned char *) exp.data;
+    unsigned char *s, *t, *end;
+    long l = exp.len, p, i, len;
+    int c;
+
+    if (start < 0)
+	start = 0;
+    if (once_only) {
+	if (start <= last_byte - l && edit_literal_match_at (start, pat, l, get_byte, data))
+	    return start;
+	return -2;
+    }
+
+    for (i = 0; i < 256; i++) {
+	fold[i] = replace_case ? i : my_lower_case (i);
+	shift[i] = l;
+    }
+    for (i = 0; i < l - 1; i++)
+	shift[pat[i]] = l - 1 - i;
+
+    for (p = start; p <= last_byte - l;) {
+	s = (*get_span) (data, p, &len);
+	if (len > last_byte - p)
+	    len = last_byte - p;
+	if (len < l) {
+	    if (edit_literal_match_at (p, pat, l, get_byte, data))
+		return p;
+	    p++;
+	    continue;
+	}
+	end = s + len - l;
+	if (l == 1 && replace_case) {
+	    t = memchr (s, pat[0], len);
+	    if (t)
+		return p + (t - s);
+	    p += len;
+	    if (edit_search_poll (p))
+		return -4;
+	    continue;
+	}
+	for (t = s; t <= end; t += shift[c]) {
+	    c = fold[t[l - 1]];
+	    if (c != pat[l - 1])
+		continue;
+	    if (replace_case) {
+		if (!memcmp (t, pat, l - 1))
+		    return p + (t - s);
+	    } else {
+		for (i = 0; i < l - 1 && fold[t[i]] == pat[i]; i++);
+		if (i == l - 1)
+		    return p + (t - s);
+	    }
+	}
+	p += t - s;
+	if (edit_search_poll (p))
+	    return -4;
+    }
+    return -2;
+}
+
 /* thanks to  Liviu Daia <daia@stoilow.imar.ro>  for getting this
    (and the above) routines to work properly - paul */
-static long edit_find_string__ (unsigned char **work_space1, unsigned char **work_space2, long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), void *data, int once_only, void *d)
+static long edit_find_string__ (unsigned char **work_space1, unsigned char **work_space2, long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only, void *d)
 {E_
     long p, q = 0;
     long l = exp.len, f = 0;
@@ -1844,6 +2132,10 @@ static long edit_find_string__ (unsigned char **work_space1, unsigned char **wor
 	    unsigned char *mbuf;
             long alloced = 8;
 
+#ifndef MIDNIGHT
+	    if (get_span)
+		return edit_find_regexp (work_space1, start, exp, len, last_byte, get_byte, get_span, data, once_only, d);
+#endif
 	    mbuf = *work_space1 = (unsigned char *) realloc (*work_space1, alloced + 8);
             *mbuf = 0;
 
@@ -1891,6 +2183,11 @@ static long edit_find_string__ (unsigned char **work_space1, unsigned char **wor
 	}
     } else {
  	*len = exp.len;
+	if (!replace_case)
+	    for (p = 0; p < exp.len; p++)
+		exp.data[p] = my_lower_case (exp.data[p]);
+	if (get_span && l > 0)
+	    return edit_find_literal (start, exp, last_byte, get_byte, get_span, data, once_only);
 	if (replace_case) {
 	    for (p = start; p <= last_byte - l; p++) {
  		if ((*get_byte) (data, p) == (unsigned char)exp.data[0]) {	/* check if first char matches */
@@ -1904,9 +2201,6 @@ static long edit_find_string__ (unsigned char **work_space1, unsigned char **wor
 		    return -2;
 	    }
 	} else {
-	    for (p = 0; p < exp.len; p++)
-		exp.data[p] = my_lower_case (exp.data[p]);
-
 	    for (p = start; p <= last_byte - l; p++) {
 		if (my_lower_case ((*get_byte) (data, p)) == (unsigned char)exp.data[0]) {
 		    for (f = 0, q = 0; q < l && f < 1; q++)
@@ -1923,33 +2217,33 @@ static long edit_find_string__ (unsigned char **work_space1, unsigned char **wor
     return -2;
 }
 
-static long edit_find_string_ (long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), void *data, int once_only, void *d)
+static long edit_find_string_ (long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only, void *d)
 {E_
     long r;
     unsigned char *work_space1 = NULL, *work_space2 = NULL;
-    r = edit_find_string__ (&work_space1, &work_space2, start, exp, len, last_byte, get_byte, data, once_only, d);
+    r = edit_find_string__ (&work_space1, &work_space2, start, exp, len, last_byte, get_byte, get_span, data, once_only, d);
     free (work_space2);
     free (work_space1);
     return r;
 }
 
-long edit_find_string (long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), void *data, int once_only, void *d)
+long edit_find_string (long start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only, void *d)
 {E_
     int r;
     CStr s;
     s = CStr_dupstr(exp);
-    r = edit_find_string_ (start, s, len, last_byte, get_byte, data, once_only, d);
+    r = edit_find_string_ (start, s, len, last_byte, get_byte, get_span, data, once_only, d);
     CStr_free(&s);
     return r;
 }
 
-long edit_find_forwards (long search_start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), void *data, int once_only, void *d)
+long edit_find_forwards (long search_start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, int once_only, void *d)
 {				/*front end to find_string to check for
 				   whole words */
     long p;
     p = search_start;
 
-    while ((p = edit_find_string (p, exp, len, last_byte, get_byte, data, once_only, d)) >= 0) {
+    while ((p = edit_find_string (p, exp, len, last_byte, get_byte, get_span, data, once_only, d)) >= 0) {
 	if (replace_whole) {
 /*If the bordering chars are not in option_whole_chars_search then word is whole */
 	    if (!strcasechr (option_whole_chars_search, (*get_byte) (data, p - 1))
@@ -1966,18 +2260,20 @@ long edit_find_forwards (long search_start, CStr exp, int *len, long last_byte,
     return p;
 }
 
-long edit_find (long search_start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), void *data, void *d)
+long edit_find (long search_start, CStr exp, int *len, long last_byte, int (*get_byte) (void *, long), unsigned char *(*get_span) (void *, long, long *), void *data, void *d)
 {E_
     long p;
     if (replace_backwards) {
 	while (search_start >= 0) {
-	    p = edit_find_forwards (search_start, exp, len, last_byte, get_byte, data, 1, d);
-	    if (p == search_start)
+	    p = edit_find_forwards (search_start, exp, len, last_byte, get_byte, get_span, data, 1, d);
+	    if (p == search_start || p < -2)
 		return p;
 	    search_start--;
+	    if (!(search_start & 0xFFFF) && edit_search_poll (search_start))
+		return -4;
 	}
     } else {
-	return edit_find_forwards (search_start, exp, len, last_byte, get_byte, data, 0, d);
+	return edit_find_forwards (search_start, exp, len, last_byte, get_byte, get_span, data, 0, d);
     }
     return -2;
 }
@@ -2089,6 +2385,94 @@ static void regexp_error (WEdit *edit)
 }
 
 /* call with edit = 0 before shutdown to close memory leaks */
+/* formats the replacement for a scanf or regexp match at start into
+   repl_str, returns -1 if the format string is bad */
+static int edit_replace_format (WEdit * edit, CStr exp2, regmatch_t * pmatch, long start, int *argord, char *repl_str)
+{E_
+    if (replace_regexp) {	/* we need to fill in sargs just like with scanf */
+	int k, j;
+	for (k = 1; k < NUM_REPL_ARGS && pmatch[k].rm_eo >= 0; k++) {
+	    unsigned char *t;
+	    t = (unsigned char *) &sargs[k - 1][0];
+	    for (j = 0; j < pmatch[k].rm_eo - pmatch[k].rm_so && j < 255; j++, t++)
+		*t = (unsigned char) edit_get_byte (edit, start - pmatch[0].rm_so + pmatch[k].rm_so + j);
+	    *t = '\0';
+	}
+	for (; k <= NUM_REPL_ARGS; k++)
+	    sargs[k - 1][0] = 0;
+    }
+    return sprintf_p (repl_str, exp2.data, PRINTF_ARGS) >= 0 ? 0 : -1;
+}
+
+/*
+   Replace-all without prompting, forwards. Every match from start up to
+   last_search is found against the unchanged buffer while the new text
+   for the whole stretch from the first match to the end of the last is
+   assembled in memory. The buffer is then rebuilt once: one delete and
+   one insert, which undo as a single step. Returns the number of
+   replacements, or -1 if the format string is bad. *result is the last
+   return value of edit_find(), or -5 if memory ran out, in which case
+   the matches found so far are still replaced.
+ */
+static long edit_replace_all (WEdit * edit, long start, long last_search, CStr exp1, CStr exp2, regmatch_t * pmatch, int *argord, long *result)
+{E_
+    unsigned char *out = NULL, *t;
+    char *repl_str = NULL;
+    long out_len = 0, out_alloc = 0, first = -1, prev = 0, times = 0, n = 0, r;
+    const char *repl;
+    int len;
+
+    if (replace_scanf || replace_regexp)
+	repl_str = (char *) malloc (MAX_REPL_LEN + 8);
+    for (;;) {
+	r = edit_find (start, exp1, &len, last_search,
+		       (int (*)(void *, long)) edit_get_byte,
+		       (unsigned char *(*)(void *, long, long *)) edit_get_span, (void *) edit, pmatch);
+	*result = r;
+	if (r < 0)
+	    break;
+	if (repl_str) {
+	    if (edit_replace_format (edit, exp2, pmatch, r, argord, repl_str)) {
+		times = -1;
+		break;
+	    }
+	    repl = repl_str;
+	    n = strlen (repl_str);
+	} else {
+	    repl = exp2.data;
+	    n = exp2.len;
+	}
+	if (first < 0)
+	    first = prev = r;
+	if (out_len + (r - prev) + n > out_alloc) {
+	    out_alloc = max (out_alloc * 2, out_len + (r - prev) + n + EDIT_BUF_SIZE);
+	    if (!(t = (unsigned char *) realloc (out, out_alloc))) {
+		*result = -5;
+		break;
+	    }
+	    out = t;
+	}
+	edit_get_text (edit, prev, r, out + out_len);
+	out_len += r - prev;
+	memcpy (out + out_len, repl, n);
+	out_len += n;
+	prev = start = r + len;
+	times++;
+	search_count++;
+    }
+    if (times > 0) {
+	edit_cursor_move (edit, first - edit->curs1);
+	edit_delete_text (edit, prev - first);
+	edit_insert_ahead_text (edit, out, out_len);
+	edit_cursor_move (edit, out_len);
+	edit->found_start = edit->curs1 - n;
+	edit->found_len = n;
+    }
+    free (out);
+    free (repl_str);
+    return times;
+}
+
 void edit_replace_cmd (WEdit * edit, int again)
 {E_
     int cancel = 0;
@@ -2179,8 +2563,23 @@ void edit_replace_cmd (WEdit * edit, int again)
     do {
 	int len = 0;
 	long new_start;
-	new_start = edit_find (edit->search_start, exp1, &len, last_search,
-	   (int (*)(void *, long)) edit_get_byte, (void *) edit, pmatch);
+	if (!search_edit) {
+	    edit_search_progress_start (edit, _("Replacing"), edit->search_start, replace_backwards ? 0 : edit->last_byte);
+	    search_count = times_replaced;
+	}
+	if (replace_continue && !treplace_prompt && !replace_backwards) {
+	    long n;
+	    n = edit_replace_all (edit, edit->search_start, last_search, exp1, exp2, pmatch, argord, &new_start);
+	    if (n < 0) {
+		edit_search_progress_stop ();
+		edit_error_dialog (_ (" Replace "), _ (" Error in replacement format string. "));
+		break;
+	    }
+	    times_replaced += n;
+	} else
+	    new_start = edit_find (edit->search_start, exp1, &len, last_search,
+	       (int (*)(void *, long)) edit_get_byte,
+		       (unsigned char *(*)(void *, long, long *)) edit_get_span, (void *) edit, pmatch);
 	if (new_start == -3) {
 	    regexp_error (edit);
 	    break;
@@ -2193,12 +2592,13 @@ void edit_replace_cmd (WEdit * edit, int again)
 	    i = edit->found_len = len;
 
 	    edit_cursor_move (edit, edit->search_start - edit->curs1);
-	    edit_scroll_screen_over_cursor (edit);
 
 	    replace_yes = 1;
 
 	    if (treplace_prompt) {
 		int l;
+		edit_search_progress_stop ();
+		edit_scroll_screen_over_cursor (edit);
 		l = edit->curs_row - edit->num_widget_lines / 3;
 		if (l > 0)
 		    edit_scroll_downward (edit, l);
@@ -2237,20 +2637,8 @@ void edit_replace_cmd (WEdit * edit, int again)
 		if (replace_scanf || replace_regexp) {
 		    char *repl_str;
                     repl_str = (char *) malloc (MAX_REPL_LEN + 8);
-		    if (replace_regexp) {	/* we need to fill in sargs just like with scanf */
-			int k, j;
-			for (k = 1; k < NUM_REPL_ARGS && pmatch[k].rm_eo >= 0; k++) {
-			    unsigned char *t;
-			    t = (unsigned char *) &sargs[k - 1][0];
-			    for (j = 0; j < pmatch[k].rm_eo - pmatch[k].rm_so && j < 255; j++, t++)
-				*t = (unsigned char) edit_get_byte (edit, edit->search_start - pmatch[0].rm_so + pmatch[k].rm_so + j);
-			    *t = '\0';
-			}
-			for (; k <= NUM_REPL_ARGS; k++)
-			    sargs[k - 1][0] = 0;
-		    }
-		    if (sprintf_p (repl_str, exp2.data, PRINTF_ARGS) >= 0) {
-			times_replaced++;
+		    if (!edit_replace_format (edit, exp2, pmatch, edit->search_start, argord, repl_str)) {
+			search_count = ++times_replaced;
 			while (i--)
 			    edit_delete (edit);
 			while (repl_str[++i])
@@ -2263,7 +2651,7 @@ void edit_replace_cmd (WEdit * edit, int again)
 		    }
                     free (repl_str);
 		} else {
-		    times_replaced++;
+		    search_count = ++times_replaced;
 		    while (i--)
 			edit_delete (edit);
 		    while (++i < exp2.len)
@@ -2279,14 +2667,19 @@ void edit_replace_cmd (WEdit * edit, int again)
 		edit->search_start += i;
 		last_search = edit->last_byte;
 	    }
-	    edit_scroll_screen_over_cursor (edit);
+	    if (treplace_prompt)	/* replace-all only redraws once at the end */
+		edit_scroll_screen_over_cursor (edit);
 	} else {
+	    edit_search_progress_stop ();
 	    edit->search_start = edit->curs1;	/* try and find from right here for next search */
 	    edit_update_curs_col (edit);
 
 	    edit->force |= REDRAW_PAGE;
 	    edit_render_keypress (edit);
-	    if (times_replaced) {
+	    if (new_start == -4 || new_start == -5) {
+		sprintf (fin_string, _ (" Replace aborted, %ld replacements made. "), times_replaced);
+		edit_message_dialog (_ (" Replace "), fin_string);
+	    } else if (times_replaced) {
 		sprintf (fin_string, _ (" %ld replacements made. "), times_replaced);
 		edit_message_dialog (_ (" Replace "), fin_string);
 	    } else
@@ -2294,6 +2687,7 @@ void edit_replace_cmd (WEdit * edit, int again)
 	    replace_continue = 0;
 	}
     } while (replace_continue);
+    edit_search_progress_stop ();
 
   out:
     CStr_free(&exp1);
@@ -2341,12 +2735,14 @@ void edit_search_cmd (WEdit * edit, int again)
 		int found = 0, books = 0;
 		int l = 0, l_last = -1;
 		long p, q = 0;
+		edit_search_progress_start (edit, _("Searching"), 0, edit->last_byte);
 		for (;;) {
 		    p = edit_find (q, exp, &len, edit->last_byte,
-				   (int (*)(void *, long)) edit_get_byte, (void *) edit, 0);
+				   (int (*)(void *, long)) edit_get_byte,
+		   (unsigned char *(*)(void *, long, long *)) edit_get_span, (void *) edit, 0);
 		    if (p < 0)
 			break;
-		    found++;
+		    search_count = ++found;
 		    l += edit_count_lines (edit, q, p);
 		    if (l != l_last) {
 			book_mark_insert (edit, l, BOOK_MARK_FOUND_COLOR, 0, 0, 0);
@@ -2355,10 +2751,13 @@ void edit_search_cmd (WEdit * edit, int again)
 		    l_last = l;
 		    q = p + 1;
 		}
-		if (found) {
+		edit_search_progress_stop ();
+		if (p == -3) {
+		    regexp_error (edit);
+		} else if (found) {
 		    char fin_string[64];
 /* in response to number of bookmarks added because of string being found %d times */
-		    sprintf (fin_string, _ (" %d finds made, %d bookmarks added "), found, books);
+		    sprintf (fin_string, p == -4 ? _ (" Search aborted, %d finds made, %d bookmarks added ") : _ (" %d finds made, %d bookmarks added "), found, books);
 		    edit_message_dialog (_ (" Search "), fin_string);
 		} else {
 		    edit_error_dialog (_ (" Search "), _ (" Search string not found. "));
@@ -2371,8 +2770,11 @@ void edit_search_cmd (WEdit * edit, int again)
 		if (edit->found_len && edit->search_start == edit->found_start && !replace_backwards)
 		    edit->search_start += edit->found_len;
 
+		edit_search_progress_start (edit, _("Searching"), edit->search_start, replace_backwards ? 0 : edit->last_byte);
 		edit->search_start = edit_find (edit->search_start, exp, &len, edit->last_byte,
-		(int (*)(void *, long)) edit_get_byte, (void *) edit, 0);
+		(int (*)(void *, long)) edit_get_byte,
+		   (unsigned char *(*)(void *, long, long *)) edit_get_span, (void *) edit, 0);
+		edit_search_progress_stop ();
 
 		if (edit->search_start >= 0) {
 		    edit->found_start = edit->search_start;
@@ -2387,6 +2789,8 @@ void edit_search_cmd (WEdit * edit, int again)
 		} else if (edit->search_start == -3) {
 		    edit->search_start = edit->curs1;
 		    regexp_error (edit);
+		} else if (edit->search_start == -4) {
+		    edit->search_start = edit->curs1;	/* aborted by the user */
 		} else {
 		    edit->search_start = edit->curs1;
 		    edit_error_dialog (_ (" Search "), _ (" Search string not found. "));
@@ -2495,8 +2899,8 @@ unsigned char *edit_get_block (WEdit * edit, long start, long finish, int *l)
 	}
     } else {
 	*l = finish - start;
-	while (start < finish)
-	    *s++ = edit_get_byte (edit, start++);
+	edit_get_text (edit, start, finish, s);
+	s += *l;
     }
     *s = 0;
     return r;
@@ -2523,18 +2927,20 @@ int edit_save_block (WEdit * edit, const char *filename, long start, long finish
 	}
 	free (block);
     } else {
-	unsigned char *buf;
-	int i = start, end;
-	len = finish - start;
-	buf = malloc (TEMP_BUF_LEN);
-	while (start != finish) {
-	    end = min (finish, start + TEMP_BUF_LEN);
-	    for (; i < end; i++)
-		buf[i - start] = edit_get_byte (edit, i);
-	    len -= write (file, (char *) buf, end - start);
-	    start = end;
+	unsigned char *p;
+	long n;
+	int r;
+	len = 0;
+	while (start < finish) {	/* write straight out of the edit buffers */
+	    p = edit_get_span (edit, start, &n);
+	    n = min (n, finish - start);
+	    r = write (file, p, n);
+	    if (r <= 0) {
+		len = 1;
+		break;
+	    }
+	    start += r;
 	}
-	free (buf);
     }
     close (file);
     if (len)
@@ -9,8 +9,6 @@
 #include "edit.h"
 #include "remotefs.h"
 
-#define MAX_LINE_LEN 8192
-
 #if ! defined (MIDNIGHT) && ! defined (GTK)
 #include "app_glob.c"
 #include "coollocal.h"
@@ -175,6 +173,8 @@ void edit_status (WEdit * edit)
         host = (char *) strdup ("");
     if (edit_translate_key_in_key_compose ()) {
         snprintf (s, sizeof (s), "\034\030%s\033\035", possible_char ());
+    } else if (edit->progress) {
+        snprintf (s, sizeof (s), "\034\030%s\033\035", edit->progress);
     } else {
         sprintf (s,
 	     "\034%c%s\033\035  \034%s\035  \034%s%s%s%c\035  \034\030%02ld\033\035  \034%-4ld+%2ld=\030%4ld\033/%3ld\035  \034*%-5ld/%5ldb=%s\035%s  \034%s%s\035",
@@ -427,9 +427,9 @@ static void print_to_widget (WEdit * edit, long row, int start_col, float start_
 /* b pointer to begining of line */
 static void edit_draw_this_line_proportional (WEdit * edit, long b, long row, long start_col, long end_col)
 {E_
-    static unsigned int line[MAX_LINE_LEN];
-    unsigned int *p = line;
-    unsigned int *eol = &line[MAX_LINE_LEN - 1];
+    static unsigned int *line = 0;
+    static int line_len = 0;
+    unsigned int *p, *eol;
     long m1 = 0, m2 = 0, q, c1, c2;
     int col, start_col_real;
     unsigned int c;
@@ -441,6 +441,21 @@ static void edit_draw_this_line_proportional (WEdit * edit, long b, long row, lo
 	book_mark = -1;
 #endif
 
+/* only the visible columns are converted, and a tab may straddle either edge */
+    if (end_col - start_col + TAB_SIZE * 2 + 8 > line_len) {
+	unsigned int *t;
+/* out of memory, the old buffer still draws the start of the line */
+	t = realloc (line, (end_col - start_col + TAB_SIZE * 2 + 8) * sizeof (unsigned int));
+	if (t) {
+	    line = t;
+	    line_len = end_col - start_col + TAB_SIZE * 2 + 8;
+	} else if (!line) {
+	    return;
+	}
+    }
+    p = line;
+    eol = &line[line_len - 1];
+
     edit_get_syntax_color (edit, b - 1, &fg, &bg);
     q = edit_move_forward3 (edit, b, start_col - edit->start_col, 0);
     start_col_real = (col = (int) edit_move_forward3 (edit, b, 0, q)) + edit->start_col;
@@ -535,6 +550,7 @@ static void edit_draw_this_line_proportional (WEdit * edit, long b, long row, lo
 /* #define edit_draw_this_line edit_draw_this_line_proportional */
 
 int option_smooth_scrolling = 0;
+int option_copy_scrolling = 1;
 
 static int event_pending (WEdit * edit, int event_type)
 {E_
@@ -588,8 +604,6 @@ static int edit_draw_this_char (WEdit * edit, long curs, long row)
 #endif
 }
 
-void edit_draw_proportional_invalidate (int row_start, int row_end, int x_max);
-
 /* cursor must be in screen for other than REDRAW_PAGE passed in force */
 static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_y,
 		       long end_x, int event_type)
@@ -598,6 +612,7 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
     static int prev_curs_row = 0;
     static long prev_curs = 0;
     static long prev_start = -1;
+    static WEdit *prev_edit = 0;
 
 #ifndef MIDNIGHT
     static unsigned long prev_win = 0;
@@ -640,7 +655,7 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
 	    if (edit->start_line > prev_start) {
                 h = edit_height_delta (edit, prev_start, edit->start_line);
                 if (h <= threshold) {
-		    edit_draw_proportional (0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		    edit_draw_proportional_invalidate (edit->widget, 0, edit->num_widget_lines, CWidthOf (edit->widget));
 		    for (pos2 = 0, t = 0; t < time_division; t++) {
 		        int move, finish_up = 0;
 		        pos1 = h * (t + 1) / time_division;
@@ -672,7 +687,7 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
 	    } else if (edit->start_line < prev_start) {
                 h = edit_height_delta (edit, edit->start_line, prev_start);
                 if (h <= threshold) {
-		    edit_draw_proportional (0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		    edit_draw_proportional_invalidate (edit->widget, 0, edit->num_widget_lines, CWidthOf (edit->widget));
 		    for (pos2 = 0, t = 0; t < time_division; t++) {
 		        int move, finish_up = 0;
 		        pos1 = h * (t + 1) / time_division;
@@ -700,6 +715,36 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
 		    }
 	        }
 	    }
+	} else if (option_copy_scrolling && edit->start_line != prev_start && prev_edit == edit && prev_win == CWindowOf (edit->widget)
+		   && !EditExposeRedraw && !CCheckWindowEvent (edit->widget->winid, ExposureMask, 0)) {
+/* keep the rows that are still visible by moving their pixels, so that only the uncovered rows get drawn */
+	    int h, rows;
+	    rows = edit->start_line - prev_start;
+	    if (rows > 0)
+		h = edit_height_delta (edit, prev_start, edit->start_line);
+	    else
+		h = -edit_height_delta (edit, edit->start_line, prev_start);
+	    if (abs (h) < edit->widget->height - (EDIT_FRAME_H - 1) && edit_draw_proportional_shift (edit->widget, rows, h, CWidthOf (edit->widget))) {
+		if (h > 0) {
+		    XCopyArea (CDisplay, edit->widget->winid, edit->widget->winid, CGC,
+			       EDIT_TEXT_HORIZONTAL_OFFSET, EDIT_TEXT_VERTICAL_OFFSET + h,
+			       edit->widget->width - EDIT_FRAME_W, edit->widget->height - (EDIT_FRAME_H - 1) - h,
+			       EDIT_TEXT_HORIZONTAL_OFFSET, EDIT_TEXT_VERTICAL_OFFSET);
+		    XClearArea (CDisplay, edit->widget->winid, EDIT_TEXT_HORIZONTAL_OFFSET,
+				edit->widget->height - (EDIT_FRAME_H - 1) + EDIT_TEXT_VERTICAL_OFFSET - h,
+				edit->widget->width - EDIT_FRAME_W, h, 0);
+		} else {
+		    XCopyArea (CDisplay, edit->widget->winid, edit->widget->winid, CGC,
+			       EDIT_TEXT_HORIZONTAL_OFFSET, EDIT_TEXT_VERTICAL_OFFSET,
+			       edit->widget->width - EDIT_FRAME_W, edit->widget->height - (EDIT_FRAME_H - 1) + h,
+			       EDIT_TEXT_HORIZONTAL_OFFSET, EDIT_TEXT_VERTICAL_OFFSET - h);
+		    XClearArea (CDisplay, edit->widget->winid, EDIT_TEXT_HORIZONTAL_OFFSET, EDIT_TEXT_VERTICAL_OFFSET,
+				edit->widget->width - EDIT_FRAME_W, -h, 0);
+		}
+/* the flashing cursor must be redrawn to learn where it now is */
+		if (edit->curs_row >= 0)
+		    edit_draw_proportional_invalidate (edit->widget, edit->curs_row, edit->curs_row, CWidthOf (edit->widget));
+	    }
 	}
 #endif
 	if (!(force & REDRAW_IN_BOUNDS)) {	/* !REDRAW_IN_BOUNDS means to ignore bounds and redraw whole rows */
@@ -747,7 +792,7 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
                 row++;
 
                 if (y >= CHeightOf (edit->widget) - EDIT_FRAME_H + EDIT_TEXT_VERTICAL_OFFSET) {
-                    edit_draw_proportional_invalidate (row, edit->num_widget_lines, CWidthOf (edit->widget));
+                    edit_draw_proportional_invalidate (edit->widget, row, edit->num_widget_lines, CWidthOf (edit->widget));
                     break;
                 }
 
@@ -797,6 +842,7 @@ static int render_edit_text (WEdit * edit, long start_y, long start_x, long end_
   exit_render:
     edit->screen_modified = 0;
     prev_start = edit->start_line;
+    prev_edit = edit;
     CPopFont ();
 
     return drawn_extents_y;
@@ -921,6 +967,8 @@ void edit_render_expose (WEdit * edit, XExposeEvent * xexpose)
     EditExposeRedraw = 0;
 }
 
+#ifdef GTK
+
 void edit_render_keypress (WEdit * edit)
 {E_
     CPushFont ("editor", 0);
@@ -937,6 +985,30 @@ void edit_render_event (WEdit * edit, int event_type)
 
 #else
 
+static void edit_render_frame (CWidget * w)
+{E_
+    if (!w->editor)
+	return;
+    CPushFont ("editor", 0);
+    edit_render (w->editor, 0, 0, 0, 0, 0, 0);
+    CPopFont ();
+}
+
+/* the changes accumulate in edit->force until the next frame paints them all at once */
+void edit_render_keypress (WEdit * edit)
+{E_
+    CScheduleRender (edit->widget, edit_render_frame);
+}
+
+void edit_render_event (WEdit * edit, int event_type)
+{E_
+    CScheduleRender (edit->widget, edit_render_frame);
+}
+
+#endif
+
+#else
+
 void edit_render_keypress (WEdit * edit)
 {E_
     edit_render (edit, 0, 0, 0, 0, 0);
@@ -40,6 +40,23 @@ void edit_destroy_callback (CWidget * w)
 	CError ("Trying to destroy non-existing editor widget.\n");
 }
 
+/* called on every tick: lexes ahead in each editor a slice at a time */
+void edit_syntax_tick (void)
+{E_
+    CWidget *w;
+    int i = 0;
+    while (last_widget > i++) {
+	if (!(w = CIndex (i)))
+	    continue;
+	if (w->kind != C_EDITOR_WIDGET || !w->editor)
+	    continue;
+	if (edit_syntax_prelex (w->editor)) {
+	    w->editor->force |= REDRAW_PAGE;
+	    edit_render_keypress (w->editor);
+	}
+    }
+}
+
 #define CLOSE_ON_NO_DATA
 
 #define SHELL_INPUT_BUF_SIZE 1024
@@ -387,15 +404,13 @@ static int insert_drop (WEdit * e, Window from, unsigned char *data, int size, i
 		edit_insert_file (e, f = filename_from_url ((char *) data, size, strlen ("file:")));
 		free (f);
 	    } else {
-		while (size--)
-		    edit_insert_ahead (e, data[size]);
+		edit_insert_ahead_text (e, data, size);
 	    }
 	} else {
 	    if (column_highlighting) {
 		edit_insert_column_of_text (e, data, size, abs (e->column2 - e->column1));
 	    } else {
-		while (size--)
-		    edit_insert_ahead (e, data[size]);
+		edit_insert_ahead_text (e, data, size);
 	    }
 	}
     }
@@ -780,7 +780,7 @@ static void fielded_text_print_line (CWidget * w, long b, int row)
     edit_draw_proportional (w,
 			    (converttext_cb_t) convert_text_fielded_textbox,
                             (calctextpos_cb_t) calc_text_pos_fielded_textbox,
-			    -w->firstcolumn * FONT_MEAN_WIDTH, w->winid,
+			    -w->firstcolumn * FONT_MEAN_WIDTH, w,
 			    w->width, b, row, row * FONT_PIX_PER_LINE + EDIT_TEXT_VERTICAL_OFFSET, 0,
 			    1, 0, 0);
 }
@@ -15,11 +15,9 @@
 /* this file definatively relies on int being 32 bits or more */
 
 int option_long_whitespace = 0;
-int cache_width = 0;
-int cache_height = 0;
 
-/* must be a multiple of 8 */
-#define MAX_LINE_LEN 8192
+/* bytes between column marks along a long line */
+#define COLUMN_MARK_INTERVAL	1024
 
 
 /* background colors: marked is refers to mouse highlighting, highlighted refers to a found string. */
@@ -227,13 +225,46 @@ int edit_width_of_long_printable (C_wchar_t c)
     return width_of_long_printable (c);
 }
 
+/* decodes a chunk of the line at a time, so the scanning loops below index an array */
+#define WIDE_CHUNK	256
+
+struct wide_reader {
+    long start, end;
+    C_wchar_t ch[WIDE_CHUNK];
+};
+
+static inline C_wchar_t wide_get (WEdit * edit, struct wide_reader *w, long q)
+{E_
+    if (q < w->start || q >= w->end) {
+	w->start = q;
+	w->end = edit_get_wide_text (edit, q, q + WIDE_CHUNK, w->ch);
+    }
+    return w->ch[q - w->start];
+}
+
+/* column marks are only valid for the font and tab width they were measured with */
+#define COLUMN_TAB	(tab_width * 2 + (option_long_whitespace != 0))
+
 /* returns x pixel pos of char at offset *q with x not more than l */
 static int calc_text_pos (WEdit * edit, long b, long *q, int l)
 {E_
     int x = 0, xn = 0;
+    long bol = b, next_mark;
+    struct column_mark *m;
     C_wchar_t c;
+    struct wide_reader w;
+    w.start = w.end = 0;
+    if ((m = edit_column_mark (edit, bol, LONG_MAX, l, current_font, COLUMN_TAB))) {
+	b = m->offset;
+	x = xn = m->x;
+    }
+    next_mark = b + COLUMN_MARK_INTERVAL;
     for (;;) {
-	c = edit_get_wide_byte (edit, b);
+	c = wide_get (edit, &w, b);
+	if (b >= next_mark && c != -1) {
+	    edit_column_mark_add (edit, bol, b, x, current_font, COLUMN_TAB);
+	    next_mark = b + COLUMN_MARK_INTERVAL;
+	}
 	switch (c) {
 	case -1:
 /* no character since used up by a multi-byte sequence */
@@ -266,14 +297,27 @@ static int calc_text_pos (WEdit * edit, long b, long *q, int l)
 static int calc_text_len (WEdit * edit, long b, long upto)
 {E_
     int x = 0;
+    long bol = b, next_mark;
+    struct column_mark *m;
     C_wchar_t c;
+    struct wide_reader w;
+    w.start = w.end = 0;
+    if ((m = edit_column_mark (edit, bol, upto, INT_MAX, current_font, COLUMN_TAB))) {
+	b = m->offset;
+	x = m->x;
+    }
+    next_mark = b + COLUMN_MARK_INTERVAL;
     for (;;) {
 	if (b == upto) {
 	    if (x > edit->max_column)
 		edit->max_column = x;
 	    return x;
 	}
-	c = edit_get_wide_byte (edit, b);
+	c = wide_get (edit, &w, b);
+	if (b >= next_mark && c != -1) {
+	    edit_column_mark_add (edit, bol, b, x, current_font, COLUMN_TAB);
+	    next_mark = b + COLUMN_MARK_INTERVAL;
+	}
 	switch (c) {
 	case -1:
 /* no character since used up by a multi-byte sequence */
@@ -294,16 +338,105 @@ static int calc_text_len (WEdit * edit, long b, long upto)
     }
 }
 
+/* lines longer than this are measured through sparse column marks instead */
+#define COLUMN_DENSE_MAX	4096
+
+/* returns the x position of every offset on the line at b, or 0 if the line is too long */
+static struct column_cache *column_line (WEdit * edit, long b)
+{E_
+    struct column_cache *c;
+    C_wchar_t ch;
+    struct wide_reader w;
+    int x = 0, n;
+    c = edit_column_cache (edit, b, current_font, COLUMN_TAB);
+    if (c->n_x)
+	return c->n_x > 0 ? c : 0;
+    w.start = w.end = 0;
+    for (n = 0;; n++, b++) {
+	if (n == COLUMN_DENSE_MAX) {
+	    c->n_x = -1;
+	    return 0;
+	}
+	if (n == c->x_alloc) {
+	    int *t;
+	    t = realloc (c->x, (c->x_alloc * 2 + 128) * sizeof (int));
+	    if (!t) {
+/* out of memory, measure the line as though it were too long */
+		free (c->x);
+		c->x = 0;
+		c->x_alloc = 0;
+		c->n_x = -1;
+		return 0;
+	    }
+	    c->x = t;
+	    c->x_alloc = c->x_alloc * 2 + 128;
+	}
+	c->x[n] = x;
+	ch = wide_get (edit, &w, b);
+	if (ch == '\n')
+	    break;
+	if (ch == '\t')
+	    x = next_tab_pos (x);
+	else if (ch != -1)
+	    x += width_of_long_printable (ch);
+    }
+    c->n_x = n + 1;
+    return c;
+}
+
+/* as calc_text_len(), by lookup */
+static int line_text_len (WEdit * edit, struct column_cache *c, long upto)
+{E_
+    int x;
+    if (upto < c->bol || upto - c->bol >= c->n_x)
+	x = c->x[c->n_x - 1];
+    else
+	x = c->x[upto - c->bol];
+    if (x > edit->max_column)
+	edit->max_column = x;
+    return x;
+}
+
+/* as calc_text_pos(), by binary search: the first character that would end past l */
+static long line_text_pos (WEdit * edit, struct column_cache *c, int l)
+{E_
+    int i = 0, j = c->n_x - 1, k, x;
+    if (c->x[j] <= l || !j) {
+	i = j;
+    } else {
+	while (j - i > 1) {
+	    k = (i + j) / 2;
+	    if (c->x[k] > l)
+		j = k;
+	    else
+		i = k;
+	}
+	i = j - 1;
+    }
+    x = c->x[i];
+    if (x > edit->max_column)
+	edit->max_column = x;
+    return c->bol + i;
+}
+
 /* If pixels is zero this returns the count of pixels from current to upto. */
 /* If upto is zero returns index of pixels across from current. */
 long edit_move_forward3 (WEdit * edit, long current, int pixels, long upto)
 {E_
+    struct column_cache *c;
     CPushFont ("editor", 0);
     if (upto) {
-	current = calc_text_len (edit, current, upto);
+	if ((c = column_line (edit, current)))
+	    current = line_text_len (edit, c, upto);
+	else
+	    current = calc_text_len (edit, current, upto);
     } else if (pixels) {
 	long q;
-	calc_text_pos (edit, current, &q, pixels);
+	if ((c = column_line (edit, current))) {
+	    q = line_text_pos (edit, c, pixels);
+	} else {
+	    calc_text_pos (edit, current, &q, pixels);
+	}
 	current = q;
     }
     CPopFont ();
@@ -366,7 +499,9 @@ static void convert_text (WEdit * edit, long bol, long q, cache_type * p, cache_
     C_wchar_t text[12];
     int n_bookmarks = 0;
     int column_marker = -1;
+    struct wide_reader w;
     struct _book_mark *book_mark_colors[10];
+    w.start = w.end = 0;
     eval_marks (edit, &m1, &m2);
 
     for (i = 0; i < all_bookmarks; i++) {
@@ -390,7 +525,7 @@ static void convert_text (WEdit * edit, long bol, long q, cache_type * p, cache_
     if (n_bookmarks) {
 	int the_end = 0, book_mark_cycle = 0;
 	for (;;) {
-	    c = edit_get_wide_byte (edit, q);
+	    c = wide_get (edit, &w, q);
 	    if (!the_end) {
 		*p = get_style (edit, q, c, m1, m2, x);
                 if (column_marker != -1 && bol + column_marker == q)
@@ -454,7 +589,7 @@ static void convert_text (WEdit * edit, long bol, long q, cache_type * p, cache_
     } else if ((m2 < q) && (edit->curs1 < q) && (edit->found_start + edit->found_len < q) && (edit->bracket < q)) {
 #endif
 	for (;;) {
-	    c = edit_get_wide_byte (edit, q);
+	    c = wide_get (edit, &w, q);
 	    *p = get_style_fast (edit, q, c);
             if (column_marker != -1 && bol + column_marker == q)
                 p->c.style |= MOD_UNDERCARET;
@@ -507,7 +642,7 @@ static void convert_text (WEdit * edit, long bol, long q, cache_type * p, cache_
 	}
     } else {
 	for (;;) {
-	    c = edit_get_wide_byte (edit, q);
+	    c = wide_get (edit, &w, q);
 	    *p = get_style (edit, q, c, m1, m2, x);
             if (column_marker != -1 && bol + column_marker == q)
                 p->c.style |= MOD_UNDERCARET;
@@ -638,7 +773,7 @@ static int draw_string (Window win, int x, int y, cache_type s, XChar2b *text, C
 	    || ((cache->c.style | line->c.style) & MOD_CURSOR) \
 	    || !(cache->c.ch | cache->_style) || !(line->c.ch | line->_style))
 
-int get_ignore_length (cache_type *cache, cache_type *line)
+int get_ignore_length (cache_type *cache, cache_type *line, int cache_width)
 {E_
     int i;
     for (i = 0; i < cache_width; i++, line++, cache++) {
@@ -662,7 +797,7 @@ static inline size_t lwstrlen (const cache_type * s)
     return sc - s;
 }
 
-int get_ignore_trailer (cache_type *cache, cache_type *line, int length)
+int get_ignore_trailer (cache_type *cache, cache_type *line, int length, int cache_width)
 {E_
     int i;
     int cache_len, line_len;
@@ -711,37 +846,56 @@ struct cache_line {
     cache_type *data;
 };
 
-struct cache_line *cache_lines = 0;
+/* what each row of a widget was last drawn with, so that a redraw need only draw what changed */
+struct line_cache {
+    int width, height;
+    int valid;			/* cleared after an expose redraw */
+    struct cache_line *lines;
+    cache_type *line;		/* the line being converted, enough cells for one screen width */
+    int line_len;
+};
 
-void edit_free_cache_lines (void)
+void edit_free_line_cache (CWidget * w)
 {E_
     int i;
-    if (cache_lines) {
-	for (i = 0; i < cache_height; i++)
-	    free (cache_lines[i].data);
-	free (cache_lines);
-	cache_lines = 0;
+    struct line_cache *c = w->line_cache;
+    if (c) {
+	for (i = 0; i < c->height; i++)
+	    free (c->lines[i].data);
+	free (c->lines);
+	free (c->line);
+	free (c);
+	w->line_cache = 0;
     }
 }
 
-static void edit_realloc_cache_lines (int width, int height)
+static struct line_cache *edit_realloc_line_cache (CWidget * w, int width, int height)
 {E_
-    if (width > cache_width || height > cache_height) {
+    struct line_cache *c = w->line_cache;
+    if (!c || width > c->width || height > c->height) {
 	int i;
-	edit_free_cache_lines ();
-	cache_width = max (width + 10, cache_width);
-	cache_height = max (height + 10, cache_height);
-	cache_lines = malloc (sizeof (struct cache_line) * cache_height);
-	memset (cache_lines, 0, sizeof (struct cache_line) * cache_height);
-	for (i = 0; i < cache_height; i++) {
-	    cache_lines[i].data = malloc (sizeof (cache_type) * (cache_width + 1));
-	    memset (cache_lines[i].data, 0, sizeof (cache_type) * (cache_width + 1));
-	    cache_lines[i].x0 = NOT_VALID;
-	    cache_lines[i].x1 = 10000;
-	    cache_lines[i].y = -1;
-	    cache_lines[i].bookmarkhash = 0;
+	width = c ? max (width + 10, c->width) : width + 10;
+	height = c ? max (height + 10, c->height) : height + 10;
+	edit_free_line_cache (w);
+	c = w->line_cache = malloc (sizeof (struct line_cache));
+	c->width = width;
+	c->height = height;
+	c->valid = 0;
+	c->lines = malloc (sizeof (struct cache_line) * c->height);
+	memset (c->lines, 0, sizeof (struct cache_line) * c->height);
+	for (i = 0; i < c->height; i++) {
+	    c->lines[i].data = malloc (sizeof (cache_type) * (c->width + 1));
+	    memset (c->lines[i].data, 0, sizeof (cache_type) * (c->width + 1));
+	    c->lines[i].x0 = NOT_VALID;
+	    c->lines[i].x1 = 10000;
+	    c->lines[i].y = -1;
+	    c->lines[i].bookmarkhash = 0;
 	}
+/* every cell is at least a pixel wide, and the conversion stops at the right edge */
+	c->line_len = c->width * 3 + 64;
+	c->line = malloc (sizeof (cache_type) * c->line_len);
     }
+    return c;
 }
 
 /*
@@ -876,22 +1030,68 @@ static unsigned int book_marks_calc_hash (struct _book_mark **book_marks, int n_
     return r;
 }
 
-void edit_draw_proportional_invalidate (int row_start, int row_end, int x_max)
+void edit_draw_proportional_invalidate (CWidget * w, int row_start, int row_end, int x_max)
 {E_
     int i;
-    for (i = row_start; i <= row_end && i < cache_height; i++) {
-	cache_lines[i].x0 = NOT_VALID;
-	cache_lines[i].x1 = x_max;
-	cache_lines[i].y = -1;
-	cache_lines[i].bookmarkhash = 0;
+    struct line_cache *c = w->line_cache;
+    if (!c)
+	return;
+    for (i = row_start; i <= row_end && i < c->height; i++) {
+	c->lines[i].x0 = NOT_VALID;
+	c->lines[i].x1 = x_max;
+	c->lines[i].y = -1;
+	c->lines[i].bookmarkhash = 0;
     }
 }
 
+/*
+   The window contents were copied up by h pixels (down if h is negative),
+   so what was drawn on row i + rows is now on row i. Move the remembered
+   lines to match, so that only the uncovered rows get drawn. Returns 0 if
+   nothing is remembered, or memory ran out, in which case the copy would
+   be wasted.
+ */
+int edit_draw_proportional_shift (CWidget * w, int rows, int h, int x_max)
+{E_
+    struct line_cache *c = w->line_cache;
+    struct cache_line *t;
+    int i, n;
+    if (!c || !c->valid || !rows || abs (rows) >= c->height)
+	return 0;
+    n = abs (rows);
+    t = malloc (n * sizeof (struct cache_line));
+    if (!t)
+	return 0;
+    if (rows > 0) {
+	memcpy (t, c->lines, n * sizeof (struct cache_line));
+	memmove (c->lines, c->lines + n, (c->height - n) * sizeof (struct cache_line));
+	memcpy (c->lines + c->height - n, t, n * sizeof (struct cache_line));
+    } else {
+	memcpy (t, c->lines + c->height - n, n * sizeof (struct cache_line));
+	memmove (c->lines + n, c->lines, (c->height - n) * sizeof (struct cache_line));
+	memcpy (c->lines, t, n * sizeof (struct cache_line));
+    }
+    free (t);
+    for (i = 0; i < c->height; i++)
+	if (c->lines[i].y != -1)
+	    c->lines[i].y -= h;
+    if (rows > 0) {
+	edit_draw_proportional_invalidate (w, c->height - n, c->height - 1, x_max);
+/* the last row may have been cut off by the bottom edge before it moved up */
+	for (i = c->height - n - 1; i >= 0 && c->lines[i].y == -1; i--);
+	if (i >= 0)
+	    edit_draw_proportional_invalidate (w, i, i, x_max);
+    } else {
+	edit_draw_proportional_invalidate (w, 0, n - 1, x_max);
+    }
+    return 1;
+}
+
 int edit_draw_proportional (void *data,
 	                        converttext_cb_t converttext,
                                 calctextpos_cb_t calctextpos,
 				int scroll_right,
-				Window win,
+				CWidget * w,
 				int x_max,
 				long b,
 				int row,
@@ -901,8 +1101,10 @@ int edit_draw_proportional (void *data,
                                 struct _book_mark **book_marks,
                                 int n_book_marks)
 {E_
-    static Window last = 0;
-    cache_type style, line[MAX_LINE_LEN], *p, *eol;
+    Window win = w->winid;
+    struct line_cache *c;
+    struct cache_line *cache;
+    cache_type style, *line, *p, *eol;
     XChar2b text[128];
     C_wchar_t textwc[128];
     int x0, x, ignore_text = 0, ignore_trailer = 2000000000, j, i, undercaret_offset = -1, drawn_extents_y = 0;
@@ -915,19 +1117,14 @@ int edit_draw_proportional (void *data,
 
     x_max -= 3;
 
-    edit_realloc_cache_lines (x_max / 3, row + 1);
+    c = edit_realloc_line_cache (w, x_max / 3, row + 1);
+    cache = &c->lines[row];
+    line = c->line;
 
-/* if its not the same window, reset the screen rememberer */
-    if (last != win || !win) {
-	last = win;
-        for (i = 0; i < cache_height; i++) {
-	    cache_lines[i].x0 = NOT_VALID;
-	    cache_lines[i].x1 = x_max;
-	    cache_lines[i].y = -1;
-	    cache_lines[i].bookmarkhash = 0;
-        }
-	if (!win)
-	    return 0;
+/* if the window was last drawn by an expose, reset the screen rememberer */
+    if (!c->valid) {
+	c->valid = 1;
+	edit_draw_proportional_invalidate (w, 0, c->height - 1, x_max);
     }
 
     drawn_extents_y = y + FONT_PIX_PER_LINE;
@@ -936,18 +1133,12 @@ int edit_draw_proportional (void *data,
     x0 = (*calctextpos) (data, b, &q, -scroll_right + x_offset);
 /* q contains the offset in the edit buffer */
 
-/* translate this line into printable characters with a style (=color) high byte */
-    for (i = 0; i < MAX_LINE_LEN; i += 8) {
-	line[i]._style = line[i].c.ch = 0;
-	line[i + 1]._style = line[i + 1].c.ch = 0;
-	line[i + 2]._style = line[i + 2].c.ch = 0;
-	line[i + 3]._style = line[i + 3].c.ch = 0;
-	line[i + 4]._style = line[i + 4].c.ch = 0;
-	line[i + 5]._style = line[i + 5].c.ch = 0;
-	line[i + 6]._style = line[i + 6].c.ch = 0;
-	line[i + 7]._style = line[i + 7].c.ch = 0;
-    }
-    (*converttext) (data, b, q, line, &line[MAX_LINE_LEN - 16], x0, x_max - scroll_right - EDIT_TEXT_HORIZONTAL_OFFSET, row, book_marks, n_book_marks);
+/* translate the visible part of this line into printable characters with a style (=color) high byte */
+    (*converttext) (data, b, q, line, &line[c->line_len - 16], x0, x_max - scroll_right - EDIT_TEXT_HORIZONTAL_OFFSET, row, book_marks, n_book_marks);
+/* the comparison with the previous line runs the full cache width */
+    i = lwstrnlen (line, c->width);
+    if (i < c->width)
+	memset (&line[i], 0, (c->width - i) * sizeof (cache_type));
     reverse_text (line);
 
 /* adjust for the horizontal scroll and border */
@@ -956,14 +1147,14 @@ int edit_draw_proportional (void *data,
 
 /* is some of the line identical to that already printed so that we can ignore it? */
     if (!EditExposeRedraw) {
-	if (cache_lines[row].x0 == x0 && cache_lines[row].y == y && row < cache_height) {	/* i.e. also  && cache_lines[row].x0 != NOT_VALID */
-	    ignore_text = get_ignore_length (cache_lines[row].data, line);
+	if (cache->x0 == x0 && cache->y == y) {	/* i.e. also  && cache->x0 != NOT_VALID */
+	    ignore_text = get_ignore_length (cache->data, line, c->width);
 	    if (FIXED_FONT)
-		ignore_trailer = get_ignore_trailer (cache_lines[row].data, line, ignore_text);
+		ignore_trailer = get_ignore_trailer (cache->data, line, ignore_text, c->width);
 	}
     }
     p = line;
-    eol = &line[MAX_LINE_LEN - 1];
+    eol = &line[c->line_len - 1];
     j = 0;
     while (p->c.ch | p->_style) {
 	if (p->c.style & MOD_UNDERCARET)
@@ -1008,15 +1199,15 @@ int edit_draw_proportional (void *data,
     x = min (x, x_max);
 
     if (!EditExposeRedraw || EditClear) {
-        if (cache_lines[row].y == y)
-	    cover_trail (win, x0, x, cache_lines[row].x1, y, 0);
-        else if (cache_lines[row].y != y)
+        if (cache->y == y)
+	    cover_trail (win, x0, x, cache->x1, y, 0);
+        else if (cache->y != y)
             cover_trail (win, x_offset, x, x_max, y, 1);
     }
 
     bookmarkhash = book_marks_calc_hash (book_marks, n_book_marks, undercaret_offset);
 
-    if (EditExposeRedraw || cache_lines[row].bookmarkhash != bookmarkhash || cache_lines[row].y != y) {
+    if (EditExposeRedraw || cache->bookmarkhash != bookmarkhash || cache->y != y) {
         int i, h;
         for (h = 0, i = 0; i < n_book_marks; i++) {
             int H, Y;
@@ -1085,21 +1276,19 @@ int edit_draw_proportional (void *data,
         }
     }
 
-    memcpy (&(cache_lines[row].data[ignore_text]),
+    memcpy (&(cache->data[ignore_text]),
 	    &(line[ignore_text]),
-	 (min (j, cache_width) - ignore_text) * sizeof (cache_type));
+	 (min (j, c->width) - ignore_text) * sizeof (cache_type));
 
-    cache_lines[row].data[min (j, cache_width)].c.ch = 0;
-    cache_lines[row].data[min (j, cache_width)]._style = 0;
+    cache->data[min (j, c->width)].c.ch = 0;
+    cache->data[min (j, c->width)]._style = 0;
 
-    cache_lines[row].x0 = x0;
-    cache_lines[row].x1 = x;
-    cache_lines[row].y = y;
-    cache_lines[row].bookmarkhash = bookmarkhash;
+    cache->x0 = x0;
+    cache->x1 = x;
+    cache->y = y;
+    cache->bookmarkhash = bookmarkhash;
     if (EditExposeRedraw)
-	last = 0;
-    else
-	last = win;
+	c->valid = 0;
     return drawn_extents_y;
 }
 
@@ -1122,7 +1311,7 @@ int edit_draw_this_line_proportional (WEdit * edit, long b, int row, int y, int
     y = edit_draw_proportional (edit,
 			    (converttext_cb_t) convert_text,
 			    (calctextpos_cb_t) calc_text_pos,
-			    edit->start_col, CWindowOf (edit->widget),
+			    edit->start_col, edit->widget,
 			    end_column, b, row, y,
 			    EditExposeRedraw ? start_column : 0, FONT_PER_CHAR(' ') * TAB_SIZE,
                             book_marks, n_book_marks);
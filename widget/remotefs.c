@@ -69,6 +69,19 @@
 #include <sys/filio.h>
 #endif
 
+#if defined(__linux__) && !defined(MSWIN)
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#endif
+
+#ifndef MSWIN
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "remotefs.h"
 #include "dirtools.h"
 #include "aes.h"
@@ -106,6 +119,7 @@
 int option_remote_timeout = 2000;
 int option_no_crypto = 0;
 int option_force_crypto = 0;
+int option_workers = 0;
 
 
 char *pathdup_ (const char *p, const char *home_dir);
@@ -130,8 +144,9 @@ static int windows_rename (const char *a, const char *b)
 static const char *translate_path_sep (const char *p)
 {E_
     char *s;
-    static unsigned int rotate = 0;
-    static char r_[2][MAX_PATH_LEN * 2];
+/* per thread, as the server's workers call this too: */
+    static __thread unsigned int rotate = 0;
+    static __thread char r_[2][MAX_PATH_LEN * 2];
     char *r;
     int l;
     rotate++;
@@ -1404,6 +1419,14 @@ struct sock_data {
     int crypto;
     int enable_crypto;
     struct crypto_data crypto_data;
+/* set once the remote has answered REMOTEFS_ACTION_OPENFILE with NOTIMPLEMENTED */
+    int no_openfile;
+/* whether file data is sent in compressed frames, asked once per connection */
+#define COMPRESS_UNKNOWN        0
+#define COMPRESS_YES            1
+#define COMPRESS_NO             2
+    int compress;
+    struct compress_data *compress_data;
 };
 
 struct remotefs_private {
@@ -1418,6 +1441,8 @@ void SHUTSOCK (struct sock_data *p)
         p->crypto = 0;
         p->crypto_data.read_buf.avail = 0;
         p->crypto_data.read_buf.written = 0;
+        p->no_openfile = 0;
+        p->compress = COMPRESS_UNKNOWN;
 
         shutdown (p->sock, 2);
         closesocket (p->sock);
@@ -1428,6 +1453,16 @@ void SHUTSOCK (struct sock_data *p)
 #define MSG_VERSION                             1
 #define FILE_PROTO_MAGIC                        0x726f
 
+/* A tagged request is not acked. Its body starts with a 4 byte request
+   id that is echoed at the start of the response body, so that many
+   requests can be out on a connection at once and be answered in any
+   order. A remote that answers REMOTEFS_ACTION_TAGGED takes them. Only
+   the server side is here: this client still sends one v1 request at a
+   time, since none of its callers has independent requests to batch. */
+#define MSG_VERSION_TAGGED                      3
+#define TAGGED_ID_LEN                           4
+#define TAGGED_MAX                              64
+
 
 #define REMOTEFS_ACTION_NOTIMPLEMENTED          0
 #define REMOTEFS_ACTION_READDIR                 1
@@ -1439,6 +1474,9 @@ void SHUTSOCK (struct sock_data *p)
 #define REMOTEFS_ACTION_REALPATHIZE             7
 #define REMOTEFS_ACTION_GETHOMEDIR              8
 #define REMOTEFS_ACTION_ENABLECRYPTO            9
+#define REMOTEFS_ACTION_TAGGED                  10
+#define REMOTEFS_ACTION_OPENFILE                11
+#define REMOTEFS_ACTION_COMPRESS                12
 
 const char *action_descr[] = {
     "NOTIMPLEMENTED",
@@ -1451,6 +1489,9 @@ const char *action_descr[] = {
     "REALPATHIZE",
     "GETHOMEDIR",
     "ENABLECRYPTO",
+    "TAGGED",
+    "OPENFILE",
+    "COMPRESS",
 };
 
 
@@ -2654,10 +2695,9 @@ static int decode_error (const unsigned char **p, const unsigned char *end, remo
     return 0;
 }
 
-static char *dname (struct dirent *directentry)
+static char *dname (struct dirent *directentry, char *t)
 {E_
     int l;
-    static char t[MAX_PATH_LEN];
     l = NAMLEN (directentry);
     if (l >= MAX_PATH_LEN)
         l = MAX_PATH_LEN - 1;
@@ -2843,7 +2883,8 @@ static int writer_ (struct sock_data *sock_data, const void *p_, long l)
     return 0;
 }
 
-static int writervec (struct sock_data *sock_data, CStr *v, int n)
+/* encrypts v[] into one packet in crypto_data.write_buf and returns the packet length */
+static long crypto_packet (struct sock_data *sock_data, CStr *v, int n)
 {E_
     unsigned long blocks, pad_bytes;
     unsigned char *p, *q;
@@ -2851,19 +2892,9 @@ static int writervec (struct sock_data *sock_data, CStr *v, int n)
     int l, i;
 
 #define LOOP(u, init)       for ((u) = (init), i = 0; i < n; (u) += v[i].len, i++)
-    assert (n > 0);
     LOOP (l, 0);
     assert (l > 0);
 
-    if (!sock_data->crypto) {
-        int c, dummy;
-        LOOP (dummy, 0) {
-            if ((c = writer_ (sock_data, v[i].data, v[i].len)))
-                return c;
-        }
-        return 0;
-    }
-
     assert (l + SYMAUTH_PREQUEL_BYTES + SYMAUTH_ADMIN_BLOCKS * SYMAUTH_BLOCK_SIZE <= sizeof (sock_data->crypto_data.write_buf));
 
     p = sock_data->crypto_data.write_buf;
@@ -2882,7 +2913,26 @@ static int writervec (struct sock_data *sock_data, CStr *v, int n)
 
     symauth_encrypt (sock_data->crypto_data.symauth, (unsigned char *) &h->first_block, SYMAUTH_ENCRYPT_LEN(blocks), (unsigned char *) &h->first_block, (unsigned char *) h->iv, ((unsigned char *) (h + 1)) + (blocks - SYMAUTH_ADMIN_BLOCKS) * SYMAUTH_BLOCK_SIZE);
 
-    return writer_ (sock_data, p, SYMAUTH_PREQUEL_BYTES + blocks * SYMAUTH_BLOCK_SIZE);
+    return SYMAUTH_PREQUEL_BYTES + blocks * SYMAUTH_BLOCK_SIZE;
+#undef LOOP
+}
+
+static int writervec (struct sock_data *sock_data, CStr *v, int n)
+{E_
+    int i;
+
+    assert (n > 0);
+
+    if (!sock_data->crypto) {
+        int c;
+        for (i = 0; i < n; i++) {
+            if ((c = writer_ (sock_data, v[i].data, v[i].len)))
+                return c;
+        }
+        return 0;
+    }
+
+    return writer_ (sock_data, sock_data->crypto_data.write_buf, crypto_packet (sock_data, v, n));
 }
 
 static int writer (struct sock_data *sock_data, const void *p, long l)
@@ -3020,6 +3070,32 @@ static int recv_crypto (struct sock_data *sock_data, unsigned char *out, int out
     return c;
 }
 
+/* Reads whatever the socket has ready into the empty d->buf without
+   blocking. Returns the count of bytes added, 0 if none are ready yet,
+   or -1 on error or hangup. */
+static int reader_fill (struct reader_data *d, enum reader_error *reader_error)
+{E_
+    int c, waiting = 0;
+    assert (d->written == d->avail);
+    d->written = d->avail = 0;
+    if (d->sock_data->crypto)
+        c = recv_crypto (d->sock_data, d->buf, READER_CHUNK, &waiting, reader_error);
+    else
+        c = recv (d->sock_data->sock, (void *) d->buf, READER_CHUNK, 0);
+    if (!c) {
+        errno = 0;
+        return -1;
+    } else if (c == SOCKET_ERROR && *reader_error != READER_ERROR_NOERROR) {
+        return -1;
+    } else if (waiting || (c == SOCKET_ERROR && (ERROR_EAGAIN() || ERROR_EINTR()))) {
+        return 0;
+    } else if (c == SOCKET_ERROR) {
+        return -1;
+    }
+    d->avail = c;
+    return c;
+}
+
 static int reader_timeout (struct reader_data *d, void *buf_, int buflen, long milliseconds, enum reader_error *reader_error)
 {E_
     struct timeval t1, t2;
@@ -3080,6 +3156,166 @@ static int reader (struct reader_data *d, void *buf, int buflen, enum reader_err
 }
 
 
+/* Once REMOTEFS_ACTION_COMPRESS is agreed, the file data of READFILE,
+   WRITEFILE and OPENFILE goes as frames of at most FRAME_CHUNK bytes.
+   Each frame is a header of the raw and sent lengths, then the chunk
+   deflated on its own, or as is where that did not make it smaller.
+   A frame fits in one crypto packet. */
+#define COMPRESS_METHOD_DEFLATE 1
+#define FRAME_HEADER_LEN        8
+#define FRAME_CHUNK             (READER_CHUNK - FRAME_HEADER_LEN)
+/* after a chunk that did not shrink, this many are sent as is before trying again */
+#define COMPRESS_BACKOFF_MAX    16
+
+struct compress_data {
+#ifdef HAVE_LIBZ
+    z_stream deflate;
+    z_stream inflate;
+#endif
+    int deflate_init;
+    int inflate_init;
+    int skip;
+    int backoff;
+    long long raw;      /* totals for the log */
+    long long wire;
+};
+
+/* Returns the compression state, which starts afresh for each file, or
+   NULL if out of memory. Frames still go with a NULL state, but as is. */
+static struct compress_data *compress_start (struct sock_data *sock_data)
+{E_
+    struct compress_data *z;
+    if (!(z = sock_data->compress_data)) {
+        if (!(z = (struct compress_data *) malloc (sizeof (struct compress_data))))
+            return NULL;
+        memset (z, '\0', sizeof (struct compress_data));
+        sock_data->compress_data = z;
+    }
+    z->skip = 0;
+    z->backoff = 1;
+    z->raw = z->wire = 0;
+    return z;
+}
+
+static void free_compress_data (struct sock_data *sock_data)
+{E_
+    struct compress_data *z;
+    if (!(z = sock_data->compress_data))
+        return;
+#ifdef HAVE_LIBZ
+    if (z->deflate_init)
+        deflateEnd (&z->deflate);
+    if (z->inflate_init)
+        inflateEnd (&z->inflate);
+#endif
+    free (z);
+    sock_data->compress_data = NULL;
+}
+
+/* Fills in the frame header h for the len bytes at in, which are
+   deflated into out if that makes them smaller. Returns the frame data
+   and its length in *outlen. */
+static const unsigned char *frame_pack (struct compress_data *z, unsigned char *h, const unsigned char *in, int len, unsigned char *out, int *outlen)
+{E_
+    const unsigned char *r = in;
+    int c = len;
+
+    if (!z) {
+        /* compression is off for this transfer */
+    } else if (z->skip > 0) {
+        z->skip--;
+    } else {
+#ifdef HAVE_LIBZ
+        if (!z->deflate_init && deflateInit2 (&z->deflate, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+            z->deflate_init = 1;
+        if (z->deflate_init && deflateReset (&z->deflate) == Z_OK) {
+            z->deflate.next_in = (Bytef *) in;
+            z->deflate.avail_in = len;
+            z->deflate.next_out = out;
+            z->deflate.avail_out = len - 1;
+/* running out of room means the chunk does not shrink */
+            if (deflate (&z->deflate, Z_FINISH) == Z_STREAM_END) {
+                c = len - 1 - z->deflate.avail_out;
+                r = out;
+            }
+        }
+#endif
+        if (r == in) {
+            z->skip = z->backoff;
+            z->backoff = MIN (z->backoff * 2, COMPRESS_BACKOFF_MAX);
+        } else {
+            z->backoff = 1;
+        }
+    }
+
+    encode_uint32 (h, len);
+    encode_uint32 (h + 4, c);
+    if (z) {
+        z->raw += len;
+        z->wire += FRAME_HEADER_LEN + c;
+    }
+    *outlen = c;
+    return r;
+}
+
+/* decodes a frame header, returning -1 if it is not one that frame_pack() could have made */
+static int frame_header (const unsigned char *h, long long remaining, int *rawlen, int *wirelen)
+{E_
+    unsigned long raw, wire;
+    decode_uint32 (h, &raw);
+    decode_uint32 (h + 4, &wire);
+    if (!raw || raw > FRAME_CHUNK || raw > remaining || !wire || wire > raw)
+        return -1;
+    *rawlen = raw;
+    *wirelen = wire;
+    return 0;
+}
+
+/* the reverse of frame_pack(), returns NULL if the frame is corrupt */
+static const unsigned char *frame_unpack (struct compress_data *z, const unsigned char *in, int wirelen, unsigned char *out, int rawlen)
+{E_
+    const unsigned char *r = NULL;
+
+    if (wirelen == rawlen) {
+        r = in;
+    } else if (z) {
+#ifdef HAVE_LIBZ
+        if (!z->inflate_init && inflateInit2 (&z->inflate, -MAX_WBITS) == Z_OK)
+            z->inflate_init = 1;
+        if (!z->inflate_init || inflateReset (&z->inflate) != Z_OK)
+            return NULL;
+        z->inflate.next_in = (Bytef *) in;
+        z->inflate.avail_in = wirelen;
+        z->inflate.next_out = out;
+        z->inflate.avail_out = rawlen;
+        if (inflate (&z->inflate, Z_FINISH) == Z_STREAM_END && !z->inflate.avail_out && !z->inflate.avail_in)
+            r = out;
+#endif
+    }
+
+    if (r && z) {
+        z->raw += rawlen;
+        z->wire += FRAME_HEADER_LEN + wirelen;
+    }
+    return r;
+}
+
+/* The server's worker threads share a few things, see struct worker_pool: */
+#ifdef MSWIN
+typedef volatile LONG remotefs_lock_t;
+#define REMOTEFS_LOCK_INITIALIZER       0
+#define remotefs_lock(l)                do { while (InterlockedExchange ((l), 1)) Sleep (0); } while (0)
+#define remotefs_unlock(l)              InterlockedExchange ((l), 0)
+#else
+typedef pthread_mutex_t remotefs_lock_t;
+#define REMOTEFS_LOCK_INITIALIZER       PTHREAD_MUTEX_INITIALIZER
+#define remotefs_lock(l)                pthread_mutex_lock (l)
+#define remotefs_unlock(l)              pthread_mutex_unlock (l)
+#endif
+
+/* regexp_match() keeps the last compiled pattern in statics */
+static remotefs_lock_t regexp_lock = REMOTEFS_LOCK_INITIALIZER;
+
 static void remotefs_listdir_ (const char *directory, unsigned long options, char *filter, CStr *r)
 {E_
     struct file_entry_item *first = NULL, *i, *next;
@@ -3087,6 +3323,7 @@ static void remotefs_listdir_ (const char *directory, unsigned long options, cha
     struct portable_stat stats;
     DIR *dir;
     char path_fname[MAX_PATH_LEN * 2];
+    char dn_[MAX_PATH_LEN];
     unsigned char *p;
     int got_dot_dot = 0;
 
@@ -3124,7 +3361,7 @@ static void remotefs_listdir_ (const char *directory, unsigned long options, cha
     while ((directentry = readdir (dir))) {
         char *dn;
         const char *q;
-        dn = dname (directentry);
+        dn = dname (directentry, dn_);
         if (directory[0] == '/' && directory[1] == '\0') {
             strcpy (path_fname, "/");
             strcat (path_fname, dn);
@@ -3139,7 +3376,11 @@ static void remotefs_listdir_ (const char *directory, unsigned long options, cha
                 got_dot_dot = 1;
             if ((S_ISDIR (stats.ustat.st_mode) && (options & FILELIST_DIRECTORIES_ONLY)) ||
                 (!S_ISDIR (stats.ustat.st_mode) && (options & FILELIST_FILES_ONLY))) {
-                if (regexp_match (filter, dn, match_file) == 1) {
+                int match;
+                remotefs_lock (&regexp_lock);
+                match = regexp_match (filter, dn, match_file);
+                remotefs_unlock (&regexp_lock);
+                if (match == 1) {
                     i = (struct file_entry_item *) malloc (sizeof (*i));
                     memset (i, '\0', sizeof (*i));
                     portable_stat (1, q, &i->data.pstat, NULL, NULL, NULL);
@@ -3179,42 +3420,60 @@ static void remotefs_listdir_ (const char *directory, unsigned long options, cha
     }
 }
 
-static void remotefs_readfile_ (int (*chunk_cb) (void *, const unsigned char *, int, long long, char *), int (*start_cb) (void *, long long, char *), void *hook, const char *filename, CStr * r)
+/* opens filename for reading and gets its size. on error fills r and returns -1 */
+static int readfile_open (const char *filename, HANDLE *fd, long long *filelen, CStr * r)
 {E_
-    unsigned char chunk[READER_CHUNK];
-    char errmsg[REMOTEFS_ERR_MSG_LEN];
-    HANDLE fd = INVALID_HANDLE_VALUE;
     struct stat_posix_or_mswin st;
-    unsigned long long progress = 0ULL;
 
     memset (&st, '\0', sizeof (st));
 
-    fd = open (translate_path_sep (filename), O_RDONLY | _O_BINARY);
-    if (fd == INVALID_HANDLE_VALUE || my_fstat (fd, &st)) {
+    *fd = open (translate_path_sep (filename), O_RDONLY | _O_BINARY);
+    if (*fd == INVALID_HANDLE_VALUE || my_fstat (*fd, &st)) {
         alloc_encode_errno_strerror (r, 0);
-        return;
+        if (*fd != INVALID_HANDLE_VALUE)
+            close (*fd);
+        *fd = INVALID_HANDLE_VALUE;
+        return -1;
     }
+    *filelen = st.st_size;
+    return 0;
+}
 
-    if (start_cb && (*start_cb) (hook, st.st_size, errmsg)) {
-        alloc_encode_error (r, RFSERR_OTHER_ERROR, errmsg, 0);
-        goto errout;
+/* reads the next chunk of up to len bytes and returns its length. on error fills r and returns -1 */
+static int readfile_read (HANDLE fd, unsigned char *chunk, int len, CStr * r)
+{E_
+    int c;
+    c = read (fd, chunk, len);
+    if (!c) {
+        alloc_encode_error (r, RFSERR_ENDOFFILE, "System call read() returned zero", 0);
+        return -1;
+    }
+    if (c < 0) {
+        alloc_encode_errno_strerror (r, 0);
+        return -1;
     }
+    return c;
+}
+
+static void remotefs_readfile_ (int (*chunk_cb) (void *, const unsigned char *, int, long long, char *), void *hook, const char *filename, CStr * r)
+{E_
+    unsigned char chunk[READER_CHUNK];
+    char errmsg[REMOTEFS_ERR_MSG_LEN];
+    HANDLE fd = INVALID_HANDLE_VALUE;
+    long long filelen = 0;
+    unsigned long long progress = 0ULL;
+
+    if (readfile_open (filename, &fd, &filelen, r))
+        return;
 
     for (;;) {
         int c;
-        if (progress >= (unsigned long long) st.st_size)
+        if (progress >= (unsigned long long) filelen)
             break;
-        c = read (fd, chunk, READER_CHUNK);
-        if (!c) {
-            alloc_encode_error (r, RFSERR_ENDOFFILE, "System call read() returned zero", 0);
-            goto errout;
-        }
-        if (c < 0) {
-            alloc_encode_errno_strerror (r, 0);
+        if ((c = readfile_read (fd, chunk, READER_CHUNK, r)) < 0)
             goto errout;
-        }
 
-        if ((*chunk_cb) (hook, chunk, c, st.st_size, errmsg)) {
+        if ((*chunk_cb) (hook, chunk, c, filelen, errmsg)) {
             alloc_encode_error (r, RFSERR_OTHER_ERROR, errmsg, 0);
             goto errout;
         }
@@ -3227,11 +3486,11 @@ static void remotefs_readfile_ (int (*chunk_cb) (void *, const unsigned char *,
     return;
 
   errout:
-    if (fd != INVALID_HANDLE_VALUE)
-        close (fd);
+    close (fd);
     return;
 }
 
+static remotefs_lock_t random_lock = REMOTEFS_LOCK_INITIALIZER;
 static unsigned char random_seed[SYMAUTH_SHA256_SIZE];
 
 static void scramble_random (void)
@@ -3252,12 +3511,14 @@ int windows_get_random (unsigned char *out, const int outlen);
 
 static void init_random (void)
 {E_
+    remotefs_lock (&random_lock);
     memset (random_seed, '\0', sizeof (random_seed));
     if (windows_get_random (random_seed, SYMAUTH_SHA256_SIZE)) {
         perror ("Windows Crypto provider");
         exit (1);
     }
     scramble_random ();
+    remotefs_unlock (&random_lock);
 }
 #else
 static void init_random (void)
@@ -3275,9 +3536,11 @@ static void init_random (void)
     sha256_reset (&sha256);
     while ((c = fread (buf, 1, sizeof (buf), p)) > 0)
         sha256_update (&sha256, buf, c);
-    sha256_finish (&sha256, random_seed);
     pclose (p);
+    remotefs_lock (&random_lock);
+    sha256_finish (&sha256, random_seed);
     scramble_random ();
+    remotefs_unlock (&random_lock);
 }
 #endif
 
@@ -3288,6 +3551,7 @@ struct randblock {
 static void get_random (struct randblock *r)
 {E_
     sha256_context_t sha256;
+    remotefs_lock (&random_lock);
     sha256_reset (&sha256);
     sha256_update (&sha256, random_seed, sizeof (random_seed));
     sha256_finish (&sha256, random_seed);
@@ -3296,6 +3560,7 @@ static void get_random (struct randblock *r)
         scramble_random ();
 
     memcpy (&r->d[0], random_seed, SYMAUTH_SHA256_SIZE);
+    remotefs_unlock (&random_lock);
 }
 
 static void get_next_iv (unsigned char *iv)
@@ -3307,24 +3572,33 @@ static void get_next_iv (unsigned char *iv)
     memcpy (iv, &r, SYMAUTH_BLOCK_SIZE);
 }
 
-static void remotefs_writefile_ (void (*intermediate_ack_cb) (void *, int), int (*chunk_cb) (void *, unsigned char *, int *, char *), void *hook, const char *filename, long long filelen, int overwritemode, unsigned int permissions, const char *backup_extension, CStr * r)
+/* A file write in progress. The server feeds it chunks as they arrive
+   from the client, the local case from a loop in remotefs_writefile_(). */
+struct writefile_state {
+    HANDLE fd;
+    int overwritemode;
+    struct portable_stat st_orig;
+    char filename[MAX_PATH_LEN];
+    char temp_name[MAX_PATH_LEN + 40];
+    char backup_extension[MAX_PATH_LEN];
+};
+
+/* opens the file, or the temporary file that will replace it. on error fills r and returns -1 */
+static int writefile_open (struct writefile_state *w, const char *filename, int overwritemode, unsigned int permissions, const char *backup_extension, CStr * r)
 {E_
-    struct portable_stat st, st_orig;
-    unsigned char *p;
-    unsigned char chunk[READER_CHUNK];
     char errmsg[REMOTEFS_ERR_MSG_LEN] = "";
     enum remotefs_error_code remotefs_error_code_ = RFSERR_SUCCESS;
-    HANDLE fd = INVALID_HANDLE_VALUE;
     HANDLE fd_exists = INVALID_HANDLE_VALUE;
-    char temp_name[MAX_PATH_LEN + 40];
+
+    memset (w, '\0', sizeof (*w));
+    w->fd = INVALID_HANDLE_VALUE;
 
     if (strlen (filename) > MAX_PATH_LEN - 1) {
         alloc_encode_error (r, RFSERR_PATHNAME_TOO_LONG, "Pathname too long", FORCE_SHUTDOWN);
-        goto errout;
+        return -1;
     }
-
-    memset (&st, '\0', sizeof (st));
-    memset (&st_orig, '\0', sizeof (st_orig));
+    strcpy (w->filename, filename);
+    snprintf (w->backup_extension, sizeof (w->backup_extension), "%s", backup_extension);
 
     fd_exists = open (translate_path_sep (filename), O_WRONLY | _O_BINARY, permissions);
 
@@ -3333,97 +3607,98 @@ static void remotefs_writefile_ (void (*intermediate_ack_cb) (void *, int), int
 /* The only reason we should not be able to write to the file is that it does not exist,
    any other reason is a problem: */
             alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
-            goto errout;
+            return -1;
         }
 /* If the file does not exist, then no point in safe save or backup mode */
         overwritemode = REMOTEFS_WRITEFILE_OVERWRITEMODE_QUICK;
     } else {
         if (overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_SAFE || overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
-            if (portable_stat (0, translate_path_sep (filename), &st_orig, NULL, &remotefs_error_code_, errmsg)) {
+            if (portable_stat (0, translate_path_sep (filename), &w->st_orig, NULL, &remotefs_error_code_, errmsg)) {
                 alloc_encode_error (r, remotefs_error_code_, errmsg, FORCE_SHUTDOWN);
-                goto errout;
+                close (fd_exists);
+                return -1;
             }
         }
         close (fd_exists);
-        fd_exists = INVALID_HANDLE_VALUE;
     }
+    w->overwritemode = overwritemode;
 
     if (overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_SAFE || overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
         char *p;
         struct randblock b;
-        strcpy (temp_name, filename);
-        p = strrchr (temp_name, '/');
+        strcpy (w->temp_name, filename);
+        p = strrchr (w->temp_name, '/');
         if (p)
             p++;
         else
-            p = temp_name;
+            p = w->temp_name;
         get_random (&b);
         snprintf (p, 40, "tmp%x%x", b.d[0], b.d[1]);
-        fd = open (translate_path_sep (temp_name), O_CREAT|O_WRONLY|O_TRUNC | _O_BINARY, permissions);
-        if (fd == INVALID_HANDLE_VALUE) {
-            alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
-            goto errout;
-        }
+        w->fd = open (translate_path_sep (w->temp_name), O_CREAT|O_WRONLY|O_TRUNC | _O_BINARY, permissions);
     } else {
-        fd = open (translate_path_sep (filename), O_CREAT|O_WRONLY|O_TRUNC | _O_BINARY, permissions);
-        if (fd == INVALID_HANDLE_VALUE) {
-            alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
-            goto errout;
-        }
+        w->fd = open (translate_path_sep (filename), O_CREAT|O_WRONLY|O_TRUNC | _O_BINARY, permissions);
     }
+    if (w->fd == INVALID_HANDLE_VALUE) {
+        alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
+        return -1;
+    }
+    return 0;
+}
 
-
-    while (filelen > 0) {
-        int c;
-        c = READER_CHUNK;
-        if ((*chunk_cb) (hook, chunk, &c, errmsg)) {
-            alloc_encode_error (r, RFSERR_OTHER_ERROR, errmsg, FORCE_SHUTDOWN);
-            goto errout;
-        }
-        assert (c <= filelen);
-        filelen -= c;
-        if (write (fd, chunk, c) != c) {
-            alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
-            goto errout;
-        }
+static int writefile_write (struct writefile_state *w, const unsigned char *chunk, int c, CStr * r)
+{E_
+    if (write (w->fd, chunk, c) != c) {
+        alloc_encode_errno_strerror (r, FORCE_SHUTDOWN);
+        return -1;
     }
+    return 0;
+}
+
+/* closes the file, puts it in place of the original and fills r with the response */
+static int writefile_close (struct writefile_state *w, CStr * r)
+{E_
+    struct portable_stat st;
+    unsigned char *p;
+    char errmsg[REMOTEFS_ERR_MSG_LEN] = "";
+    enum remotefs_error_code remotefs_error_code_ = RFSERR_SUCCESS;
 
 /* from here on client and server are in sync, so FORCE_SHUTDOWN is not necessary */
 
-    close (fd);
-    fd = INVALID_HANDLE_VALUE;
+    close (w->fd);
+    w->fd = INVALID_HANDLE_VALUE;
 
-    if (overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_SAFE || overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
-        if (overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
-            char backup[MAX_PATH_LEN + 40];
-            snprintf (backup, sizeof (backup), "%s%s", filename, backup_extension);
-	    if (rename (translate_path_sep (filename), translate_path_sep (backup)) == -1) {
+    if (w->overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_SAFE || w->overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
+        if (w->overwritemode == REMOTEFS_WRITEFILE_OVERWRITEMODE_BACKUP) {
+            char backup[MAX_PATH_LEN * 2];
+            snprintf (backup, sizeof (backup), "%s%s", w->filename, w->backup_extension);
+	    if (rename (translate_path_sep (w->filename), translate_path_sep (backup)) == -1) {
                 alloc_encode_errno_strerror (r, 0);
-                goto errout;
+                return -1;
             }
         }
-	if (rename (translate_path_sep (temp_name), translate_path_sep (filename)) == -1) {
+	if (rename (translate_path_sep (w->temp_name), translate_path_sep (w->filename)) == -1) {
             alloc_encode_errno_strerror (r, 0);
-            goto errout;
+            return -1;
         }
 #ifdef MSWIN
         /* chown (filename, st_orig.st_uid, st_orig.st_gid); */
 #else
         {
             int chown_result;
-            chown_result = chown (translate_path_sep (filename), st_orig.ustat.st_uid, st_orig.ustat.st_gid);
+            chown_result = chown (translate_path_sep (w->filename), w->st_orig.ustat.st_uid, w->st_orig.ustat.st_gid);
 /* we don't care if this fails, the important part is that the file was written out. */
             (void) chown_result;
         }
 #endif
 /* chmod comes after since chown removes the setuid bit */
-        chmod (translate_path_sep (filename), st_orig.ustat.st_mode & 07777);
+        chmod (translate_path_sep (w->filename), w->st_orig.ustat.st_mode & 07777);
     }
 
 /* get the modified time: */
-    if (portable_stat (0, translate_path_sep (filename), &st, NULL, &remotefs_error_code_, errmsg)) {
+    memset (&st, '\0', sizeof (st));
+    if (portable_stat (0, translate_path_sep (w->filename), &st, NULL, &remotefs_error_code_, errmsg)) {
         alloc_encode_error (r, remotefs_error_code_, errmsg, 0);
-        goto errout;
+        return -1;
     }
 
     r->len = encode_uint (NULL, REMOTEFS_SUCCESS);
@@ -3432,16 +3707,47 @@ static void remotefs_writefile_ (void (*intermediate_ack_cb) (void *, int), int
     p = (unsigned char *) r->data;
     encode_uint (&p, REMOTEFS_SUCCESS);
     encode_stat (&p, &st);
+    return 0;
+}
+
+static void writefile_abort (struct writefile_state *w)
+{E_
+    if (w->fd != INVALID_HANDLE_VALUE)
+        close (w->fd);
+    w->fd = INVALID_HANDLE_VALUE;
+}
+
+static void remotefs_writefile_ (void (*intermediate_ack_cb) (void *, int), int (*chunk_cb) (void *, unsigned char *, int *, char *), void *hook, const char *filename, long long filelen, int overwritemode, unsigned int permissions, const char *backup_extension, CStr * r)
+{E_
+    struct writefile_state w;
+    unsigned char chunk[READER_CHUNK];
+    char errmsg[REMOTEFS_ERR_MSG_LEN] = "";
+
+    if (writefile_open (&w, filename, overwritemode, permissions, backup_extension, r))
+        goto errout;
+
+    while (filelen > 0) {
+        int c;
+        c = READER_CHUNK;
+        if ((*chunk_cb) (hook, chunk, &c, errmsg)) {
+            alloc_encode_error (r, RFSERR_OTHER_ERROR, errmsg, FORCE_SHUTDOWN);
+            goto errout;
+        }
+        assert (c <= filelen);
+        filelen -= c;
+        if (writefile_write (&w, chunk, c, r))
+            goto errout;
+    }
+
+    if (writefile_close (&w, r))
+        goto errout;
 
     (*intermediate_ack_cb) (hook, 0);
 
     return;
 
   errout:
-    if (fd != INVALID_HANDLE_VALUE)
-        close (fd);
-    if (fd_exists != INVALID_HANDLE_VALUE)
-        close (fd_exists);
+    writefile_abort (&w);
 
 /* tell the remote to hang up and not send any more data: */
     (*intermediate_ack_cb) (hook, 1);
@@ -3486,7 +3792,7 @@ static void remotefs_checkordinaryfileaccess_ (const char *filename, unsigned lo
         goto errout;
     }
     if ((unsigned long long) st.ustat.st_size >= sizelimit) {
-        snprintf (errmsg, REMOTEFS_ERR_MSG_LEN, " File is too large: %s \n Increase edit.h:MAXBUFF and recompile the editor. ", filename);
+        snprintf (errmsg, REMOTEFS_ERR_MSG_LEN, " File is too large: %s ", filename);
         goto errout;
     }
     close (fd);
@@ -3744,7 +4050,7 @@ static int local_readfile (struct remotefs *rfs, struct action_callbacks *o, con
 {E_
     CStr s;
     *errmsg = '\0';
-    remotefs_readfile_ (local_chunk_reader_cb, NULL, (void *) o, filename, &s);
+    remotefs_readfile_ (local_chunk_reader_cb, (void *) o, filename, &s);
 
     MARSHAL_START_LOCAL;
     /* nothing to decode */
@@ -3877,8 +4183,10 @@ static int encode_listdir_params (unsigned char **p_, const char *directory, uns
 
 static int send_recv_mesg (struct remotefs *rfs, CStr *msg, CStr *response, int action, char *errmsg, int *no_such_action);
 static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, int action, char *errmsg);
+static int send_mesg_ (struct remotefs *rfs, struct reader_data *d, CStr * msg, int action, int eager, char *errmsg);
 static int recv_mesg (struct remotefs *rfs, struct reader_data *d, CStr * response, int action, char *errmsg, int *no_such_action);
 static int reader (struct reader_data *d, void *buf_, int buflen, enum reader_error *reader_error);
+static int remote_compress (struct remotefs *rfs, char *errmsg);
 
 
 static int remote_listdir (struct remotefs *rfs, const char *directory, unsigned long options, char *filter, struct file_entry **r, int *n, char *errmsg)
@@ -3907,20 +4215,77 @@ static int remote_listdir (struct remotefs *rfs, const char *directory, unsigned
 }
 
 
+/* reads the length then the contents of a file being sent by the remote */
+static int recv_file_data (struct reader_data *d, struct action_callbacks *o, int *err, char *errmsg)
+{E_
+    unsigned long long filelen, remaining;
+    unsigned char buf[READER_CHUNK];
+    unsigned char frame[FRAME_CHUNK];
+    unsigned char t[FRAME_HEADER_LEN];
+    struct compress_data *z = NULL;
+    int framed;
+    enum reader_error reader_error = READER_ERROR_NOERROR;
+
+    if (reader (d, t, 6, &reader_error))
+        goto readerr;
+
+    decode_uint48 (t, &filelen);
+    remaining = filelen;
+
+/* out of memory, z is NULL and only frames sent as is can be read */
+    if ((framed = (d->sock_data->compress == COMPRESS_YES)))
+        z = compress_start (d->sock_data);
+
+/* even if the remote has an error we continue reading the full network
+   transaction to preserve continuity of the connection: */
+    while (remaining > 0) {
+        const unsigned char *p = buf;
+        int c, wirelen;
+        if (framed) {
+            if (reader (d, t, FRAME_HEADER_LEN, &reader_error))
+                goto readerr;
+            if (frame_header (t, remaining, &c, &wirelen))
+                goto badframe;
+            if (reader (d, frame, wirelen, &reader_error))
+                goto readerr;
+            if (!(p = frame_unpack (z, frame, wirelen, buf, c)))
+                goto badframe;
+        } else {
+            c = (MIN ((unsigned long long) READER_CHUNK, remaining));
+            if (reader (d, buf, c, &reader_error))
+                goto readerr;
+        }
+        if (!*err)
+            if ((*o->sock_reader) (o, p, c, filelen, errmsg))
+                *err = 1;
+        remaining -= c;
+    }
+
+    return 0;
+
+  readerr:
+    set_sockerrmsg_to_errno (errmsg, errno, reader_error);
+    return -1;
+
+  badframe:
+    SHUTSOCK (d->sock_data);
+    strcpy (errmsg, "invalid compressed frame from remote");
+    return -1;
+}
+
 static int remote_readfile (struct remotefs *rfs, struct action_callbacks *o, const char *filename, char *errmsg)
 {E_
     char throw_away[REMOTEFS_ERR_MSG_LEN];
     CStr s, msg;
     unsigned char *q;
-    unsigned long long filelen, remaining;
     struct reader_data d;
-    unsigned char buf[READER_CHUNK];
-    unsigned char t[6];
     int err = 0;
-    enum reader_error reader_error = READER_ERROR_NOERROR;
 
     *errmsg = '\0';
 
+    if (rfs->remotefs_private->sock_data->compress == COMPRESS_UNKNOWN && remote_compress (rfs, errmsg))
+        return -1;
+
     msg.len = encode_str (NULL, filename, strlen (filename));
     msg.data = (char *) malloc (msg.len);
     q = (unsigned char *) msg.data;
@@ -3937,31 +4302,98 @@ static int remote_readfile (struct remotefs *rfs, struct action_callbacks *o, co
     free (msg.data);
     msg.data = NULL;
 
-    if (reader (&d, t, 6, &reader_error)) {
-        set_sockerrmsg_to_errno (errmsg, errno, reader_error);
+    if (recv_file_data (&d, o, &err, errmsg))
         return -1;
-    }
 
-    decode_uint48 (t, &filelen);
-    remaining = filelen;
+    if (recv_mesg (rfs, &d, &s, REMOTEFS_ACTION_READFILE, err ? throw_away : errmsg, NULL))
+        return -1;
 
-/* even if the remote has an error we continue reading the full network
-   transaction to preserve continuity of the connection: */
-    while (remaining > 0) {
-        int c;
-        c = (MIN ((unsigned long long) READER_CHUNK, remaining));
-        if (reader (&d, buf, c, &reader_error)) {
-            set_sockerrmsg_to_errno (errmsg, errno, reader_error);
-            return -1;
-        }
-        if (!err)
-            if ((*o->sock_reader) (o, buf, c, filelen, errmsg))
-                err = 1;
-        remaining -= c;
+    MARSHAL_START_REMOTE;
+    /* nothing to decode */
+    MARSHAL_END_REMOTE(NULL);
+}
+
+/* what REMOTEFS_ACTION_OPENFILE does, for where it is not available */
+static int openfile_separately (struct remotefs *rfs, struct action_callbacks *o, const char *filename, unsigned long long sizelimit, struct portable_stat *st, char *errmsg)
+{E_
+    if ((*rfs->remotefs_checkordinaryfileaccess) (rfs, filename, sizelimit, st, errmsg))
+        return -1;
+    if ((*o->sock_opened) (o, st, errmsg))
+        return -1;
+    return (*rfs->remotefs_readfile) (rfs, o, filename, errmsg);
+}
+
+/* The access check, stat and file contents all come back from one
+   request. The remote first sends a whole message with the result of
+   the access check, then the file exactly as for a READFILE, which is
+   empty if access was denied. */
+static int remote_openfile (struct remotefs *rfs, struct action_callbacks *o, const char *filename, unsigned long long sizelimit, struct portable_stat *st, char *errmsg)
+{E_
+    char throw_away[REMOTEFS_ERR_MSG_LEN];
+    CStr s, msg;
+    unsigned char *q;
+    struct reader_data d;
+    const unsigned char *p, *end;
+    unsigned long long v;
+    int no_such_action = 0;
+    int err = 0;
+
+    *errmsg = '\0';
+
+    if (rfs->remotefs_private->sock_data->no_openfile)
+        return openfile_separately (rfs, o, filename, sizelimit, st, errmsg);
+
+    if (rfs->remotefs_private->sock_data->compress == COMPRESS_UNKNOWN && remote_compress (rfs, errmsg))
+        return -1;
+
+    msg.len = encode_str (NULL, filename, strlen (filename));
+    msg.len += encode_uint (NULL, sizelimit);
+    msg.data = (char *) malloc (msg.len);
+    q = (unsigned char *) msg.data;
+    encode_str (&q, filename, strlen (filename));
+    encode_uint (&q, sizelimit);
+
+    memset (&d, '\0', sizeof (d));
+    d.sock_data = rfs->remotefs_private->sock_data;
+
+    if (send_mesg_ (rfs, &d, &msg, REMOTEFS_ACTION_OPENFILE, 1, errmsg)) {
+        free (msg.data);
+        return -1;
     }
+    free (msg.data);
 
-    if (recv_mesg (rfs, &d, &s, REMOTEFS_ACTION_READFILE, err ? throw_away : errmsg, NULL))
+    if (recv_mesg (rfs, &d, &s, REMOTEFS_ACTION_OPENFILE, errmsg, &no_such_action)) {
+        if (!no_such_action || rfs->remotefs_private->sock_data->sock == INVALID_SOCKET)
+            return -1;
+        rfs->remotefs_private->sock_data->no_openfile = 1;
+        *errmsg = '\0';
+        return openfile_separately (rfs, o, filename, sizelimit, st, errmsg);
+    }
+
+    p = (const unsigned char *) s.data;
+    end = p + s.len;
+    if (decode_uint (&p, end, &v) || v != REMOTEFS_SUCCESS) {
+        p = (const unsigned char *) s.data;
+        decode_error (&p, end, NULL, errmsg, NULL);
+        err = 1;
+    } else if (decode_stat (&p, end, st)) {
+        strcpy (errmsg, "invalid stat response");
+        err = 1;
+    } else if ((*o->sock_opened) (o, st, errmsg)) {
+        err = 1;
+    }
+    free (s.data);
+
+    if (recv_file_data (&d, o, &err, errmsg))
+        return -1;
+
+    if (recv_mesg (rfs, &d, &s, REMOTEFS_ACTION_OPENFILE, err ? throw_away : errmsg, NULL))
+        return -1;
+
+    if (err) {
+        free (s.data);
         return -1;
+    }
 
     MARSHAL_START_REMOTE;
     /* nothing to decode */
@@ -4015,6 +4447,10 @@ static int remote_writefile (struct remotefs *rfs, struct action_callbacks *o, c
     unsigned long long remaining;
     struct reader_data d;
     unsigned char buf[READER_CHUNK];
+    unsigned char frame[FRAME_CHUNK];
+    unsigned char h[FRAME_HEADER_LEN];
+    struct compress_data *z = NULL;
+    int framed;
     int got_ack = 0;
     int got_stop = 0;
     enum reader_error reader_error = READER_ERROR_NOERROR;
@@ -4026,6 +4462,9 @@ static int remote_writefile (struct remotefs *rfs, struct action_callbacks *o, c
     *errmsg = '\0';
     memset (st, '\0', sizeof (*st));
 
+    if (rfs->remotefs_private->sock_data->compress == COMPRESS_UNKNOWN && remote_compress (rfs, errmsg))
+        return -1;
+
     msg.len = encode_str (NULL, filename, strlen (filename));
     msg.len += encode_uint (NULL, filelen);
     msg.len += encode_uint (NULL, overwritemode);
@@ -4052,13 +4491,16 @@ static int remote_writefile (struct remotefs *rfs, struct action_callbacks *o, c
     msg.data = NULL;
 
     remaining = filelen;
+/* out of memory, z is NULL and the frames go as is */
+    if ((framed = (d.sock_data->compress == COMPRESS_YES)))
+        z = compress_start (d.sock_data);
 
 /* we adopt the protocol that the remote can indicate a success/failure ack at any time.
    this is primarily useful for a remote that fills up its device and returns an error
    midway */
 
     while (remaining > 0) {
-        int c;
+        int c, err;
 
         if (maybe_see_ack (&d, &got_ack, &got_stop, &reader_error)) {
             set_sockerrmsg_to_errno (errmsg, errno, reader_error);
@@ -4067,7 +4509,7 @@ static int remote_writefile (struct remotefs *rfs, struct action_callbacks *o, c
         if (got_stop)
             break;
 
-        c = (MIN ((unsigned long long) READER_CHUNK, remaining));
+        c = (MIN ((unsigned long long) (framed ? FRAME_CHUNK : READER_CHUNK), remaining));
         if ((*o->sock_writer) (o, buf, &c, errmsg)) {
             SHUTSOCK (rfs->remotefs_private->sock_data);
             strcpy (errmsg, "Ran out of data to write");
@@ -4075,7 +4517,16 @@ static int remote_writefile (struct remotefs *rfs, struct action_callbacks *o, c
         }
         assert (c > 0);
 
-        if (writer (d.sock_data, buf, c)) {
+        if (framed) {
+            CStr v[2];
+            v[0].data = (char *) h;
+            v[0].len = FRAME_HEADER_LEN;
+            v[1].data = (char *) frame_pack (z, h, buf, c, frame, &v[1].len);
+            err = writervec (d.sock_data, v, 2);
+        } else {
+            err = writer (d.sock_data, buf, c);
+        }
+        if (err) {
             set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
             if (!maybe_see_ack (&d, &got_ack, &got_stop, &reader_error) && got_stop)
                 break;
@@ -4626,7 +5077,9 @@ static int remotefs_enable_crypto (struct remotefs *rfs, char *errmsg)
     return -1;
 }
 
-static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, int action, char *errmsg)
+/* With eager set the body goes out together with the header instead of
+   after the ack, saving a round trip. */
+static int send_mesg_ (struct remotefs *rfs, struct reader_data *d, CStr * msg, int action, int eager, char *errmsg)
 {E_
     struct cooledit_remote_msg_header m;
     struct cooledit_remote_msg_ack ack;
@@ -4687,7 +5140,17 @@ static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, i
 
     encode_msg_header (&m, msg->len, MSG_VERSION, action, FILE_PROTO_MAGIC);
 
-    if (writer (rfs->remotefs_private->sock_data, &m, sizeof (m))) {
+    if (eager && msg->len) {
+        CStr v[2];
+        v[0].data = (char *) &m;
+        v[0].len = sizeof (m);
+        v[1] = *msg;
+        if (writervec (rfs->remotefs_private->sock_data, v, 2)) {
+            set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
+            SHUTSOCK (rfs->remotefs_private->sock_data);
+            return -1;
+        }
+    } else if (writer (rfs->remotefs_private->sock_data, &m, sizeof (m))) {
         set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
         SHUTSOCK (rfs->remotefs_private->sock_data);
         return -1;
@@ -4746,7 +5209,7 @@ static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, i
         return -1;
     }
 
-    if (msg->len && writer (rfs->remotefs_private->sock_data, msg->data, msg->len)) {
+    if (!eager && msg->len && writer (rfs->remotefs_private->sock_data, msg->data, msg->len)) {
         set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
         SHUTSOCK (rfs->remotefs_private->sock_data);
         return -1;
@@ -4755,6 +5218,11 @@ static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, i
     return 0;
 }
 
+static int send_mesg (struct remotefs *rfs, struct reader_data *d, CStr * msg, int action, char *errmsg)
+{E_
+    return send_mesg_ (rfs, d, msg, action, 0, errmsg);
+}
+
 static int recv_mesg (struct remotefs *rfs, struct reader_data *d, CStr * response, int action, char *errmsg, int *no_such_action)
 {E_
     unsigned long long msglen;
@@ -4830,6 +5298,45 @@ static int send_recv_mesg (struct remotefs *rfs, CStr * msg, CStr * response, in
     return 0;
 }
 
+/* asks the remote to send file data in compressed frames, connecting if need be */
+static int remote_compress (struct remotefs *rfs, char *errmsg)
+{E_
+#ifdef HAVE_LIBZ
+    CStr msg, s;
+    unsigned char *q;
+    const unsigned char *p, *end;
+    unsigned long long v, method;
+    int no_such_action = 0;
+
+    msg.len = encode_uint (NULL, COMPRESS_METHOD_DEFLATE);
+    msg.data = (char *) malloc (msg.len);
+    q = (unsigned char *) msg.data;
+    encode_uint (&q, COMPRESS_METHOD_DEFLATE);
+
+    if (send_recv_mesg (rfs, &msg, &s, REMOTEFS_ACTION_COMPRESS, errmsg, &no_such_action)) {
+        free (msg.data);
+        if (!no_such_action)
+            return -1;
+        *errmsg = '\0';
+        rfs->remotefs_private->sock_data->compress = COMPRESS_NO;
+        return 0;
+    }
+    free (msg.data);
+
+/* the remote answers with the method it will use, or zero for none */
+    p = (const unsigned char *) s.data;
+    end = p + s.len;
+    if (!decode_uint (&p, end, &v) && v == REMOTEFS_SUCCESS && !decode_uint (&p, end, &method) && method == COMPRESS_METHOD_DEFLATE)
+        rfs->remotefs_private->sock_data->compress = COMPRESS_YES;
+    else
+        rfs->remotefs_private->sock_data->compress = COMPRESS_NO;
+    free (s.data);
+#else
+    rfs->remotefs_private->sock_data->compress = COMPRESS_NO;
+#endif
+    return 0;
+}
+
 
 static char remotefs_error_return_[REMOTEFS_ERR_MSG_LEN];
 
@@ -4879,6 +5386,11 @@ static int dummyerr_gethomedir (struct remotefs *rfs, char *out, int outlen, cha
     return remotefs_error_return (errmsg);
 }
 
+static int dummyerr_openfile (struct remotefs *rfs, struct action_callbacks *o, const char *filename, unsigned long long sizelimit, struct portable_stat *st, char *errmsg)
+{E_
+    return remotefs_error_return (errmsg);
+}
+
 static int dummyerr_enablecrypto (struct remotefs *rfs, const unsigned char *challenge_local, unsigned char *challenge_remote, char *errmsg)
 {E_
     return remotefs_error_return (errmsg);
@@ -4897,6 +5409,7 @@ struct remotefs remotefs_dummyerr = {
     dummyerr_realpathize,
     dummyerr_gethomedir,
     dummyerr_enablecrypto,
+    dummyerr_openfile,
     NULL,
 };
 
@@ -4911,6 +5424,7 @@ struct remotefs remotefs_local = {
     local_realpathize,
     local_gethomedir,
     local_enablecrypto,
+    openfile_separately,
     NULL
 };
 
@@ -4925,6 +5439,7 @@ struct remotefs remotefs_socket = {
     remote_realpathize,
     remote_gethomedir,
     remote_enablecrypto,
+    remote_openfile,
     NULL
 };
 
@@ -5039,6 +5554,17 @@ struct remotefs *remotefs_lookup (const char *host_, char *last_directory)
 
 struct server_data {
     struct reader_data *reader_data;
+/* REMOTEFS_ACTION_READFILE or REMOTEFS_ACTION_WRITEFILE while the file
+   data is streaming, see client_step() */
+    int streaming;
+    HANDLE fd;
+    long long filelen;
+    long long progress;
+    struct writefile_state w;
+/* REMOTEFS_ACTION_OPENFILE's access check result, sent ahead of the file */
+    CStr opened;
+/* whether the file data now streaming is in compressed frames */
+    int framed;
 };
 
 static int remote_action_fn_v1_notimplemented (struct server_data *sd, CStr * s, const unsigned char *in, int inlen)
@@ -5066,114 +5592,32 @@ static int remote_action_fn_v1_listdir (struct server_data *sd, CStr *s, const u
     return 0;
 }
 
-struct server_reader_info {
-    struct server_data *sd;
-    long long progress;
-    long long filelen;
-};
-
-static int remote_chunk_startreader_cb (void *hook, long long filelen, char *errmsg)
-{E_
-    struct server_reader_info *info;
-    unsigned char p[6];
-
-    info = (struct server_reader_info *) hook;
-
-    encode_uint48 (p, filelen);
-    if (writer (info->sd->reader_data->sock_data, p, 6)) {
-        info->progress = -1LL;
-        set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
-        return -1;
-    }
-
-    return 0;
-}
-
-static int remote_chunk_reader_cb (void *hook, const unsigned char *chunk, int chunklen, long long filelen, char *errmsg)
-{E_
-    struct server_reader_info *info;
-
-    info = (struct server_reader_info *) hook;
-
-    if (writer (info->sd->reader_data->sock_data, chunk, chunklen)) {
-        set_sockerrmsg_to_errno (errmsg, errno, READER_ERROR_NOERROR);
-        return -1;
-    }
-
-    info->filelen = filelen;
-    info->progress += chunklen;
-
-    return 0;
-}
-
+/* the file itself is sent by client_step() as the socket drains */
 static int remote_action_fn_v1_readfile (struct server_data *sd, CStr * s, const unsigned char *in, int inlen)
 {E_
     const unsigned char *p, *end;
     char filename[MAX_PATH_LEN];
-    struct server_reader_info info;
-
-    memset (&info, '\0', sizeof (info));
-    info.sd = sd;
 
     p = in;
     end = in + inlen;
     if (decode_str (&p, end, filename, sizeof (filename)))
         return -1;
 
-    remotefs_readfile_ (remote_chunk_reader_cb, remote_chunk_startreader_cb, (void *) &info, filename, s);
-    if (info.progress != info.filelen)
-        return -1;
-    return 0;
-}
-
-struct server_writer_info {
-    struct server_data *sd;
-    long long remaining;
-};
-
-static int remote_chunk_writer_cb (void *hook, unsigned char *chunk, int *chunklen, char *errmsg)
-{E_
-    struct server_writer_info *info;
-    enum reader_error reader_error = READER_ERROR_NOERROR;
-
-    info = (struct server_writer_info *) hook;
-
-    *chunklen = MIN (info->remaining, *chunklen);
-
-    if (reader (info->sd->reader_data, chunk, *chunklen, &reader_error)) {
-        set_sockerrmsg_to_errno (errmsg, errno, reader_error);
-        return -1;
-    }
-
-    info->remaining -= *chunklen;
-
+    if (readfile_open (filename, &sd->fd, &sd->filelen, s))
+        return 0;
+    sd->progress = 0;
+    sd->streaming = REMOTEFS_ACTION_READFILE;
     return 0;
 }
 
-static void remote_intermediate_ack_cb (void *hook, int got_error)
-{E_
-    struct server_writer_info *info;
-    struct cooledit_remote_msg_ack ack;
-
-    info = (struct server_writer_info *) hook;
-
-    memset (&ack, '\0', sizeof (ack));
-    encode_msg_ack (&ack, got_error ? RFSERR_EARLY_TERMINATE_FROM_WRITE_FILE : RFSERR_SUCCESS, MSG_VERSION);
-
-    writer (info->sd->reader_data->sock_data, &ack, sizeof (ack));
-}
-
+/* the file itself is received by client_step() as it arrives */
 static int remote_action_fn_v1_writefile (struct server_data *sd, CStr *s, const unsigned char *in, int inlen)
 {E_
     const unsigned char *p, *end;
     char filename[MAX_PATH_LEN];
     char backup_extension[MAX_PATH_LEN];
-    struct server_writer_info info;
     unsigned long long filelen, overwritemode, permissions;
 
-    memset (&info, '\0', sizeof (info));
-    info.sd = sd;
-
     p = in;
     end = in + inlen;
     if (decode_str (&p, end, filename, sizeof (filename)))
@@ -5186,10 +5630,11 @@ static int remote_action_fn_v1_writefile (struct server_data *sd, CStr *s, const
         return -1;
     if (decode_str (&p, end, backup_extension, sizeof (backup_extension)))
         return -1;
-    info.remaining = filelen;
-    remotefs_writefile_ (remote_intermediate_ack_cb, remote_chunk_writer_cb, (void *) &info, filename, filelen, overwritemode, permissions, backup_extension, s);
-    if (info.remaining)
-        return -1;
+    sd->filelen = filelen;
+    sd->progress = 0;
+    sd->streaming = REMOTEFS_ACTION_WRITEFILE;
+/* on failure s holds the error, and client_step() sends it straight away */
+    writefile_open (&sd->w, filename, overwritemode, permissions, backup_extension, s);
     return 0;
 }
 
@@ -5256,6 +5701,71 @@ static int remote_action_fn_v1_gethomedir (struct server_data *sd, CStr *s, cons
     return 0;
 }
 
+static int remote_action_fn_v3_tagged (struct server_data *sd, CStr *s, const unsigned char *in, int inlen)
+{E_
+    alloc_encode_success (s);
+    return 0;
+}
+
+static int remote_action_fn_v3_openfile (struct server_data *sd, CStr *s, const unsigned char *in, int inlen)
+{E_
+    const unsigned char *p, *end;
+    char filename[MAX_PATH_LEN];
+    unsigned long long sizelimit, v;
+
+    p = in;
+    end = in + inlen;
+    if (decode_str (&p, end, filename, sizeof (filename)))
+        return -1;
+    if (decode_uint (&p, end, &sizelimit))
+        return -1;
+
+    remotefs_checkordinaryfileaccess_ (filename, sizelimit, &sd->opened);
+
+/* access denied: the file is sent empty and the response repeats the error */
+    p = (const unsigned char *) sd->opened.data;
+    if (decode_uint (&p, p + sd->opened.len, &v) || v != REMOTEFS_SUCCESS) {
+        s->len = sd->opened.len;
+        s->data = (char *) malloc (s->len);
+        memcpy (s->data, sd->opened.data, s->len);
+        return 0;
+    }
+
+    if (readfile_open (filename, &sd->fd, &sd->filelen, s))
+        return 0;
+    sd->progress = 0;
+    sd->streaming = REMOTEFS_ACTION_READFILE;
+    return 0;
+}
+
+#ifdef HAVE_LIBZ
+/* file data goes in compressed frames from the next transfer on */
+static int remote_action_fn_v3_compress (struct server_data *sd, CStr *s, const unsigned char *in, int inlen)
+{E_
+    const unsigned char *p, *end;
+    unsigned char *q;
+    unsigned long long method;
+
+    p = in;
+    end = in + inlen;
+    if (decode_uint (&p, end, &method))
+        return -1;
+
+    if (method == COMPRESS_METHOD_DEFLATE)
+        sd->reader_data->sock_data->compress = COMPRESS_YES;
+    else
+        method = 0;
+
+    s->len = encode_uint (NULL, REMOTEFS_SUCCESS);
+    s->len += encode_uint (NULL, method);
+    s->data = (char *) malloc (s->len);
+    q = (unsigned char *) s->data;
+    encode_uint (&q, REMOTEFS_SUCCESS);
+    encode_uint (&q, method);
+    return 0;
+}
+#endif
+
 static int remote_action_fn_v2_enablecrypto (struct server_data *sd, CStr *s, const unsigned char *in, int inlen)
 {E_
     const unsigned char *p, *end;
@@ -5278,28 +5788,53 @@ static int remote_action_fn_v2_enablecrypto (struct server_data *sd, CStr *s, co
 
 struct action_item {
     int (*action_fn) (struct server_data *sd, CStr *r, const unsigned char *in, int inlen);
+    int blocking;       /* touches the filesystem, so is run on a worker thread */
+    int tagged;         /* may be sent as MSG_VERSION_TAGGED */
 };
 
 struct action_item action_list[] = {
-    { remote_action_fn_v1_notimplemented, },
-    { remote_action_fn_v1_listdir, },
-    { remote_action_fn_v1_readfile, },
-    { remote_action_fn_v1_writefile, },
-    { remote_action_fn_v1_checkordinaryfileaccess, },
-    { remote_action_fn_v1_stat, },
-    { remote_action_fn_v1_chdir, },
-    { remote_action_fn_v1_realpathize, },
-    { remote_action_fn_v1_gethomedir, },
-    { remote_action_fn_v2_enablecrypto, },
+    { remote_action_fn_v1_notimplemented, 0, 0, },
+    { remote_action_fn_v1_listdir, 1, 1, },
+    { remote_action_fn_v1_readfile, 1, 0, },
+    { remote_action_fn_v1_writefile, 1, 0, },
+    { remote_action_fn_v1_checkordinaryfileaccess, 1, 1, },
+    { remote_action_fn_v1_stat, 1, 1, },
+    { remote_action_fn_v1_chdir, 0, 1, },     /* the cwd is per process: run on the loop thread */
+    { remote_action_fn_v1_realpathize, 1, 1, },
+    { remote_action_fn_v1_gethomedir, 0, 1, },
+    { remote_action_fn_v2_enablecrypto, 0, 0, },
+    { remote_action_fn_v3_tagged, 0, 0, },
+    { remote_action_fn_v3_openfile, 1, 0, },
+#ifdef HAVE_LIBZ
+    { remote_action_fn_v3_compress, 0, 1, },
+#else
+    { NULL, 0, 0, },
+#endif
 };
 
 static unsigned int client_count = 0L;
 
+/* A client is neither read from nor sent further file data while this
+   much output is still waiting to go out to it. */
+#define OUT_QUEUE_MAX           (READER_CHUNK * 4)
+
+struct out_queue {
+    unsigned char *data;
+    long len;
+    long sent;
+    long alloc;
+};
+
 struct service {
     SOCKET h;
+#ifdef HAVE_EPOLL
+    int epfd;
+#endif
     struct iprange_list *iprange_list;
     struct client_item *client_list;
     const char *option_range;
+    time_t last_sweep;
+    int reap;
 };
 
 static void init_service (struct service *serv, const char *listen_address, const char *option_range)
@@ -5315,8 +5850,42 @@ static void init_service (struct service *serv, const char *listen_address, cons
     }
     if (serv->h == INVALID_SOCKET)
         exit (1);
+#ifdef HAVE_EPOLL
+    {
+        struct epoll_event ev;
+        serv->epfd = epoll_create (64);
+        if (serv->epfd < 0) {
+            perror ("epoll_create");
+            exit (1);
+        }
+        memset (&ev, '\0', sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl (serv->epfd, EPOLL_CTL_ADD, serv->h, &ev)) {
+            perror ("epoll_ctl");
+            exit (1);
+        }
+    }
+#endif
 }
 
+/* A piece of work for the worker pool, see struct worker_pool. A
+   client's untagged requests and file transfers use the one job in its
+   client_item, each tagged request gets a job of its own. */
+struct job {
+    struct job *next;
+    struct client_item *client;
+    void (*run) (struct job *);
+    void (*done) (struct job *);
+    unsigned long action_id;
+    unsigned char *body;
+    const unsigned char *in;
+    long in_len;
+    unsigned char tag[TAGGED_ID_LEN];
+    CStr r;
+    int c;
+};
+
 struct client_item {
 #define CLIENT_MAGIC    0xf0536726
     unsigned int magic;
@@ -5336,55 +5905,255 @@ struct client_item {
 #define KILL_HARD       2
     int kill;
     long long discard;
+
+/* Each message is read into the header, then into the body, as much
+   at a time as has arrived. Replies are queued in out and sent as the
+   socket takes them, so no client ever waits on another. */
+#define CLIENT_HEADER   0
+#define CLIENT_BODY     1
+    int state;
+    struct cooledit_remote_msg_header m;
+    unsigned char *body;
+    unsigned char *in;
+    long in_len;
+    long in_got;
+    struct out_queue out;
+
+#define CLIENT_WANT_READ        1
+#define CLIENT_WANT_WRITE       2
+    unsigned int events;
+
+/* While busy, job is running on a worker and nothing else touches the
+   client until its done is called here. Tagged requests only touch
+   their own job, so any number up to TAGGED_MAX can be out meanwhile. */
+    int busy;
+    struct job job;
+    int tagged_pending;
+    unsigned char *chunk;
+
+/* the header and data of a compressed frame, see FRAME_CHUNK */
+    unsigned char frame[FRAME_HEADER_LEN];
+    unsigned char *zchunk;
 };
 
-static void add_client (struct service *serv)
+static void client_expect_header (struct client_item *i)
 {E_
-    struct client_item *i;
-    int found_ip;
-    struct sock_data sock_data_, *sock_data;
+    i->state = CLIENT_HEADER;
+    i->in = (unsigned char *) &i->m;
+    i->in_len = sizeof (i->m);
+    i->in_got = 0;
+}
+
+/* Filesystem calls can block for a long time, a listdir of a large NFS
+   directory for instance, so they are run by a fixed pool of worker
+   threads while this thread goes on serving the other clients. A client
+   is not read from while its untagged request is out, so those are
+   still handled in order. Tagged requests are answered as they finish. */
+#define WORKERS_DEFAULT         4
+#define WORKERS_MAX             64
+
+static struct worker_pool {
+    remotefs_lock_t lock;
 #ifdef MSWIN
-    BOOL yes = TRUE;
-    u_long nbio = 1;
+    HANDLE sem;
 #else
-    int yes = 1;
-    int nbio = 1;
+    pthread_cond_t cond;
+    int wake[2];        /* a byte is written here each time a job is done */
 #endif
-    socklen_t l;
-    remotefs_sockaddr_t client_address;
+    struct job *todo;
+    struct job **todo_last;
+    struct job *done;
+    int pending;
+} pool;
 
-    sock_data = &sock_data_;
-    memset (sock_data, '\0', sizeof (*sock_data));
+static void worker_run (void)
+{E_
+    struct job *j;
 
-    l = sizeof (client_address);
-    sock_data->sock = accept (serv->h, (struct sockaddr *) &client_address, &l);
-    if (sock_data->sock == INVALID_SOCKET) {
-        perrorsocket ("accept fail");
-        return;
-    }
+    for (;;) {
+#ifdef MSWIN
+        WaitForSingleObject (pool.sem, INFINITE);
+        remotefs_lock (&pool.lock);
+#else
+        remotefs_lock (&pool.lock);
+        while (!pool.todo)
+            pthread_cond_wait (&pool.cond, &pool.lock);
+#endif
+        j = pool.todo;
+        if (!(pool.todo = j->next))
+            pool.todo_last = &pool.todo;
+        remotefs_unlock (&pool.lock);
 
-    found_ip = iprange_match (serv->iprange_list, remotefs_sockaddr_t_address (&client_address), remotefs_sockaddr_t_addresslen (&client_address));
+        (*j->run) (j);
 
-    if (!found_ip) {
-        char t[64];
-        SHUTSOCK (sock_data);
-        ip_to_text (remotefs_sockaddr_t_address (&client_address), remotefs_sockaddr_t_addresslen (&client_address), t);
-        printf ("incoming address %s not in range %s\n", t, serv->option_range);
-        return;
+        remotefs_lock (&pool.lock);
+        j->next = pool.done;
+        pool.done = j;
+        remotefs_unlock (&pool.lock);
+#ifndef MSWIN
+        if (write (pool.wake[1], "", 1) < 0) {
+            /* the pipe is full, so the loop will wake anyway */
+        }
+#endif
     }
+}
 
-    if (setsockopt (sock_data->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &yes, sizeof (yes))) {
-        SHUTSOCK (sock_data);
-        perrorsocket ("setsockopt TCP_NODELAY\n");
-        return;
-    }
-    if (ioctlsocket (sock_data->sock, FIONBIO, &nbio))  {
-        SHUTSOCK (sock_data);
-        perrorsocket ("ioctl FIONBIO\n");
-        return;
-    }
+#ifdef MSWIN
+static DWORD WINAPI worker_main (LPVOID arg)
+{E_
+    worker_run ();
+    return 0;
+}
+#else
+static void *worker_main (void *arg)
+{E_
+    worker_run ();
+    return NULL;
+}
+#endif
 
-    printf ("connection established\n");
+static void pool_start (struct service *serv, int n)
+{E_
+    int k;
+
+    pool.todo_last = &pool.todo;
+#ifdef MSWIN
+    pool.sem = CreateSemaphore (NULL, 0, 0x7fffffff, NULL);
+    if (!pool.sem) {
+        printf ("CreateSemaphore failed with error: %d\n", (int) GetLastError ());
+        exit (1);
+    }
+#else
+    pthread_mutex_init (&pool.lock, NULL);
+    pthread_cond_init (&pool.cond, NULL);
+    if (pipe (pool.wake)) {
+        perror ("pipe");
+        exit (1);
+    }
+    fcntl (pool.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl (pool.wake[1], F_SETFL, O_NONBLOCK);
+#ifdef HAVE_EPOLL
+    {
+        struct epoll_event ev;
+        memset (&ev, '\0', sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void *) &pool;
+        if (epoll_ctl (serv->epfd, EPOLL_CTL_ADD, pool.wake[0], &ev)) {
+            perror ("epoll_ctl");
+            exit (1);
+        }
+    }
+#endif
+#endif
+
+    for (k = 0; k < n; k++) {
+#ifdef MSWIN
+        HANDLE h;
+        h = CreateThread (NULL, 0, worker_main, NULL, 0, NULL);
+        if (!h) {
+            printf ("CreateThread failed with error: %d\n", (int) GetLastError ());
+            exit (1);
+        }
+        CloseHandle (h);
+#else
+        pthread_t t;
+        int r;
+        if ((r = pthread_create (&t, NULL, worker_main, NULL))) {
+            fprintf (stderr, "pthread_create: %s\n", strerror (r));
+            exit (1);
+        }
+        pthread_detach (t);
+#endif
+    }
+}
+
+/* runs run on a worker, then done back on this thread */
+static void job_dispatch (struct job *j, void (*run) (struct job *), void (*done) (struct job *))
+{E_
+    j->run = run;
+    j->done = done;
+    j->next = NULL;
+    pool.pending++;
+
+    remotefs_lock (&pool.lock);
+    *pool.todo_last = j;
+    pool.todo_last = &j->next;
+#ifndef MSWIN
+    pthread_cond_signal (&pool.cond);
+#endif
+    remotefs_unlock (&pool.lock);
+#ifdef MSWIN
+    ReleaseSemaphore (pool.sem, 1, NULL);
+#endif
+}
+
+static void client_dispatch (struct client_item *i, void (*run) (struct job *), void (*done) (struct job *))
+{E_
+    i->busy = 1;
+    job_dispatch (&i->job, run, done);
+}
+
+static void add_client (struct service *serv)
+{E_
+    struct client_item *i;
+    int found_ip;
+    struct sock_data sock_data_, *sock_data;
+#ifdef MSWIN
+    BOOL yes = TRUE;
+    u_long nbio = 1;
+#else
+    int yes = 1;
+    int nbio = 1;
+#endif
+    socklen_t l;
+    remotefs_sockaddr_t client_address;
+
+    sock_data = &sock_data_;
+    memset (sock_data, '\0', sizeof (*sock_data));
+
+    l = sizeof (client_address);
+    sock_data->sock = accept (serv->h, (struct sockaddr *) &client_address, &l);
+    if (sock_data->sock == INVALID_SOCKET) {
+        perrorsocket ("accept fail");
+        return;
+    }
+
+    found_ip = iprange_match (serv->iprange_list, remotefs_sockaddr_t_address (&client_address), remotefs_sockaddr_t_addresslen (&client_address));
+
+    if (!found_ip) {
+        char t[64];
+        SHUTSOCK (sock_data);
+        ip_to_text (remotefs_sockaddr_t_address (&client_address), remotefs_sockaddr_t_addresslen (&client_address), t);
+        printf ("incoming address %s not in range %s\n", t, serv->option_range);
+        return;
+    }
+
+    if (setsockopt (sock_data->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &yes, sizeof (yes))) {
+        SHUTSOCK (sock_data);
+        perrorsocket ("setsockopt TCP_NODELAY\n");
+        return;
+    }
+    if (ioctlsocket (sock_data->sock, FIONBIO, &nbio))  {
+        SHUTSOCK (sock_data);
+        perrorsocket ("ioctl FIONBIO\n");
+        return;
+    }
+
+#ifdef HAVE_EPOLL
+    {
+        struct epoll_event ev;
+        memset (&ev, '\0', sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl (serv->epfd, EPOLL_CTL_ADD, sock_data->sock, &ev)) {
+            SHUTSOCK (sock_data);
+            perror ("epoll_ctl");
+            return;
+        }
+    }
+#endif
+
+    printf ("connection established\n");
 
     client_count++;
 
@@ -5396,71 +6165,236 @@ static void add_client (struct service *serv)
     i->client_address = client_address;
     i->d.sock_data = &i->sock_data;
     i->sd.reader_data = &i->d;
+    i->sd.fd = INVALID_HANDLE_VALUE;
+    i->sd.w.fd = INVALID_HANDLE_VALUE;
+    i->job.client = i;
+    i->events = CLIENT_WANT_READ;
+    client_expect_header (i);
     time (&i->last_accessed);
 
+#ifdef HAVE_EPOLL
+    {
+        struct epoll_event ev;
+        memset (&ev, '\0', sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void *) i;
+        epoll_ctl (serv->epfd, EPOLL_CTL_MOD, i->sock_data.sock, &ev);
+    }
+#endif
+
     i->next = serv->client_list;
     serv->client_list = i;
 
     printf ("adding %u\n", i->id);
 }
 
-static void process_client (struct client_item *i)
+/* returns -1 if out of memory, with the queue as it was */
+static int out_queue_append (struct out_queue *q, const void *p, long l)
+{E_
+    unsigned char *d;
+    long alloc;
+    if (q->sent && q->len + l > q->alloc) {
+        memmove (q->data, q->data + q->sent, q->len - q->sent);
+        q->len -= q->sent;
+        q->sent = 0;
+    }
+    if (q->len + l > q->alloc) {
+        alloc = MAX (q->alloc * 2, q->len + l);
+        if (!(d = (unsigned char *) realloc (q->data, alloc)))
+            return -1;
+        q->data = d;
+        q->alloc = alloc;
+    }
+    memcpy (q->data + q->len, p, l);
+    q->len += l;
+    return 0;
+}
+
+static void client_error (struct client_item *i, const char *s, const char *m, enum reader_error reader_error);
+
+/* queues v[] exactly as writervec() would have sent it. A client whose
+   response cannot be queued is dropped */
+static void client_queue (struct client_item *i, CStr *v, int n)
+{E_
+    int j;
+    if (!i->sock_data.crypto) {
+        for (j = 0; j < n; j++)
+            if (out_queue_append (&i->out, v[j].data, v[j].len))
+                goto nomem;
+        return;
+    }
+    if (!out_queue_append (&i->out, i->sock_data.crypto_data.write_buf, crypto_packet (&i->sock_data, v, n)))
+        return;
+  nomem:
+    client_error (i, "out of memory", "queueing response", READER_ERROR_NOERROR);
+}
+
+static void client_queue_ack (struct client_item *i, remotefs_error_code_t error_code)
 {E_
-#define r       (v[1])
-    CStr v[2];
-    char log_action[8];
-    unsigned char *p = NULL;
-    unsigned long long msglen;
-    unsigned long version, action, magic;
-    struct cooledit_remote_msg_header m;
     struct cooledit_remote_msg_ack ack;
-    enum reader_error reader_error = READER_ERROR_NOERROR;
+    CStr v;
+    memset (&ack, '\0', sizeof (ack));
+    encode_msg_ack (&ack, error_code, MSG_VERSION);
+    v.data = (char *) &ack;
+    v.len = sizeof (ack);
+    client_queue (i, &v, 1);
+}
 
-    memset (&r, '\0', sizeof (r));
+/* sends as much of the queue as the socket will take without blocking */
+static int client_flush (struct client_item *i)
+{E_
+    struct out_queue *q;
+    q = &i->out;
+    while (q->sent < q->len) {
+        int c;
+        c = send (i->sock_data.sock, (void *) (q->data + q->sent), MIN (q->len - q->sent, READER_CHUNK), 0);
+        if (c == SOCKET_ERROR && ERROR_EINTR ())
+            continue;
+        if (c == SOCKET_ERROR && ERROR_EAGAIN ())
+            break;
+        if (c <= 0)
+            return -1;
+        q->sent += c;
+        time (&i->last_accessed);
+    }
+    if (q->sent == q->len)
+        q->sent = q->len = 0;
+    return 0;
+}
 
-#define ERR(s,m)  \
-    do { \
-        printf ("%d: Error: %s, %s, %s, %s\n", i->id, (s), (m), reader_error == READER_ERROR_NOERROR ? strerrorsocket () : "", reader_error_to_str(reader_error)); \
-        goto errout; \
-    } while (0)
+static void client_error (struct client_item *i, const char *s, const char *m, enum reader_error reader_error)
+{E_
+    printf ("%d: Error: %s, %s, %s, %s\n", i->id, s, m, reader_error == READER_ERROR_NOERROR ? strerrorsocket () : "", reader_error_to_str (reader_error));
+    i->kill = KILL_HARD;
+}
 
-    if (reader (&i->d, &m, sizeof (m), &reader_error)) {
-        if (reader_error != READER_ERROR_NOERROR) {
-            /* This can only happy if crypto is enabled: */
-            int ignore;
-            struct crypto_packet_error e;
-            encode_uint16 (e.error_magic, CRYPTO_ERROR_MAGIC);
-            encode_uint32 (e.__future, 0);
-            encode_uint32 (e.read_error, reader_error);
-            ignore = send (i->sock_data.sock, (void *) &e, sizeof (e), 0);
-            if (ignore != sizeof (e)) {
-                ERR ("reading header, failed to send error msg", "");
-            } else {
-                ERR ("reading header, error msg sent", "");
-            }
-        } else {
-            ERR ("reading header, no error msg sent", "");
+/* returns non-zero if there is no response to send at all */
+static int client_failed (struct client_item *i, CStr *r)
+{E_
+    i->kill = KILL_SOFT;
+    printf ("Error: executing action, %s %d\n", i->action, r->len);
+    if (!r->len) {
+        if (r->data)
+            free (r->data);
+        r->data = NULL;
+        i->kill = KILL_HARD;
+        return 1;
+    }
+
+/* if we get here it means the action function wants to send a response but
+   then also immediately close the connection. We don't immediately send a
+   shutdown because stupid-windows takes a shutdown() to mean that all data
+   in the send queue must be discarded and stupid-windows also has no API
+   call to wait for the output of the send queue to be written to the network
+   nor any API call to inspect the send queue. Instead we wait for the client
+   to close. The response should include a force_shutdown=1 */
+
+    return 0;
+}
+
+/* queues the header h then the body r, and frees r */
+static void client_queue_response (struct client_item *i, CStr *h, CStr *r)
+{E_
+    CStr v[2];
+
+    v[0] = *h;
+    v[1] = *r;
+
+/* Large directory reads segfault here without this block: {{{ */
+    if (v[1].len > READER_CHUNK / 4) {
+        client_queue (i, &v[0], 1);
+        while (v[1].len > 0) {
+            CStr w;
+            w.data = v[1].data;
+            w.len = MIN (v[1].len, READER_CHUNK / 4);
+            client_queue (i, &w, 1);
+            v[1].data += w.len;
+            v[1].len -= w.len;
         }
+    } else {
+        client_queue (i, v, 2);
     }
 
-    decode_msg_header (&m, &msglen, &version, &action, &magic);
+    if (r->data)
+        free (r->data);
+    r->data = NULL;
+}
+
+/* queues the response to the current message and waits for the next one */
+static void client_respond (struct client_item *i, unsigned long action, CStr *r, int failed)
+{E_
+    struct cooledit_remote_msg_header m;
+    CStr h;
+
+    if (failed && client_failed (i, r))
+        return;
+
+    encode_msg_header (&m, r->len, MSG_VERSION, action, FILE_PROTO_MAGIC);
+    h.data = (char *) &m;
+    h.len = sizeof (m);
+    client_queue_response (i, &h, r);
+
+    i->sock_data.crypto = i->sock_data.enable_crypto;
+
+    client_expect_header (i);
+}
+
+/* queues the response to a tagged request, which may be any of those out */
+static void client_tagged_done (struct job *j)
+{E_
+    struct client_item *i = j->client;
+    unsigned char h[sizeof (struct cooledit_remote_msg_header) + TAGGED_ID_LEN];
+    CStr v;
+
+    i->tagged_pending--;
+    if (!j->c || !client_failed (i, &j->r)) {
+        encode_msg_header ((struct cooledit_remote_msg_header *) h, TAGGED_ID_LEN + j->r.len, MSG_VERSION_TAGGED, j->action_id, FILE_PROTO_MAGIC);
+        memcpy (h + sizeof (struct cooledit_remote_msg_header), j->tag, TAGGED_ID_LEN);
+        v.data = (char *) h;
+        v.len = sizeof (h);
+        client_queue_response (i, &v, &j->r);
+    }
+    free (j->body);
+    free (j);
+}
+
+/* returns non-zero if the request must wait for tagged ones still out */
+static int client_header (struct client_item *i)
+{E_
+    unsigned long long msglen;
+    unsigned long version, action, magic;
+
+    decode_msg_header (&i->m, &msglen, &version, &action, &magic);
+
+/* an untagged request is only answered after every tagged one before it */
+    if (version == MSG_VERSION_TAGGED ? i->tagged_pending >= TAGGED_MAX : i->tagged_pending > 0)
+        return -1;
 
     if (option_force_crypto) {
         if (!i->d.sock_data->crypto && action != REMOTEFS_ACTION_ENABLECRYPTO) {
-            memset (&ack, '\0', sizeof (ack));
-            encode_msg_ack (&ack, RFSERR_NON_CRYPTO_OP_ATTEMPTED, MSG_VERSION);
-            if (writer (&i->sock_data, &ack, sizeof (ack)))
-                ERR ("writing ack", i->action);
-            ERR ("non-crypto op attempted", "");
-            goto errout;
+            client_queue_ack (i, RFSERR_NON_CRYPTO_OP_ATTEMPTED);
+            client_error (i, "non-crypto op attempted", "", READER_ERROR_NOERROR);
+            return 0;
         }
     }
 
-    if (magic != FILE_PROTO_MAGIC)
-        ERR ("bad magic", "");
+    if (magic != FILE_PROTO_MAGIC) {
+        client_error (i, "bad magic", "", READER_ERROR_NOERROR);
+        return 0;
+    }
+
+    if (msglen > 1024 * 1024) {
+        client_error (i, "msglen > 1M", "", READER_ERROR_NOERROR);
+        return 0;
+    }
 
-    if (msglen > 1024 * 1024)
-        ERR ("msglen > 1M", "");
+    if (version == MSG_VERSION_TAGGED) {
+        if (msglen < TAGGED_ID_LEN) {
+            client_error (i, "no request id", "", READER_ERROR_NOERROR);
+            return 0;
+        }
+        goto body;
+    }
 
 /* we immediately ack so that the client can timeout if it does not
    recieve this ack. the subsequent response could take a long time
@@ -5468,18 +6402,123 @@ static void process_client (struct client_item *i)
    within an order of the ping time. the case of the client not getting
    this response means it can choose to try reconnect rather than waiste
    the users time. See (*1*): */
-    memset (&ack, '\0', sizeof (ack));
-    encode_msg_ack (&ack, 0, MSG_VERSION);
+    client_queue_ack (i, 0);
+
+  body:
+    if (!(i->body = (unsigned char *) malloc (msglen + 1))) {
+        client_error (i, "out of memory", "request msg", READER_ERROR_NOERROR);
+        return 0;
+    }
+    i->state = CLIENT_BODY;
+    i->in = i->body;
+    i->in_len = msglen;
+    i->in_got = 0;
+    return 0;
+}
+
+static void client_expect_frame (struct client_item *i)
+{E_
+    i->in = i->frame;
+    i->in_len = FRAME_HEADER_LEN;
+    i->in_got = 0;
+}
 
-    if (writer (&i->sock_data, &ack, sizeof (ack)))
-        ERR ("writing ack", i->action);
+/* file data is in frames if compression was agreed before the transfer began */
+static void client_stream_start (struct client_item *i)
+{E_
+    i->sd.framed = (i->sock_data.compress == COMPRESS_YES);
+    if (!i->sd.framed)
+        return;
 
-    p = (unsigned char *) malloc (msglen);
+    if (!i->chunk)
+        i->chunk = (unsigned char *) malloc (READER_CHUNK);
+    if (!i->zchunk)
+        i->zchunk = (unsigned char *) malloc (READER_CHUNK);
+/* out of memory, the frames of this transfer go as is */
+    if (!compress_start (&i->sock_data) || !i->zchunk)
+        free_compress_data (&i->sock_data);
+    if (i->sd.streaming == REMOTEFS_ACTION_WRITEFILE)
+        client_expect_frame (i);
+}
 
-    if (reader (&i->d, p, msglen, &reader_error))
-        ERR ("reading request msg", "");
+static void client_stream_end (struct client_item *i)
+{E_
+    struct compress_data *z;
+
+    i->sd.streaming = 0;
+    if (!i->sd.framed)
+        return;
+    i->sd.framed = 0;
+
+    z = i->sock_data.compress_data;
+    if (z && z->raw)
+        printf ("%u: %s %lld bytes as %lld, ratio %.2f\n", i->id, i->action, z->raw, z->wire, (double) z->raw / z->wire);
+}
+
+static void client_writefile_finish (struct client_item *i, CStr *r, int got_error)
+{E_
+/* tell the remote to hang up and not send any more data: */
+    client_queue_ack (i, got_error ? RFSERR_EARLY_TERMINATE_FROM_WRITE_FILE : RFSERR_SUCCESS);
+    client_stream_end (i);
+    client_respond (i, REMOTEFS_ACTION_WRITEFILE, r, i->sd.progress != i->sd.filelen);
+}
 
-    memset (&r, '\0', sizeof (r));
+static void client_action_job (struct job *j)
+{E_
+    j->c = (*action_list[j->action_id].action_fn) (&j->client->sd, &j->r, j->in, j->in_len);
+}
+
+static void client_action_done (struct job *j)
+{E_
+    struct client_item *i = j->client;
+
+    free (j->body);
+    j->body = NULL;
+
+    if (i->sd.opened.data) {
+        struct cooledit_remote_msg_header m;
+        CStr h;
+        encode_msg_header (&m, i->sd.opened.len, MSG_VERSION, j->action_id, FILE_PROTO_MAGIC);
+        h.data = (char *) &m;
+        h.len = sizeof (m);
+        client_queue_response (i, &h, &i->sd.opened);
+        if (!i->sd.streaming) {
+            unsigned char p[6];
+            CStr v;
+            encode_uint48 (p, 0);
+            v.data = (char *) p;
+            v.len = 6;
+            client_queue (i, &v, 1);
+        }
+    }
+
+    if (!j->c && i->sd.streaming)
+        client_stream_start (i);
+
+    if (j->c || !i->sd.streaming) {
+        client_respond (i, j->action_id, &j->r, j->c);
+    } else if (i->sd.streaming == REMOTEFS_ACTION_READFILE) {
+        unsigned char p[6];
+        CStr v;
+        encode_uint48 (p, i->sd.filelen);
+        v.data = (char *) p;
+        v.len = 6;
+        client_queue (i, &v, 1);
+    } else if (j->r.len) {
+/* the file could not be opened for writing */
+        client_writefile_finish (i, &j->r, 1);
+    }
+}
+
+static void client_body (struct client_item *i)
+{E_
+    char log_action[16];
+    unsigned long long msglen;
+    unsigned long version, action, magic;
+    void (*done) (struct job *);
+    struct job *j;
+
+    decode_msg_header (&i->m, &msglen, &version, &action, &magic);
 
     log_action[0] = '\0';
     if (action <= REMOTEFS_ACTION_NOTIMPLEMENTED || action >= sizeof (action_list) / sizeof (action_list[0])) {
@@ -5490,85 +6529,413 @@ static void process_client (struct client_item *i)
         snprintf (log_action, sizeof (log_action), "(%ld)", action);
         action = REMOTEFS_ACTION_NOTIMPLEMENTED;
     }
+    if (version == MSG_VERSION_TAGGED && !action_list[action].tagged) {
+        snprintf (log_action, sizeof (log_action), "(%ld tagged)", action);
+        action = REMOTEFS_ACTION_NOTIMPLEMENTED;
+    }
     i->action = action_descr[action];
     printf ("%u: %s%s%s: \n", i->id, i->sock_data.crypto ? (symauth_with_aesni (i->sock_data.crypto_data.symauth) ?  "(aesni) " : "(aes) ") : "", i->action, log_action);
-    if ((*action_list[action].action_fn) (&i->sd, &r, p, msglen)) {
-        i->kill = KILL_SOFT;
-        printf ("Error: executing action, %s %d\n", i->action, r.len);
-        if (!r.len)
-            goto errout; /* and kill hard */
-
-/* if we get here it means the action function wants to send a response but
-   then also immediately close the connection. We don't immediately send a
-   shutdown because stupid-windows takes a shutdown() to mean that all data
-   in the send queue must be discarded and stupid-windows also has no API
-   call to wait for the output of the send queue to be written to the network
-   nor any API call to inspect the send queue. Instead we wait for the client
-   to close. The response should include a force_shutdown=1 */
 
+    if (version == MSG_VERSION_TAGGED) {
+        j = (struct job *) malloc (sizeof (struct job));
+        memset (j, '\0', sizeof (*j));
+        memcpy (j->tag, i->body, TAGGED_ID_LEN);
+        j->in = i->body + TAGGED_ID_LEN;
+        j->in_len = i->in_len - TAGGED_ID_LEN;
+        done = client_tagged_done;
+        i->tagged_pending++;
+        client_expect_header (i);
+    } else {
+        j = &i->job;
+        memset (&j->r, '\0', sizeof (j->r));
+        j->in = i->body;
+        j->in_len = i->in_len;
+        done = client_action_done;
+    }
+    j->client = i;
+    j->action_id = action;
+    j->body = i->body;
+    i->body = NULL;
+
+    if (!action_list[action].blocking) {
+        client_action_job (j);
+        (*done) (j);
+    } else if (version == MSG_VERSION_TAGGED) {
+        job_dispatch (j, client_action_job, done);
+    } else {
+        client_dispatch (i, client_action_job, done);
     }
+}
 
-    free (p);
-    p = NULL;
+static void client_readfile_job (struct job *j)
+{E_
+    struct client_item *i = j->client;
+
+    memset (&j->r, '\0', sizeof (j->r));
+    j->c = 0;
+
+    if (i->sd.progress < i->sd.filelen) {
+        if (!i->chunk)
+            i->chunk = (unsigned char *) malloc (READER_CHUNK);
+        if ((j->c = readfile_read (i->sd.fd, i->chunk, MIN (i->sd.framed ? FRAME_CHUNK : READER_CHUNK, i->sd.filelen - i->sd.progress), &j->r)) > 0) {
+            if (i->sd.framed) {
+                int n;
+                j->in = frame_pack (i->sock_data.compress_data, i->frame, i->chunk, j->c, i->zchunk, &n);
+                j->in_len = n;
+            }
+            return;
+        }
+    } else {
+        alloc_encode_success (&j->r);
+    }
 
-    encode_msg_header (&m, r.len, MSG_VERSION, action, FILE_PROTO_MAGIC);
+    close (i->sd.fd);
+    i->sd.fd = INVALID_HANDLE_VALUE;
+}
 
-    v[0].data = (char *) &m;
-    v[0].len = sizeof (m);
+/* queues the chunk just read, or the response once the file is all out */
+static void client_readfile_done (struct job *j)
+{E_
+    struct client_item *i = j->client;
 
-/* Large directory reads segfault here without this block: {{{ */
-    if (v[1].len > READER_CHUNK / 4) {
-        int qlen;
-        char *qdata;
-        if (writervec (&i->sock_data, &v[0], 1))
-            ERR ("writing response header", i->action);
-        qdata = v[1].data;
-        qlen = v[1].len;
-        while (qlen > 0) {
-            int t;
-            CStr w;
-            t = MIN (qlen, READER_CHUNK / 4);
-            w.data = qdata;
-            w.len = t;
-            if (writervec (&i->sock_data, &w, 1))
-                ERR ("writing response header", i->action);
-            qlen -= t;
-            qdata += t;
+    if (j->c > 0) {
+        CStr v[2];
+        if (i->sd.framed) {
+            v[0].data = (char *) i->frame;
+            v[0].len = FRAME_HEADER_LEN;
+            v[1].data = (char *) j->in;
+            v[1].len = j->in_len;
+            client_queue (i, v, 2);
+        } else {
+            v[0].data = (char *) i->chunk;
+            v[0].len = j->c;
+            client_queue (i, v, 1);
         }
+        i->sd.progress += j->c;
+        return;
     }
-    else
-    if (writervec (&i->sock_data, v, 2))
-        ERR ("writing response header", i->action);
 
-    free (r.data);
-    r.data = NULL;
+    client_stream_end (i);
+    client_respond (i, j->action_id, &j->r, i->sd.progress != i->sd.filelen);
+}
 
-    i->sock_data.crypto = i->sock_data.enable_crypto;
+static void client_writefile_job (struct job *j)
+{E_
+    struct client_item *i = j->client;
+
+    memset (&j->r, '\0', sizeof (j->r));
 
+    if (j->c > 0) {
+        const unsigned char *p = j->in;
+        if (i->sd.framed && !(p = frame_unpack (i->sock_data.compress_data, j->in, j->in_len, i->chunk, j->c))) {
+            alloc_encode_error (&j->r, RFSERR_OTHER_ERROR, "invalid compressed frame", 0);
+            goto errout;
+        }
+        if (writefile_write (&i->sd.w, p, j->c, &j->r))
+            goto errout;
+    }
+    j->c = 0;
+    if (i->sd.progress == i->sd.filelen && writefile_close (&i->sd.w, &j->r))
+        goto errout;
     return;
 
   errout:
-    if (p)
-        free (p);
-    if (r.data)
-        free (r.data);
-    i->kill = KILL_HARD;
-    return;
-#undef r
+    writefile_abort (&i->sd.w);
+    j->c = -1;
+}
+
+static void client_writefile_done (struct job *j)
+{E_
+    struct client_item *i = j->client;
+
+    if (j->c < 0)
+        client_writefile_finish (i, &j->r, 1);
+    else if (i->sd.progress == i->sd.filelen)
+        client_writefile_finish (i, &j->r, 0);
+}
+
+/* hands what has arrived of a file being written to a worker, which
+   also finishes the file once it is all in */
+static void client_writefile_chunk (struct client_item *i)
+{E_
+    long n;
+
+    n = MIN ((long long) (i->d.avail - i->d.written), i->sd.filelen - i->sd.progress);
+    i->sd.progress += n;
+    i->job.in = i->d.buf + i->d.written;
+    i->job.in_len = n;
+    i->d.written += n;
+    i->job.c = n;
+    client_dispatch (i, client_writefile_job, client_writefile_done);
+}
+
+/* called once a compressed frame's header is in, and again once its
+   data is, which then goes to a worker as for client_writefile_chunk() */
+static void client_writefile_frame (struct client_item *i)
+{E_
+    int rawlen, wirelen;
+
+    if (frame_header (i->frame, i->sd.filelen - i->sd.progress, &rawlen, &wirelen)) {
+        writefile_abort (&i->sd.w);
+        client_stream_end (i);
+        client_error (i, "invalid compressed frame", i->action, READER_ERROR_NOERROR);
+        return;
+    }
+
+    if (i->in == i->frame) {
+        i->in = i->zchunk;
+        i->in_len = wirelen;
+        i->in_got = 0;
+        return;
+    }
+
+    i->sd.progress += rawlen;
+    i->job.in = i->zchunk;
+    i->job.in_len = wirelen;
+    i->job.c = rawlen;
+    client_expect_frame (i);
+    client_dispatch (i, client_writefile_job, client_writefile_done);
+}
+
+static void client_read_error (struct client_item *i, enum reader_error reader_error)
+{E_
+    if (i->sd.streaming == REMOTEFS_ACTION_WRITEFILE) {
+        writefile_abort (&i->sd.w);
+        i->sd.streaming = 0;
+        client_error (i, "reading file data", i->action, reader_error);
+    } else if (i->state == CLIENT_BODY) {
+        client_error (i, "reading request msg", "", reader_error);
+    } else if (reader_error != READER_ERROR_NOERROR) {
+        /* This can only happy if crypto is enabled: */
+        struct crypto_packet_error e;
+        encode_uint16 (e.error_magic, CRYPTO_ERROR_MAGIC);
+        encode_uint32 (e.__future, 0);
+        encode_uint32 (e.read_error, reader_error);
+        out_queue_append (&i->out, &e, sizeof (e));
+        client_error (i, "reading header, error msg sent", "", reader_error);
+    } else {
+        client_error (i, "reading header, no error msg sent", "", reader_error);
+    }
+}
+
+/* runs the client as far as it can go without blocking */
+static void client_step (struct client_item *i)
+{E_
+    enum reader_error reader_error = READER_ERROR_NOERROR;
+
+    while (!i->kill && !i->busy) {
+        int c;
+        if (i->out.len - i->out.sent >= OUT_QUEUE_MAX) {
+            if (client_flush (i)) {
+                i->kill = KILL_HARD;
+                break;
+            }
+            if (i->out.len - i->out.sent >= OUT_QUEUE_MAX)
+                break;
+        }
+        if (i->sd.streaming == REMOTEFS_ACTION_READFILE) {
+            client_dispatch (i, client_readfile_job, client_readfile_done);
+            continue;
+        }
+        if (i->sd.streaming == REMOTEFS_ACTION_WRITEFILE ? i->sd.progress == i->sd.filelen : i->in_got == i->in_len) {
+            if (i->sd.streaming)
+                client_writefile_chunk (i);
+            else if (i->state == CLIENT_BODY)
+                client_body (i);
+            else if (client_header (i))
+                break;
+            continue;
+        }
+        if (i->sd.framed && i->sd.streaming == REMOTEFS_ACTION_WRITEFILE && i->in_got == i->in_len) {
+            client_writefile_frame (i);
+            continue;
+        }
+        if (i->d.written == i->d.avail) {
+            if (!(c = reader_fill (&i->d, &reader_error)))
+                break;
+            if (c < 0) {
+                client_read_error (i, reader_error);
+                break;
+            }
+            time (&i->last_accessed);
+        }
+        if (i->sd.streaming && !i->sd.framed) {
+            client_writefile_chunk (i);
+        } else {
+            c = MIN (i->d.avail - i->d.written, i->in_len - i->in_got);
+            memcpy (i->in + i->in_got, i->d.buf + i->d.written, c);
+            i->in_got += c;
+            i->d.written += c;
+        }
+    }
+
+    if (i->kill == KILL_SOFT) {
+        /* empty the receive queue as a way of waiting for the remote to shutdown its end: */
+        for (;;) {
+            int discard;
+            char discard_data[16384];
+            discard = recv (i->sock_data.sock, discard_data, sizeof (discard_data), 0);
+            if (discard > 0) {
+                i->discard += discard;
+                continue;
+            }
+            if (discard == SOCKET_ERROR && ERROR_EINTR ())
+                continue;
+            if (!discard || !ERROR_EAGAIN ())
+                i->kill = KILL_HARD;
+            break;
+        }
+    }
+
+    if (client_flush (i))
+        i->kill = KILL_HARD;
+}
+
+static unsigned int client_wants (struct client_item *i)
+{E_
+    unsigned int w = 0;
+/* a busy client is not read from until its worker is done with it, nor
+   one whose next request waits on tagged ones */
+    if (!i->busy && (i->kill || (i->sd.streaming != REMOTEFS_ACTION_READFILE && i->out.len - i->out.sent < OUT_QUEUE_MAX
+                                 && !(i->state == CLIENT_HEADER && i->in_got == i->in_len))))
+        w |= CLIENT_WANT_READ;
+    if (i->out.sent < i->out.len)
+        w |= CLIENT_WANT_WRITE;
+    return w;
+}
+
+/* tells the poll what the client is now waiting for */
+static void client_update (struct service *serv, struct client_item *i)
+{E_
+#ifdef HAVE_EPOLL
+    struct epoll_event e;
+    memset (&e, '\0', sizeof (e));
+    if (i->kill == KILL_HARD) {
+/* a busy client can only be freed once its worker is done, but it must not wake us till then */
+        epoll_ctl (serv->epfd, EPOLL_CTL_DEL, i->sock_data.sock, &e);
+        serv->reap = 1;
+        return;
+    }
+    if (client_wants (i) == i->events)
+        return;
+    i->events = client_wants (i);
+    e.events = ((i->events & CLIENT_WANT_READ) ? EPOLLIN : 0) | ((i->events & CLIENT_WANT_WRITE) ? EPOLLOUT : 0);
+    e.data.ptr = (void *) i;
+    epoll_ctl (serv->epfd, EPOLL_CTL_MOD, i->sock_data.sock, &e);
+#else
+    if (i->kill == KILL_HARD)
+        serv->reap = 1;
+#endif
+}
+
+/* finishes on this thread what the workers have done, and carries on with those clients */
+static void pool_collect (struct service *serv)
+{E_
+    struct client_item *i;
+    struct job *j, *next;
+#ifndef MSWIN
+    char c[64];
+    while (read (pool.wake[0], c, sizeof (c)) > 0);
+#endif
+
+    remotefs_lock (&pool.lock);
+    j = pool.done;
+    pool.done = NULL;
+    remotefs_unlock (&pool.lock);
+
+    for (; j; j = next) {
+        next = j->next;
+        i = j->client;
+        assert (i->magic == CLIENT_MAGIC);
+        pool.pending--;
+        if (j == &i->job)
+            i->busy = 0;
+        time (&i->last_accessed);
+        (*j->done) (j);
+        client_step (i);
+        client_update (serv, i);
+    }
+}
+
+static void remove_client (struct service *serv, struct client_item *i)
+{E_
+#ifdef HAVE_EPOLL
+    struct epoll_event ev;
+    memset (&ev, '\0', sizeof (ev));
+    epoll_ctl (serv->epfd, EPOLL_CTL_DEL, i->sock_data.sock, &ev);
+#endif
+/* whatever is still queued, such as a final ack, is sent if the socket takes it */
+    client_flush (i);
+    SHUTSOCK (&i->sock_data);
+    i->magic = 0;
+    if (i->discard)
+        printf ("removing %u, discarding %ld bytes\n", i->id, (long) i->discard);
+    else
+        printf ("removing %u\n", i->id);
+    if (i->sd.streaming == REMOTEFS_ACTION_READFILE)
+        close (i->sd.fd);
+    if (i->sd.streaming == REMOTEFS_ACTION_WRITEFILE)
+        writefile_abort (&i->sd.w);
+    if (i->sock_data.crypto_data.symauth) {
+        symauth_free (i->sock_data.crypto_data.symauth);
+    }
+    if (i->body)
+        free (i->body);
+    if (i->chunk)
+        free (i->chunk);
+    if (i->zchunk)
+        free (i->zchunk);
+    free_compress_data (&i->sock_data);
+    if (i->out.data)
+        free (i->out.data);
+    free (i);
 }
 
 static void run_service (struct service *serv)
 {E_
     struct client_item *i, **j;
+    time_t now;
+#ifdef HAVE_EPOLL
+    struct epoll_event ev[64];
+    int n, k;
+
+    n = epoll_wait (serv->epfd, ev, sizeof (ev) / sizeof (ev[0]), 1000);
+    if (n < 0 && errno == EINTR) {
+        return;
+    } else if (n < 0) {
+        perror ("epoll_wait");
+        exit (1);
+    }
+
+    for (k = 0; k < n; k++) {
+        if (ev[k].data.ptr == (void *) &pool) {
+            pool_collect (serv);
+            continue;
+        }
+        i = (struct client_item *) ev[k].data.ptr;
+        if (!i) {
+            add_client (serv);
+            continue;
+        }
+        assert (i->magic == CLIENT_MAGIC);
+        client_step (i);
+        client_update (serv, i);
+    }
+#else
     int n = 0;
     int r;
-    fd_set rd;
+    fd_set rd, wr;
     struct timeval tv;
     FD_ZERO (&rd);
+    FD_ZERO (&wr);
 
     for (i = serv->client_list; i; i = i->next) {
         assert (i->magic == CLIENT_MAGIC);
-        FD_SET (i->sock_data.sock, &rd);
+        i->events = client_wants (i);
+        if ((i->events & CLIENT_WANT_READ))
+            FD_SET (i->sock_data.sock, &rd);
+        if ((i->events & CLIENT_WANT_WRITE))
+            FD_SET (i->sock_data.sock, &wr);
         n = MAX (n, i->sock_data.sock);
     }
     FD_SET (serv->h, &rd);
@@ -5576,9 +6943,20 @@ static void run_service (struct service *serv)
 
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    r = select (n + 1, &rd, NULL, NULL, &tv);
+#ifdef MSWIN
+/* select() only takes sockets here, so finished jobs are polled for */
+    if (pool.pending) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+    }
+#else
+    FD_SET (pool.wake[0], &rd);
+    n = MAX (n, pool.wake[0]);
+#endif
+    r = select (n + 1, &rd, &wr, NULL, &tv);
     if (!r) {
         FD_ZERO (&rd);
+        FD_ZERO (&wr);
     } else if (r == SOCKET_ERROR && (ERROR_EINTR() || ERROR_EAGAIN())) {
         return;
     } else if (r == SOCKET_ERROR) {
@@ -5586,57 +6964,41 @@ static void run_service (struct service *serv)
         exit (1);
     }
 
-    if (FD_ISSET (serv->h, &rd))
-        add_client (serv);
-
     for (i = serv->client_list; i; i = i->next) {
         assert (i->magic == CLIENT_MAGIC);
-        if (FD_ISSET (i->sock_data.sock, &rd)) {
-            if (i->kill) {
-                int discard;
-                char discard_data[16384];
-                /* empty the receive queue as a way of waiting for the remote to shutdown its end: */
-                if ((discard = recv (i->sock_data.sock, discard_data, sizeof (discard_data), 0)) <= 0)
-                    i->kill = KILL_HARD;
-                else
-                    i->discard += discard;
-            } else {
-                process_client (i);
-                time (&i->last_accessed);
-            }
+        if (((i->events & CLIENT_WANT_READ) && FD_ISSET (i->sock_data.sock, &rd)) || ((i->events & CLIENT_WANT_WRITE) && FD_ISSET (i->sock_data.sock, &wr))) {
+            client_step (i);
+            client_update (serv, i);
         }
     }
 
+    pool_collect (serv);
+
+    if (FD_ISSET (serv->h, &rd))
+        add_client (serv);
+#endif
+
+/* idle clients are looked for once a second, dead ones as soon as they die */
+    time (&now);
+    if (now == serv->last_sweep && !serv->reap)
+        return;
+    serv->last_sweep = now;
+    serv->reap = 0;
+
     for (j = &serv->client_list;;) {
-        time_t now;
-        time (&now);
         i = *j;
         if (!i)
             break;
         assert (i->magic == CLIENT_MAGIC);
 
-        if (now > i->last_accessed + 25 /* for firewalls that are 30s timeout */) {
-            struct cooledit_remote_msg_ack ack;
-            memset (&ack, '\0', sizeof (ack));
-            encode_msg_ack (&ack, RFSERR_SERVER_CLOSED_IDLE_CLIENT, MSG_VERSION);
-            writer (&i->sock_data, &ack, sizeof (ack));
+        if (!i->busy && !i->tagged_pending && now > i->last_accessed + 25 /* for firewalls that are 30s timeout */) {
+            client_queue_ack (i, RFSERR_SERVER_CLOSED_IDLE_CLIENT);
             i->kill = KILL_HARD;
         }
 
-        if (i->kill == KILL_HARD) {
-            struct client_item *next;
-            SHUTSOCK (&i->sock_data);
-            next = i->next;
-            i->magic = 0;
-            if (i->discard)
-                printf ("removing %u, discarding %ld bytes\n", i->id, (long) i->discard);
-            else
-                printf ("removing %u\n", i->id);
-            if (i->sock_data.crypto_data.symauth) {
-                symauth_free (i->sock_data.crypto_data.symauth);
-            }
-            free (i);
-            *j = next;
+        if (i->kill == KILL_HARD && !i->busy && !i->tagged_pending) {
+            *j = i->next;
+            remove_client (serv, i);
         } else {
             j = &i->next;
         }
@@ -5665,6 +7027,7 @@ void remotefs_serverize (const char *listen_address, const char *option_range)
 #endif
 
     init_service (&serv, listen_address, option_range);
+    pool_start (&serv, option_workers ? option_workers : WORKERS_DEFAULT);
 
     printf ("running\n");
 
@@ -5830,6 +7193,13 @@ int main (int argc, char **argv)
             if (i >= argc)
                 goto usage;
             keyfile = wchar_to_char (argv[i]);
+        } else if (!strcmp (p, "-w") || !strcmp (p, "--workers")) {
+            i++;
+            if (i >= argc)
+                goto usage;
+            option_workers = atoi (wchar_to_char (argv[i]));
+            if (option_workers < 1 || option_workers > WORKERS_MAX)
+                goto usage;
         } else if (p[0] == '-') {
             goto usage;
         } else {
@@ -5895,6 +7265,8 @@ int main (int argc, char **argv)
         printf ("                                       If not specified, AESKEYFILE will be created\n");
         printf ("                                       and populated with a strong random key.\n");
         printf ("                                       If AESKEYFILE exists it will be read.\n");
+        printf ("  -w <n>, --workers <n>                Run filesystem calls on <n> threads, 1 to %d.\n", WORKERS_MAX);
+        printf ("                                       Default: %d\n", WORKERS_DEFAULT);
         printf ("  -h                                   Print help and exit.\n");
         printf ("\n");
 #ifdef __clang_version__
@@ -6017,6 +7389,118 @@ static void test_floatspecial__ (int line, double J, int N, unsigned long long n
     }
 }
 
+/* packs len bytes at in as one frame, checks its header, and unpacks it again: returns the length sent */
+static int test_frame_roundtrip (struct compress_data *zp, struct compress_data *zu, const unsigned char *in, int len)
+{E_
+    static unsigned char out[READER_CHUNK], back[READER_CHUNK];
+    unsigned char h[FRAME_HEADER_LEN];
+    const unsigned char *f, *r;
+    int n, rawlen, wirelen;
+
+    f = frame_pack (zp, h, in, len, out, &n);
+    assert (n > 0 && n <= len);
+    assert (!frame_header (h, len, &rawlen, &wirelen));
+    assert (rawlen == len && wirelen == n);
+    r = frame_unpack (zu, f, wirelen, back, rawlen);
+    assert (r);
+    assert (!memcmp (r, in, len));
+    return wirelen;
+}
+
+static void test_frame_header (unsigned long raw, unsigned long wire, long long remaining, int expect)
+{E_
+    unsigned char h[FRAME_HEADER_LEN];
+    int rawlen = 0, wirelen = 0;
+    encode_uint32 (h, raw);
+    encode_uint32 (h + 4, wire);
+    assert (frame_header (h, remaining, &rawlen, &wirelen) == expect);
+    if (!expect)
+        assert ((unsigned long) rawlen == raw && (unsigned long) wirelen == wire);
+}
+
+static void test_frames (void)
+{E_
+    static unsigned char text[FRAME_CHUNK], noise[FRAME_CHUNK], out[READER_CHUNK], back[READER_CHUNK];
+    struct compress_data zp, zu;
+    unsigned char h[FRAME_HEADER_LEN];
+    unsigned long seed = 1;
+    const unsigned char *f;
+    int i, n;
+
+    memset (&zp, '\0', sizeof (zp));
+    memset (&zu, '\0', sizeof (zu));
+    zp.backoff = zu.backoff = 1;
+    for (i = 0; i < FRAME_CHUNK; i++) {
+        text[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+        seed = seed * 1103515245 + 12345;
+        noise[i] = (unsigned char) (seed >> 16);
+    }
+
+/* compressible */
+    n = test_frame_roundtrip (&zp, &zu, text, FRAME_CHUNK);
+#ifdef HAVE_LIBZ
+    assert (n < FRAME_CHUNK / 4);
+#else
+    assert (n == FRAME_CHUNK);
+#endif
+
+/* incompressible goes as is, then the next frames skip deflate with a doubling backoff */
+    assert (test_frame_roundtrip (&zp, &zu, noise, FRAME_CHUNK) == FRAME_CHUNK);
+#ifdef HAVE_LIBZ
+    assert (zp.skip == 1 && zp.backoff == 2);
+    assert (test_frame_roundtrip (&zp, &zu, text, FRAME_CHUNK) == FRAME_CHUNK);
+    assert (zp.skip == 0);
+    assert (test_frame_roundtrip (&zp, &zu, noise, FRAME_CHUNK) == FRAME_CHUNK);
+    assert (zp.skip == 2 && zp.backoff == 4);
+    for (i = 0; i < 100; i++)
+        test_frame_roundtrip (&zp, &zu, noise, FRAME_CHUNK);
+    assert (zp.backoff == COMPRESS_BACKOFF_MAX && zp.skip <= COMPRESS_BACKOFF_MAX);
+    while (zp.skip)
+        assert (test_frame_roundtrip (&zp, &zu, text, FRAME_CHUNK) == FRAME_CHUNK);
+/* a chunk that shrinks again resets the backoff */
+    assert (test_frame_roundtrip (&zp, &zu, text, FRAME_CHUNK) < FRAME_CHUNK);
+    assert (zp.skip == 0 && zp.backoff == 1);
+#endif
+
+/* with no compression state frames go as is, and only those can be read */
+    assert (test_frame_roundtrip (NULL, NULL, text, FRAME_CHUNK) == FRAME_CHUNK);
+    assert (test_frame_roundtrip (NULL, &zu, text, FRAME_CHUNK) == FRAME_CHUNK);
+    assert (test_frame_roundtrip (NULL, NULL, text, 1) == 1);
+
+/* headers frame_pack() could not have made */
+    test_frame_header (FRAME_CHUNK, FRAME_CHUNK, FRAME_CHUNK, 0);
+    test_frame_header (100, 10, 100, 0);
+    test_frame_header (100, 101, 1000, -1);
+    test_frame_header (FRAME_CHUNK + 1, 10, FRAME_CHUNK * 2, -1);
+    test_frame_header (100, 10, 99, -1);
+    test_frame_header (0, 0, 100, -1);
+    test_frame_header (100, 0, 100, -1);
+
+#ifdef HAVE_LIBZ
+/* a corrupt deflate payload */
+    f = frame_pack (&zp, h, text, FRAME_CHUNK, out, &n);
+    assert (f == out && n < FRAME_CHUNK);
+    assert (frame_unpack (&zu, out, n, back, FRAME_CHUNK));
+    assert (!frame_unpack (NULL, out, n, back, FRAME_CHUNK));
+    assert (!frame_unpack (&zu, out, n - 1, back, FRAME_CHUNK));
+    assert (!frame_unpack (&zu, out, n, back, FRAME_CHUNK - 1));
+    assert (!frame_unpack (&zu, out, n + 1, back, FRAME_CHUNK));      /* trailing bytes */
+    out[0] |= 0x06;     /* reserved block type */
+    assert (!frame_unpack (&zu, out, n, back, FRAME_CHUNK));
+    memset (out, 0xFF, n);
+    assert (!frame_unpack (&zu, out, n, back, FRAME_CHUNK));
+/* the state recovers for the next frame */
+    assert (test_frame_roundtrip (&zp, &zu, text, FRAME_CHUNK) < FRAME_CHUNK);
+    deflateEnd (&zp.deflate);
+    inflateEnd (&zu.inflate);
+#else
+    (void) f;
+    (void) h;
+    (void) out;
+    (void) back;
+#endif
+}
+
 #include "math.h"
 
 int main (int argc, char **argv)
@@ -6359,6 +7843,8 @@ int main (int argc, char **argv)
     assert (!r);
     assert (v == 0xdfd207fd99fae816ULL);
 
+    test_frames ();
+
     printf ("Success\n");
 }
 
@@ -347,6 +347,7 @@ enum remotefs_error_code {
 void remotefs_serverize (const char *listen_address, const char *acceptrange);
 
 struct file_entry;
+struct portable_stat;
 
 struct remotefs *remotefs_lookup (const char *host_, char *directory);
 #define the_remotefs_local                      (remotefs_lookup (REMOTEFS_LOCAL, NULL))
@@ -355,6 +356,8 @@ struct action_callbacks {
     void *hook;
     int (*sock_reader) (struct action_callbacks *o, const unsigned char *chunk, int chunklen, long long filelen, char *errmsg);
     int (*sock_writer) (struct action_callbacks *o, unsigned char *chunk, int *chunklen, char *errmsg);
+/* remotefs_openfile: called with the file's stat once access is granted, before any sock_reader */
+    int (*sock_opened) (struct action_callbacks *o, const struct portable_stat *st, char *errmsg);
 };
 
 typedef unsigned long long remotefs_error_code_t;
@@ -369,7 +372,6 @@ enum remotfs_password_return {
 typedef enum remotfs_password_return (*remotfs_password_cb_t) (void *user_data, int again, const char *host, int *crypto_enabled, unsigned char *password, const char *user_msg, char *errmsg);
 
 struct remotefs_private;
-struct portable_stat;
 
 const char *remotefs_home_dir (struct remotefs *rfs);
 void remotefs_set_password_cb (remotfs_password_cb_t f, void *d);
@@ -385,6 +387,7 @@ struct remotefs {
     int (*remotefs_realpathize) (struct remotefs *rfs, const char *path, const char *homedir, char *out, int outlen, char *errmsg);
     int (*remotefs_gethomedir) (struct remotefs *rfs, char *out, int outlen, char *errmsg);
     int (*remotefs_enablecrypto) (struct remotefs *rfs, const unsigned char *challenge_local, unsigned char *challenge_remote, char *errmsg);
+    int (*remotefs_openfile) (struct remotefs *rfs, struct action_callbacks *o, const char *filename, unsigned long long sizelimit, struct portable_stat *st, char *errmsg);
     struct remotefs_private *remotefs_private;
 };
 
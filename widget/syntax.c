@@ -61,6 +61,9 @@ struct defin {
 
 int option_syntax_highlighting = 1;
 int option_auto_spellcheck = 1;
+#if !defined (GTK) && !defined (MIDNIGHT)
+int option_syntax_background = 1;
+#endif
 
 /* these three functions are called from the outside */
 int edit_load_syntax (WEdit * edit, char **names, char *type);
@@ -229,15 +232,215 @@ static long compare_word_to_right_ (WEdit * edit, long i, const char *text, cons
     return (whole_right != NULL && strchr (whole_right, edit_get_lowercase_byte (edit, i)) != NULL) ? -1 : (i - end_of_line_adjust);
 }
 
-static inline const char *xx_strchr (const WEdit * edit, const unsigned char *s, int char_byte)
+/*
+   Keywords of a context that are plain strings are compiled into a trie,
+   so that every keyword that can start at a position is found in a single
+   walk over the text. Keywords containing wildcards are tried one at a
+   time as before. As before, the lowest numbered keyword that matches wins.
+ */
+struct keyword_trie_node {
+    int child;
+    int sibling;
+    int keyword;		/* lowest keyword ending here */
+    int min_keyword;		/* lowest keyword ending here or further on */
+    unsigned char c;
+};
+
+struct keyword_trie {
+    int root[256];
+    struct keyword_trie_node *node;
+    int n_nodes;
+    int n_alloc;
+    int *same;			/* next keyword with the same text, by keyword number */
+    int *wild;			/* keywords with wildcards, grouped by first byte: */
+    int wild_start[258];	/* those starting with byte c are wild[wild_start[c]...wild_start[c + 1] - 1], those starting with a wildcard are at 256 */
+};
+
+#define WILD_FIRST(k)		((k)->first < '\006' ? 256 : (k)->first)
+
+static int keyword_is_literal (struct key_word *k)
+{E_
+    const unsigned char *p;
+    for (p = (const unsigned char *) k->keyword; p < (const unsigned char *) k->keyword_e; p++)
+	if (*p >= '\001' && *p <= '\005')
+	    return 0;
+    return 1;
+}
+
+/* finds or adds the child of node x for the byte c, x being zero for the
+   root. Returns -1 if out of memory */
+static int keyword_trie_child (struct keyword_trie *t, int x, unsigned char c)
+{E_
+    struct keyword_trie_node *n;
+    int y;
+    for (y = x ? t->node[x].child : t->root[c]; y; y = t->node[y].sibling)
+	if (t->node[y].c == c)
+	    return y;
+    if (t->n_nodes >= t->n_alloc) {
+	if (!(n = realloc (t->node, t->n_alloc * 2 * sizeof (struct keyword_trie_node))))
+	    return -1;
+	t->node = n;
+	t->n_alloc *= 2;
+    }
+    y = t->n_nodes++;
+    memset (&t->node[y], 0, sizeof (struct keyword_trie_node));
+    t->node[y].c = c;
+    if (x) {
+	t->node[y].sibling = t->node[x].child;
+	t->node[x].child = y;
+    } else {
+	t->root[c] = y;
+    }
+    return y;
+}
+
+static void keyword_trie_free (struct context_rule *r);
+
+/* returns NULL if out of memory */
+static struct keyword_trie *keyword_trie_build (struct context_rule *r)
+{E_
+    struct keyword_trie *t;
+    int j, n, x, w;
+    const unsigned char *p;
+    t = syntax_malloc (sizeof (struct keyword_trie));
+/* keyword_first_chars ends at the last keyword that may be matched */
+    n = strlen (r->keyword_first_chars);
+    t->n_alloc = 256;
+    t->n_nodes = 1;		/* node 0 means none */
+    t->node = syntax_malloc (t->n_alloc * sizeof (struct keyword_trie_node));
+    t->same = syntax_malloc ((n + 1) * sizeof (int));
+    t->wild = syntax_malloc ((n + 1) * sizeof (int));
+    for (j = 1; j < n; j++) {
+	struct key_word *k = r->keyword[j];
+	if (!keyword_is_literal (k)) {
+	    t->wild_start[WILD_FIRST (k) + 1]++;
+	    continue;
+	}
+	if (k->keyword_e == k->keyword)
+	    continue;
+	x = 0;
+	for (p = (const unsigned char *) k->keyword; p < (const unsigned char *) k->keyword_e; p++) {
+	    if ((x = keyword_trie_child (t, x, *p)) < 0) {
+		r->keyword_trie = t;
+		keyword_trie_free (r);
+		return NULL;
+	    }
+	    if (!t->node[x].min_keyword)
+		t->node[x].min_keyword = j;
+	}
+	if (!t->node[x].keyword) {
+	    t->node[x].keyword = j;
+	} else {
+	    for (w = t->node[x].keyword; t->same[w]; w = t->same[w]);
+	    t->same[w] = j;
+	}
+    }
+    for (x = 1; x < 258; x++)
+	t->wild_start[x] += t->wild_start[x - 1];
+    for (j = 1; j < n; j++)
+	if (!keyword_is_literal (r->keyword[j])) {
+	    x = WILD_FIRST (r->keyword[j]);
+	    t->wild[t->wild_start[x]++] = j;
+	}
+/* the fill moved each start onto the next */
+    for (x = 257; x > 0; x--)
+	t->wild_start[x] = t->wild_start[x - 1];
+    t->wild_start[0] = 0;
+    return t;
+}
+
+static void keyword_trie_free (struct context_rule *r)
+{E_
+    if (!r->keyword_trie)
+	return;
+    syntax_free (r->keyword_trie->node);
+    syntax_free (r->keyword_trie->same);
+    syntax_free (r->keyword_trie->wild);
+    syntax_free (r->keyword_trie);
+}
+
+static inline const char *xx_strchr (const unsigned char *s, int char_byte)
 {E_
-    (void) edit;
     while (*s >= '\006' && *s != char_byte)
 	s++;
-
     return (const char *) s;
 }
 
+/* same result as keyword_trie_match() by trying each keyword starting
+   with c or a wildcard in turn, for when the trie could not be built */
+static int keyword_scan_match (WEdit * edit, struct context_rule *r, long i, int c, long *end)
+{E_
+    struct key_word *k;
+    const char *p;
+    int count;
+    long e;
+    p = r->keyword_first_chars;
+    if (!p)
+	return 0;
+    while (*(p = xx_strchr ((const unsigned char *) p + 1, c))) {
+	count = (unsigned long) p - (unsigned long) r->keyword_first_chars;
+	k = r->keyword[count];
+	e = compare_word_to_right (edit, i, k->keyword, k->whole_word_chars_left, k->whole_word_chars_right, k->line_start, k->brace_match);
+	if (e > 0) {
+	    *end = e;
+	    return count;
+	}
+    }
+    return 0;
+}
+
+/* returns the lowest numbered keyword of r matching at i, and where it ends, or 0 */
+static int keyword_trie_match (WEdit * edit, struct context_rule *r, long i, int c, long *end)
+{E_
+    struct keyword_trie *t;
+    struct key_word *k;
+    int x, w, d, left = -1, best = 0;
+    const int *a, *a_e, *b, *b_e;
+    long j, e;
+
+    if (!r->keyword_first_chars)
+	return 0;
+    if (!r->keyword_trie && !(r->keyword_trie = keyword_trie_build (r)))
+	return keyword_scan_match (edit, r, i, c, end);
+    t = r->keyword_trie;
+
+    for (x = t->root[c], j = i + 1; x && (!best || t->node[x].min_keyword < best); j++) {
+	for (w = t->node[x].keyword; w && (!best || w < best); w = t->same[w]) {
+	    k = r->keyword[w];
+	    if (left < 0)
+		left = edit_get_lowercase_byte (edit, i - 1);
+	    if ((k->line_start && left != '\n') || (k->whole_word_chars_left != NULL && strchr (k->whole_word_chars_left, left) != NULL))
+		continue;
+	    if (k->whole_word_chars_right != NULL && strchr (k->whole_word_chars_right, edit_get_lowercase_byte (edit, j)) != NULL)
+		continue;
+	    best = w;
+	    *end = j;
+	    break;
+	}
+	d = edit_get_lowercase_byte (edit, j);
+	for (x = t->node[x].child; x && t->node[x].c != d; x = t->node[x].sibling);
+    }
+
+/* keywords with wildcards starting with c or with a wildcard, in order */
+    a = t->wild + t->wild_start[c];
+    a_e = t->wild + t->wild_start[c + 1];
+    b = t->wild + t->wild_start[256];
+    b_e = t->wild + t->wild_start[257];
+    while (a < a_e || b < b_e) {
+	w = (b == b_e || (a < a_e && *a < *b)) ? *a++ : *b++;
+	if (best && w > best)
+	    break;
+	k = r->keyword[w];
+	e = compare_word_to_right (edit, i, k->keyword, k->whole_word_chars_left, k->whole_word_chars_right, k->line_start, k->brace_match);
+	if (e > 0) {
+	    best = w;
+	    *end = e;
+	    break;
+	}
+    }
+    return best;
+}
+
 static inline void apply_rules_going_right (WEdit * edit, long i, struct syntax_rule rule)
 {E_
     struct context_rule *r = NULL;
@@ -285,36 +488,25 @@ static inline void apply_rules_going_right (WEdit * edit, long i, struct syntax_
 
 /* check to turn on a keyword */
     if (!_rule.keyword && !((_rule.border & RULE_ON_LEFT_BORDER) != 0 && _rule._context != _rule.context)) {
-	const char *p;
-        r = edit->rules[_rule.context];
-	p = r->keyword_first_chars;
-	if (p != NULL)
-	    while (*(p = xx_strchr (edit, (const unsigned char *) p + 1, c)) != '\0') {
-	        struct key_word *k;
-	        int count;
-	        long e;
-	        count = (unsigned long) p - (unsigned long) r->keyword_first_chars;
-	        k = r->keyword[count];
-	        e = compare_word_to_right (edit, i, k->keyword, k->whole_word_chars_left, k->whole_word_chars_right, k->line_start, k->brace_match);
-	        if (e > 0) {
+	int count;
+	long e;
+	if ((count = keyword_trie_match (edit, edit->rules[_rule.context], i, c, &e)) > 0) {
 
 #if 0
-		    /* when both context and keyword terminate with a newline,
-		       the context overflows to the next line and colorizes it incorrectly */
-		    if (e > i + 1 && _rule._context != 0 && k->keyword[strlen (k->keyword) - 1] == '\n') {
-			r = edit->rules[_rule._context];
-			if (r->right != NULL && r->right[0] != '\0' && r->right[strlen (r->right) - 1] == '\n')
-			    e--;
-		    }
+	    /* when both context and keyword terminate with a newline,
+	       the context overflows to the next line and colorizes it incorrectly */
+	    if (e > i + 1 && _rule._context != 0 && k->keyword[strlen (k->keyword) - 1] == '\n') {
+		r = edit->rules[_rule._context];
+		if (r->right != NULL && r->right[0] != '\0' && r->right[strlen (r->right) - 1] == '\n')
+		    e--;
+	    }
 #endif
 
-		    end = e;
-		    _rule.end = e;
-		    _rule.keyword = count;
-		    keyword_foundright = 1;
-		    break;
-	        }
-	    }
+	    end = e;
+	    _rule.end = e;
+	    _rule.keyword = count;
+	    keyword_foundright = 1;
+	}
     }
 
 /* check to turn on a context */
@@ -372,78 +564,176 @@ static inline void apply_rules_going_right (WEdit * edit, long i, struct syntax_
 
 /* check again to turn on a keyword if the context switched */
     if (contextchanged && !_rule.keyword) {
-	const char *p;
-        r = edit->rules[_rule.context];
-	p = r->keyword_first_chars;
-	while (*(p = xx_strchr (edit, (unsigned char *) p + 1, c))) {
-	    struct key_word *k;
-	    int count;
-	    long e;
-	    count = (unsigned long) p - (unsigned long) r->keyword_first_chars;
-	    k = r->keyword[count];
-	    e = compare_word_to_right (edit, i, k->keyword, k->whole_word_chars_left, k->whole_word_chars_right, k->line_start, k->brace_match);
-	    if (e > 0) {
-		_rule.end = e;
-		_rule.keyword = count;
-		break;
-	    }
+	int count;
+	long e;
+	if ((count = keyword_trie_match (edit, edit->rules[_rule.context], i, c, &e)) > 0) {
+	    _rule.end = e;
+	    _rule.keyword = count;
 	}
     }
     edit->rule = _rule;
 }
 
+#define syntax_rule_equal(a, b) \
+    ((a).keyword == (b).keyword && (a).brace_depth == (b).brace_depth && (a).end == (b).end \
+     && (a).context == (b).context && (a)._context == (b)._context && (a).border == (b).border)
+
+/* index of the first marker at or after offset */
+static long syntax_marker_search (WEdit * edit, long offset)
+{E_
+    long lo = 0, hi = edit->n_syntax_markers, mid, o;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	o = edit->syntax_marker[mid].offset;
+	if (mid >= edit->syntax_shift_index)
+	    o += edit->syntax_shift;
+	if (o < offset)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void syntax_marker_flush_shift (WEdit * edit)
+{E_
+    long k;
+    for (k = edit->syntax_shift_index; k < edit->n_syntax_markers; k++) {
+	edit->syntax_marker[k].offset += edit->syntax_shift;
+	edit->syntax_marker[k].rule.end += edit->syntax_shift;
+    }
+    edit->syntax_shift = 0;
+}
+
+/*
+   Called whenever delta bytes are inserted (or -delta bytes deleted) at p.
+   Markers past the change are moved rather than freed, and are only marked
+   unverified: edit_get_rule() rechecks them on its way forward and stops
+   relexing at the first one it reaches in the same state. Consecutive
+   changes at the same place accumulate into one pending shift.
+ */
+void edit_syntax_modification (WEdit * edit, long p, long delta)
+{E_
+    long a, b, start;
+
+/* a keyword matched shortly before p may run on into the changed text */
+    start = p - SYNTAX_MARKER_DENSITY;
+    if (edit->last_get_rule >= start)
+	edit->syntax_invalidate = 1;
+    if (edit->syntax_dirty == LONG_MAX) {
+	edit->syntax_dirty = start;
+	edit->syntax_dirty_end = p;
+    } else {
+	if (edit->syntax_dirty_end > p)
+	    edit->syntax_dirty_end = max (p, edit->syntax_dirty_end + delta);
+	edit->syntax_dirty = min (edit->syntax_dirty, start);
+    }
+    edit->syntax_dirty_end = max (edit->syntax_dirty_end, p + max (delta, 0));
+
+    if (!edit->n_syntax_markers || !delta)
+	return;
+    a = b = syntax_marker_search (edit, p);
+    if (delta < 0)
+	b = syntax_marker_search (edit, p - delta);
+    if (b > a || (edit->syntax_shift && b != edit->syntax_shift_index))
+	syntax_marker_flush_shift (edit);
+/* markers inside deleted text have nothing left to mark */
+    if (b > a) {
+	memmove (edit->syntax_marker + a, edit->syntax_marker + b, (edit->n_syntax_markers - b) * sizeof (struct _syntax_marker));
+	edit->n_syntax_markers -= b - a;
+    }
+    edit->syntax_shift_index = a;
+    edit->syntax_shift += delta;
+}
+
+/* returns -1 if out of memory, markers being only a shortcut */
+static int syntax_marker_insert (WEdit * edit, long k, long offset)
+{E_
+    struct _syntax_marker *m;
+    long n;
+    if (edit->n_syntax_markers >= edit->syntax_markers_alloc) {
+	n = edit->syntax_markers_alloc ? edit->syntax_markers_alloc * 2 : 256;
+	if (!(m = realloc (edit->syntax_marker, n * sizeof (struct _syntax_marker))))
+	    return -1;
+	edit->syntax_marker = m;
+	edit->syntax_markers_alloc = n;
+    }
+    memmove (edit->syntax_marker + k + 1, edit->syntax_marker + k, (edit->n_syntax_markers - k) * sizeof (struct _syntax_marker));
+    edit->n_syntax_markers++;
+    edit->syntax_marker[k].offset = offset;
+    edit->syntax_marker[k].rule = edit->rule;
+    return 0;
+}
+
+/* restart the rule state from the last verified marker before offset */
+static void syntax_marker_restore (WEdit * edit, long offset)
+{E_
+    long k;
+    k = syntax_marker_search (edit, min (offset, edit->syntax_dirty));
+    if (k > 0) {
+	edit->last_get_rule = edit->syntax_marker[k - 1].offset;
+	edit->rule = edit->syntax_marker[k - 1].rule;
+    } else {
+	edit->last_get_rule = -1;
+	memset (&edit->rule, 0, sizeof (edit->rule));
+    }
+}
+
 static struct syntax_rule edit_get_rule (WEdit * edit, long byte_index)
 {E_
-    long i;
+    long i, k, j;
+    struct _syntax_marker *s;
+    if (edit->syntax_shift)
+	syntax_marker_flush_shift (edit);
     if (edit->syntax_invalidate) {
-	struct _syntax_marker *s;
-	while (edit->syntax_marker && edit->syntax_marker->offset >= edit->last_get_rule) {
-	    s = edit->syntax_marker->next;
-	    syntax_free (edit->syntax_marker);
-	    edit->syntax_marker = s;
-	}
-	if (edit->syntax_marker) {
-	    edit->last_get_rule = edit->syntax_marker->offset;
-	    edit->rule = edit->syntax_marker->rule;
-	} else {
-	    edit->last_get_rule = -1;
-	    memset (&edit->rule, 0, sizeof (edit->rule));
-	}
+	syntax_marker_restore (edit, edit->last_get_rule);
 	edit->syntax_invalidate = 0;
     }
-    if (byte_index > edit->last_get_rule) {
-	for (i = edit->last_get_rule + 1; i <= byte_index; i++) {
-	    apply_rules_going_right (edit, i, edit->rule);
-	    if (i > (edit->syntax_marker ? edit->syntax_marker->offset + SYNTAX_MARKER_DENSITY : SYNTAX_MARKER_DENSITY)) {
-		struct _syntax_marker *s;
-		s = edit->syntax_marker;
-		edit->syntax_marker = syntax_malloc (sizeof (struct _syntax_marker));
-		edit->syntax_marker->next = s;
-		edit->syntax_marker->offset = i;
-		edit->syntax_marker->rule = edit->rule;
-	    }
+    if (byte_index < edit->last_get_rule) {
+	syntax_marker_restore (edit, byte_index + 1);
+    } else if (byte_index > edit->last_get_rule) {
+/* skip straight to a later marker if there is one */
+	k = syntax_marker_search (edit, min (byte_index + 1, edit->syntax_dirty));
+	if (k > 0 && edit->syntax_marker[k - 1].offset > edit->last_get_rule) {
+	    edit->last_get_rule = edit->syntax_marker[k - 1].offset;
+	    edit->rule = edit->syntax_marker[k - 1].rule;
 	}
-    } else if (byte_index < edit->last_get_rule) {
-	struct _syntax_marker *s;
-	for (;;) {
-	    if (!edit->syntax_marker) {
-		memset (&edit->rule, 0, sizeof (edit->rule));
-		for (i = -1; i <= byte_index; i++)
-		    apply_rules_going_right (edit, i, edit->rule);
-		break;
+    }
+    k = syntax_marker_search (edit, edit->last_get_rule + 1);
+    for (i = edit->last_get_rule + 1; i <= byte_index; i++) {
+	apply_rules_going_right (edit, i, edit->rule);
+	if (k < edit->n_syntax_markers && edit->syntax_marker[k].offset == i) {
+	    s = &edit->syntax_marker[k++];
+	    if (i < edit->syntax_dirty)
+		continue;
+	    if (i < edit->syntax_dirty_end || !syntax_rule_equal (s->rule, edit->rule)) {
+		s->rule = edit->rule;
+		continue;
 	    }
-	    if (byte_index >= edit->syntax_marker->offset) {
-		edit->rule = edit->syntax_marker->rule;
-		for (i = edit->syntax_marker->offset + 1; i <= byte_index; i++)
-		    apply_rules_going_right (edit, i, edit->rule);
-		break;
+/* back in step with the old text, so every marker from here on is still good */
+	    edit->syntax_dirty = LONG_MAX;
+	    j = syntax_marker_search (edit, byte_index + 1);
+	    if (j > k) {
+		k = j;
+		i = edit->syntax_marker[k - 1].offset;
+		edit->rule = edit->syntax_marker[k - 1].rule;
 	    }
-	    s = edit->syntax_marker->next;
-	    syntax_free (edit->syntax_marker);
-	    edit->syntax_marker = s;
+	} else if (i > (k ? edit->syntax_marker[k - 1].offset + SYNTAX_MARKER_DENSITY : SYNTAX_MARKER_DENSITY)
+/* an edit that only widens the gap a little leaves it alone, so undoing it gives back the same markers */
+		   && (k == edit->n_syntax_markers || edit->syntax_marker[k].offset > i + SYNTAX_MARKER_DENSITY)) {
+	    if (!syntax_marker_insert (edit, k, i))
+		k++;
 	}
     }
     edit->last_get_rule = byte_index;
+/* everything up to here has now been lexed from a verified marker, but
+   markers further on may still disagree with the ones just rewritten */
+    if (edit->syntax_dirty <= byte_index) {
+	edit->syntax_dirty = byte_index + 1;
+	edit->syntax_dirty_end = max (edit->syntax_dirty_end, edit->syntax_dirty);
+    }
+    if (edit->syntax_dirty != LONG_MAX && (!edit->n_syntax_markers || edit->syntax_marker[edit->n_syntax_markers - 1].offset < edit->syntax_dirty))
+	edit->syntax_dirty = LONG_MAX;
     return edit->rule;
 }
 
@@ -455,9 +745,67 @@ static void translate_rule_to_color (WEdit * edit, struct syntax_rule rule, int
     *fg = k->fg;
 }
 
+#if !defined (GTK) && !defined (MIDNIGHT)
+
+/* bytes: text further than this past the nearest known rule is drawn
+   without colour and left to edit_syntax_prelex() */
+#define SYNTAX_LEX_SYNC_MAX	(64 * 1024)
+/* bytes lexed per call of edit_syntax_prelex() */
+#define SYNTAX_PRELEX_SLICE	(16 * 1024)
+/* bytes past the top of the screen that edit_syntax_prelex() lexes up to */
+#define SYNTAX_PRELEX_AHEAD	(1024 * 1024)
+
+/* the furthest offset at or before byte_index whose rule is known without lexing */
+static long syntax_known_before (WEdit * edit, long byte_index)
+{E_
+    long k, known = -1;
+    if (!edit->syntax_invalidate && edit->last_get_rule <= byte_index) {
+	known = edit->last_get_rule;
+	if (byte_index - known <= SYNTAX_LEX_SYNC_MAX)
+	    return known;
+    }
+    k = syntax_marker_search (edit, min (byte_index + 1, edit->syntax_dirty));
+    if (k > 0)
+	known = max (known, edit->syntax_marker[k - 1].offset + (k - 1 >= edit->syntax_shift_index ? edit->syntax_shift : 0));
+    return known;
+}
+
+static int syntax_lex_deferred (WEdit * edit, long byte_index)
+{E_
+    if (!option_syntax_background || byte_index - syntax_known_before (edit, byte_index) <= SYNTAX_LEX_SYNC_MAX)
+	return 0;
+    edit->syntax_plain = min (edit->syntax_plain, byte_index);
+    return 1;
+}
+
+/*
+   Called while the editor is idle. Lexes the next slice of text beyond
+   where the rules are known, up to SYNTAX_PRELEX_AHEAD past the top of
+   the screen, so that checkpoints are ready before they are needed.
+   Returns 1 if text drawn without colour can now be coloured.
+ */
+int edit_syntax_prelex (WEdit * edit)
+{E_
+    long from, to;
+    if (!edit->rules || !option_syntax_highlighting || !option_syntax_background)
+	return 0;
+    to = min (edit->last_byte, edit->start_display + SYNTAX_PRELEX_AHEAD) - 1;
+    from = syntax_known_before (edit, to);
+    if (from < to)
+	edit_get_rule (edit, min (to, from + SYNTAX_PRELEX_SLICE));
+    if (edit->syntax_plain == LONG_MAX || edit->syntax_plain - syntax_known_before (edit, edit->syntax_plain) > SYNTAX_LEX_SYNC_MAX)
+	return 0;
+    edit->syntax_plain = LONG_MAX;
+    return 1;
+}
+
+#else
+#define syntax_lex_deferred(edit, byte_index)	0
+#endif
+
 void edit_get_syntax_color (WEdit * edit, long byte_index, int *fg, int *bg)
 {E_
-    if (edit->rules && byte_index < edit->last_byte && option_syntax_highlighting) {
+    if (edit->rules && byte_index < edit->last_byte && option_syntax_highlighting && !syntax_lex_deferred (edit, byte_index)) {
 	translate_rule_to_color (edit, edit_get_rule (edit, byte_index), fg, bg);
     } else {
 #ifdef MIDNIGHT
@@ -1010,6 +1358,7 @@ static int edit_read_syntax_rules (WEdit * edit, FILE * f)
 	    *p = '\0';
 	    c->keyword_first_chars = syntax_malloc (strlen (first_chars) + 7);
 	    strcpy (c->keyword_first_chars, first_chars);
+	    c->keyword_trie = keyword_trie_build (c);
 	}
     }
 
@@ -1038,7 +1387,7 @@ static void edit_syntax_clear_keyword (WEdit * edit, int context, int j)
     struct _syntax_marker *s;
     c = edit->rules[context];
 /* first we clear any instances of this keyword in our cache chain (we used to just clear the cache chain, but this slows things down) */
-    for (s = edit->syntax_marker; s; s = s->next)
+    for (s = edit->syntax_marker; s < edit->syntax_marker + edit->n_syntax_markers; s++)
 	if (s->rule.keyword == j)
 	    s->rule.keyword = 0;
 	else if (s->rule.keyword > j)
@@ -1051,6 +1400,7 @@ static void edit_syntax_clear_keyword (WEdit * edit, int context, int j)
         c->keyword[k] = c->keyword[k + 1];
     for (q = &c->keyword_first_chars[j]; *q; q++)
         *q = *(q + 1);
+    keyword_trie_free (c);
 }
 
 
@@ -1121,6 +1471,7 @@ static int edit_syntax_add_keyword (WEdit * edit, char *keyword, int context, ti
     s = strdupc (c->keyword_first_chars, c->keyword[j]->first);
     syntax_free (c->keyword_first_chars);
     c->keyword_first_chars = s;
+    keyword_trie_free (c);
     return 0;
 }
 
@@ -1440,16 +1791,15 @@ void edit_free_syntax_rules (WEdit * edit)
 	syntax_free (edit->rules[i]->whole_word_chars_right);
 	syntax_free (edit->rules[i]->keyword);
 	syntax_free (edit->rules[i]->keyword_first_chars);
+	keyword_trie_free (edit->rules[i]);
 	syntax_free (edit->rules[i]);
     }
-    for (;;) {
-	struct _syntax_marker *s;
-	if (!edit->syntax_marker)
-	    break;
-	s = edit->syntax_marker->next;
-	syntax_free (edit->syntax_marker);
-	edit->syntax_marker = s;
-    }
+    syntax_free (edit->syntax_marker);
+    edit->n_syntax_markers = edit->syntax_markers_alloc = 0;
+    edit->syntax_shift_index = edit->syntax_shift = 0;
+    edit->syntax_dirty = edit->syntax_plain = LONG_MAX;
+    edit->last_get_rule = -1;
+    memset (&edit->rule, 0, sizeof (edit->rule));
     syntax_free (edit->rules);
 }
 
@@ -1726,6 +2076,11 @@ void edit_free_syntax_rules (WEdit * edit)
     return;
 }
 
+void edit_syntax_modification (WEdit * edit, long p, long delta)
+{E_
+    return;
+}
+
 void edit_get_syntax_color (WEdit * edit, long byte_index, int *fg, int *bg)
 {E_
     *fg = NORMAL_COLOR;
@@ -1736,6 +2091,174 @@ void edit_get_syntax_color (WEdit * edit, long byte_index, int *fg, int *bg)
  
 #ifdef UNIT_TEST
 
+/* the keyword found through the trie at each byte must be the one the
+   scan of keyword_first_chars finds */
+static void test_keyword_trie (WEdit * edit, const char *text, int line)
+{
+    long i, e1, e2;
+    int j, k1, k2;
+
+    edit->text = (unsigned char *) strdup (text);
+    edit->last_byte = strlen (text);
+    for (j = 0; edit->rules[j]; j++) {
+        for (i = 0; i < edit->last_byte; i++) {
+            e1 = e2 = -1;
+            k1 = keyword_trie_match (edit, edit->rules[j], i, edit_get_lowercase_byte (edit, i), &e1);
+            k2 = keyword_scan_match (edit, edit->rules[j], i, edit_get_lowercase_byte (edit, i), &e2);
+            if (k1 != k2 || e1 != e2) {
+                printf ("error, trie found keyword %d ending %ld, scan found %d ending %ld, line %d, context %d, i=%ld\n", k1, e1, k2, e2, line, j, i);
+                exit (1);
+            }
+        }
+    }
+}
+
+/* a copy of edit sharing its rules but with no checkpoints yet */
+static WEdit *test_fresh_edit (WEdit * edit)
+{
+    WEdit *f;
+    f = (WEdit *) malloc (sizeof (WEdit));
+    *f = *edit;
+    f->syntax_marker = NULL;
+    f->n_syntax_markers = f->syntax_markers_alloc = 0;
+    f->syntax_shift_index = f->syntax_shift = 0;
+    f->syntax_dirty = f->syntax_dirty_end = f->syntax_plain = LONG_MAX;
+    f->last_get_rule = -1;
+    memset (&f->rule, 0, sizeof (f->rule));
+    f->syntax_invalidate = 1;
+    return f;
+}
+
+/* every checkpoint must hold the rule that lexing from the top gives at its offset */
+static void test_markers (WEdit * edit, int line)
+{
+    struct syntax_rule r;
+    WEdit *f;
+    long k;
+    f = test_fresh_edit (edit);
+    for (k = 0; k < edit->n_syntax_markers; k++) {
+        r = edit_get_rule (f, edit->syntax_marker[k].offset);
+        if (!syntax_rule_equal (r, edit->syntax_marker[k].rule)) {
+            printf ("error, stale checkpoint at %ld, line %d\n", edit->syntax_marker[k].offset, line);
+            exit (1);
+        }
+    }
+    syntax_free (f->syntax_marker);
+    free (f);
+}
+
+/* colours all of the text, starting from the place an edit was made
+   as a redraw would, and compares them with lexing it from the top */
+static void test_colors (WEdit * edit, long p, int line)
+{
+    WEdit *f;
+    long i;
+    int fg1, fg2, bg;
+    f = test_fresh_edit (edit);
+    for (i = max (p - 100, 0); i < edit->last_byte; i++)
+        edit_get_syntax_color (edit, i, &fg1, &bg);
+    for (i = 0; i < edit->last_byte; i++) {
+        fg1 = fg2 = -1;
+        edit_get_syntax_color (edit, i, &fg1, &bg);
+        edit_get_syntax_color (f, i, &fg2, &bg);
+        if (fg1 != fg2) {
+            printf ("error, got color %d after relex (expected %d), line %d, i=%ld\n", fg1, fg2, line, i);
+            exit (1);
+        }
+    }
+    syntax_free (f->syntax_marker);
+    free (f);
+    test_markers (edit, line);
+}
+
+/* replaces len bytes at p with ins, telling the lexer as edit_delete_text()
+   and edit_insert_ahead_text() would */
+static void test_edit (WEdit * edit, long p, long len, const char *ins)
+{
+    unsigned char *t;
+    long n = strlen (ins);
+    t = (unsigned char *) malloc (edit->last_byte - len + n + 1);
+    memcpy (t, edit->text, p);
+    memcpy (t + p, ins, n);
+    memcpy (t + p + n, edit->text + p + len, edit->last_byte - p - len);
+    edit->last_byte += n - len;
+    t[edit->last_byte] = '\0';
+    free (edit->text);
+    edit->text = t;
+    if (len)
+        edit_syntax_modification (edit, p, -len);
+    if (n)
+        edit_syntax_modification (edit, p, n);
+}
+
+/* lexes text from the top, makes the edit and checks the relex */
+static void test_relex (WEdit * edit, const char *text, long p, long len, const char *ins, int line)
+{
+    WEdit *f;
+    f = test_fresh_edit (edit);
+    f->text = (unsigned char *) strdup (text);
+    f->last_byte = strlen (text);
+    test_colors (f, 0, line);
+    test_edit (f, p, len, ins);
+    test_colors (f, p, line);
+    syntax_free (f->syntax_marker);
+    free (f->text);
+    free (f);
+}
+
+/* makes an edit and then undoes it, after which the checkpoints must
+   be the ones there were before */
+static void test_undo (WEdit * edit, const char *text, long p, long len, const char *ins, int line)
+{
+    struct _syntax_marker *m;
+    char *old;
+    long n, k;
+    WEdit *f;
+    f = test_fresh_edit (edit);
+    f->text = (unsigned char *) strdup (text);
+    f->last_byte = strlen (text);
+    test_colors (f, 0, line);
+    n = f->n_syntax_markers;
+    m = (struct _syntax_marker *) malloc (n * sizeof (struct _syntax_marker));
+    memcpy (m, f->syntax_marker, n * sizeof (struct _syntax_marker));
+    old = (char *) malloc (len + 1);
+    memcpy (old, text + p, len);
+    old[len] = '\0';
+    test_edit (f, p, len, ins);
+    test_colors (f, p, line);
+    test_edit (f, p, strlen (ins), old);
+    test_colors (f, p, line);
+    if (f->n_syntax_markers != n) {
+        printf ("error, %ld checkpoints after undo (expected %ld), line %d\n", f->n_syntax_markers, n, line);
+        exit (1);
+    }
+    for (k = 0; k < n; k++)
+        if (f->syntax_marker[k].offset != m[k].offset || !syntax_rule_equal (f->syntax_marker[k].rule, m[k].rule)) {
+            printf ("error, checkpoint at %ld differs after undo, line %d\n", m[k].offset, line);
+            exit (1);
+        }
+    free (m);
+    free (old);
+    syntax_free (f->syntax_marker);
+    free (f->text);
+    free (f);
+}
+
+/* a multi-line comment and string between plain lines, with enough
+   text around them to leave several checkpoints */
+static char *test_text (const char *middle)
+{
+    static char t[65536];
+    int i;
+    t[0] = '\0';
+    for (i = 0; i < 40; i++)
+        strcat (t, "char x; /* a */ 'q' char\n");
+    strcat (t, middle);
+    for (i = 0; i < 40; i++)
+        strcat (t, "char y; $ b $ char\n");
+    return t;
+}
+
 int main(int argc, char **argv)
 {
     WEdit *edit;
@@ -1755,6 +2278,9 @@ char *s1[] = {
 "file ..\\*\\\\.uyit$ Rubbish\\sScript ^nomatch",
 "include uyit.syntax",
 "",
+"file ..\\*\\\\.uzit$ Rubbish\\sScript ^nomatch",
+"include uzit.syntax",
+"",
 0};
 
 char *s2[] = {
@@ -1973,6 +2499,97 @@ NULL,
     TEST("/**/$'$'$'",8,9,9);
     TEST("/**/$'$'$'",9,10,NO_COLOR);
 
+/* edits that change the text after them, checked against lexing from the top */
+    {
+        char *t, c[4096];
+        long p, q, n;
+
+        strcpy (c, "/* comment\n");
+        for (i = 0; i < 60; i++)
+            strcat (c, "char in a comment\n");
+        strcat (c, "*/\n'string\n");
+        for (i = 0; i < 30; i++)
+            strcat (c, "char in a string\n");
+        strcat (c, "'\n");
+        t = test_text (c);
+        p = strstr (t, "/* comment") - t;
+        q = strstr (t, "'string") - t;
+        n = strlen (t);
+
+/* inside the comment or the string: nothing after changes */
+        test_relex (edit, t, p + 300, 0, "xyz", __LINE__);
+        test_relex (edit, t, p + 300, 5, "", __LINE__);
+        test_relex (edit, t, q + 200, 0, "char", __LINE__);
+/* closing the comment early, or the string */
+        test_relex (edit, t, p + 300, 0, "*/", __LINE__);
+        test_relex (edit, t, q + 200, 0, "'", __LINE__);
+/* breaking a keyword that starts before the edit */
+        test_relex (edit, t, n - 2, 1, "x", __LINE__);
+        test_relex (edit, t, n - 1, 0, "x", __LINE__);
+/* opening a comment above everything */
+        test_relex (edit, t, 10, 0, "/*", __LINE__);
+
+/* deleting from inside the first comment to inside the last one joins them */
+        test_relex (edit, t, 10, p + 100 - 10, "", __LINE__);
+/* deleting the end of the comment runs it on into the string */
+        test_relex (edit, t, q - 3, 2, "", __LINE__);
+/* deleting the end of the string runs it on to the next quote */
+        test_relex (edit, t, n - 40 * 19 - 2, 1, "", __LINE__);
+
+/* undoing an edit puts back the checkpoints that were there before it */
+        test_undo (edit, t, p + 2, 0, "*/", __LINE__);
+        test_undo (edit, t, q + 10, 1200, "", __LINE__);
+        test_undo (edit, t, 10, 0, "/*", __LINE__);
+    }
+
+    memset (edit, '\0', sizeof (*edit));
+    edit->last_get_rule = -1;
+    edit->syntax_invalidate = 1;
+
+    edit->filename = "test.uzit";
+    if (edit_load_syntax (edit, 0, 0))
+        exit (1);
+
+/* keywords that are prefixes of each other: the lowest numbered wins */
+    TEST("interface",0,9,30);
+    TEST("inter face",0,5,31);
+    TEST("inter face",5,10,NO_COLOR);
+    TEST("into",0,2,32);
+    TEST("into",2,4,NO_COLOR);
+    TEST("\"into\"",1,3,42);
+    TEST("\"interface\"",1,3,42);
+    TEST("\"interface\"",3,7,6);
+    TEST("\"interface\"",7,9,43);
+    TEST("\"interface\"",9,10,6);
+
+/* whole, wholeleft and wholeright */
+    TEST("on",0,2,33);
+    TEST("ton",0,3,NO_COLOR);
+    TEST("one",0,3,NO_COLOR);
+    TEST(" on ",1,3,33);
+    TEST("upx",0,2,34);
+    TEST("xup",0,3,NO_COLOR);
+    TEST("xdn",1,3,35);
+    TEST("dnx",0,3,NO_COLOR);
+    TEST("ls",0,2,41);
+    TEST(" ls",0,3,NO_COLOR);
+    TEST("x\nls",2,4,41);
+
+/* wildcards, also ahead of a literal keyword with a higher number */
+    TEST("g5h",0,3,36);
+    TEST("gah",0,3,NO_COLOR);
+    TEST("yij",0,3,37);
+    TEST("xij",0,3,37);
+    TEST("kabm",0,4,39);
+    TEST("kq",0,2,40);
+    TEST("kqm",0,3,39);
+    TEST("\"bc\"",1,3,43);
+    TEST("\"dc\"",1,3,6);
+
+    test_keyword_trie (edit, "interface inter into in on ton one upx xup xdn dnx\nls ls", __LINE__);
+    test_keyword_trie (edit, "g5h gah g55h yij xij zijx kabm kq kqm k\nm \"in bc ac\"", __LINE__);
+    test_keyword_trie (edit, "ininterinterfaceinterfac xxij gg0hh kkmm", __LINE__);
+
     printf ("Test success\n");
 }
 
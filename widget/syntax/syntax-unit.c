@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include "regex.h"
 #include "stringtools.h"
@@ -36,6 +37,9 @@ struct syntax_rule {
 
 #define REDRAW_PAGE             1
 
+#define min(x,y)     (((x) < (y)) ? (x) : (y))
+#define max(x,y)     (((x) > (y)) ? (x) : (y))
+
 int triple_pipe_open(int *in, ...)
 {
     return -1;
@@ -133,12 +137,12 @@ struct context_rule {
     int spelling;
 /* first word is word[1] */
     struct key_word **keyword;
+    struct keyword_trie *keyword_trie;	/* built from keyword[] when first needed */
 };
 
 struct _syntax_marker {
     long offset;
     struct syntax_rule rule;
-    struct _syntax_marker *next;
 };
 
 struct defin;
@@ -149,12 +153,20 @@ struct WEdit_ {
     unsigned char *text;
     long last_byte;
     long curs1;
+    long start_display;
 
     char *filename;
 
     int force;
 
-    struct _syntax_marker *syntax_marker;
+    struct _syntax_marker *syntax_marker;	/* checkpoints, sorted by offset */
+    long n_syntax_markers;
+    long syntax_markers_alloc;
+    long syntax_shift_index;	/* markers from here on still have to move by syntax_shift bytes */
+    long syntax_shift;
+    long syntax_dirty;		/* markers at or after this offset are unverified */
+    long syntax_dirty_end;	/* the text from here on is unchanged since they were made */
+    long syntax_plain;		/* text from here on was drawn without colour while still unlexed */
     struct defin *defin;
     struct context_rule **rules;
     int is_case_insensitive;
@@ -463,7 +463,7 @@ static void text_print_line (CWidget * w, long b, int row)
     edit_draw_proportional (w,
                      (converttext_cb_t) convert_text2,
 		     (calctextpos_cb_t) calc_text_pos2,
-			    -w->firstcolumn * FONT_MEAN_WIDTH, w->winid,
+			    -w->firstcolumn * FONT_MEAN_WIDTH, w,
 			    w->width, b, row, row * FONT_PIX_PER_LINE + EDIT_TEXT_VERTICAL_OFFSET, 0,
 			    FONT_PER_CHAR(' ') * TAB_SIZE, 0, 0);
 }
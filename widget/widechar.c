@@ -7,6 +7,9 @@
 #include "inspect.h"
 #include <config.h>
 #include <edit.h>
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
 
 #define MB_MARKER_DENSITY 64
 
@@ -222,9 +225,78 @@ static inline struct mb_rule apply_mb_rules_going_right (WEdit * edit, long byte
     return mb_rule;
 }
 
+/* returns the index of the last marker at or before byte_index, or -1 */
+static long mb_marker_search (WEdit * edit, long byte_index)
+{E_
+    long i = -1, j = edit->n_mb_markers, k;
+    while (j - i > 1) {
+	k = (i + j) / 2;
+	if (edit->mb_marker[k].offset <= byte_index)
+	    i = k;
+	else
+	    j = k;
+    }
+    return i;
+}
+
+/* out of memory, the markers are dropped and decoding starts from the top */
+static void mb_marker_add (WEdit * edit, long offset, struct mb_rule rule)
+{E_
+    if (edit->n_mb_markers == edit->mb_markers_alloc) {
+	struct _mb_marker *t;
+	t = realloc (edit->mb_marker, (edit->mb_markers_alloc * 2 + 256) * sizeof (struct _mb_marker));
+	if (!t) {
+	    free (edit->mb_marker);
+	    edit->mb_marker = NULL;
+	    edit->n_mb_markers = edit->mb_markers_alloc = 0;
+	    return;
+	}
+	edit->mb_marker = t;
+	edit->mb_markers_alloc = edit->mb_markers_alloc * 2 + 256;
+    }
+    edit->mb_marker[edit->n_mb_markers].offset = offset;
+    edit->mb_marker[edit->n_mb_markers].rule = rule;
+    edit->n_mb_markers++;
+}
+
+/* decodes forward from i to byte_index, leaving a marker every MB_MARKER_DENSITY bytes past the last one */
+static struct mb_rule apply_mb_rules_going_right_to (WEdit * edit, long i, long byte_index, struct mb_rule mb_rule)
+{E_
+    int utf8;
+    utf8 = (get_editor_encoding () == FONT_ENCODING_UTF8);
+    for (; i <= byte_index; i++) {
+	if (utf8)
+	    mb_rule = apply_mb_rules_going_right_utf8_to_wchar (edit, i, mb_rule);
+	else
+	    mb_rule = apply_mb_rules_going_right (edit, i, mb_rule);
+	if (i > (edit->n_mb_markers ? edit->mb_marker[edit->n_mb_markers - 1].offset + MB_MARKER_DENSITY : MB_MARKER_DENSITY))
+	    mb_marker_add (edit, i, mb_rule);
+    }
+    return mb_rule;
+}
+
+/* drops the markers past a modification, see edit_modification() */
+static void mb_markers_invalidate (WEdit * edit)
+{E_
+    edit->n_mb_markers = mb_marker_search (edit, edit->last_get_mb_rule - 1) + 1;
+    if (edit->n_mb_markers) {
+	edit->last_get_mb_rule = edit->mb_marker[edit->n_mb_markers - 1].offset;
+	edit->mb_rule = edit->mb_marker[edit->n_mb_markers - 1].rule;
+    } else {
+	edit->last_get_mb_rule = -1;
+	memset (&edit->mb_rule, 0, sizeof (edit->mb_rule));
+    }
+    edit->mb_invalidate = 0;
+}
+
+/*
+   Markers stay put when reading backward, so that a jump to anywhere in
+   the text decodes at most MB_MARKER_DENSITY bytes. Only a modification
+   discards them, from the changed offset on.
+ */
 struct mb_rule get_mb_rule (WEdit * edit, long byte_index)
 {E_
-    long i;
+    long i, k;
 
     if (
 #ifdef HAVE_WCHAR_H
@@ -236,83 +308,23 @@ struct mb_rule get_mb_rule (WEdit * edit, long byte_index)
 	r.ch = edit_get_byte (edit, byte_index);
 	return r;
     }
-    if (edit->mb_invalidate) {
-	struct _mb_marker *s;
-	while (edit->mb_marker && edit->mb_marker->offset >= edit->last_get_mb_rule) {
-	    s = edit->mb_marker->next;
-	    free (edit->mb_marker);
-	    edit->mb_marker = s;
-	}
-	if (edit->mb_marker) {
-	    edit->last_get_mb_rule = edit->mb_marker->offset;
-	    edit->mb_rule = edit->mb_marker->rule;
-	} else {
-	    edit->last_get_mb_rule = -1;
-	    memset (&edit->mb_rule, 0, sizeof (edit->mb_rule));
-	}
-	edit->mb_invalidate = 0;
-    }
-    if (byte_index > edit->last_get_mb_rule) {
-	if (get_editor_encoding () == FONT_ENCODING_UTF8) {
-	    for (i = edit->last_get_mb_rule + 1; i <= byte_index; i++) {
-		edit->mb_rule = apply_mb_rules_going_right_utf8_to_wchar (edit, i, edit->mb_rule);
-		if (i >
-		    (edit->mb_marker ? edit->mb_marker->offset +
-		     MB_MARKER_DENSITY : MB_MARKER_DENSITY)) {
-		    struct _mb_marker *s;
-		    s = edit->mb_marker;
-		    edit->mb_marker = malloc (sizeof (struct _mb_marker));
-		    edit->mb_marker->next = s;
-		    edit->mb_marker->offset = i;
-		    edit->mb_marker->rule = edit->mb_rule;
-		}
-	    }
-	} else {
-	    for (i = edit->last_get_mb_rule + 1; i <= byte_index; i++) {
-		edit->mb_rule = apply_mb_rules_going_right (edit, i, edit->mb_rule);
-		if (i >
-		    (edit->mb_marker ? edit->mb_marker->offset +
-		     MB_MARKER_DENSITY : MB_MARKER_DENSITY)) {
-		    struct _mb_marker *s;
-		    s = edit->mb_marker;
-		    edit->mb_marker = malloc (sizeof (struct _mb_marker));
-		    edit->mb_marker->next = s;
-		    edit->mb_marker->offset = i;
-		    edit->mb_marker->rule = edit->mb_rule;
+    if (edit->mb_invalidate)
+	mb_markers_invalidate (edit);
+    if (byte_index != edit->last_get_mb_rule) {
+	i = edit->last_get_mb_rule + 1;
+	if (byte_index < edit->last_get_mb_rule || byte_index - edit->last_get_mb_rule > MB_MARKER_DENSITY) {
+	    k = mb_marker_search (edit, byte_index);
+	    if (k < 0) {
+		if (byte_index < edit->last_get_mb_rule) {
+		    memset (&edit->mb_rule, 0, sizeof (edit->mb_rule));
+		    i = -1;
 		}
+	    } else if (byte_index < edit->last_get_mb_rule || edit->mb_marker[k].offset > edit->last_get_mb_rule) {
+		edit->mb_rule = edit->mb_marker[k].rule;
+		i = edit->mb_marker[k].offset + 1;
 	    }
 	}
-    } else if (byte_index < edit->last_get_mb_rule) {
-	struct _mb_marker *s;
-	for (;;) {
-	    if (!edit->mb_marker) {
-		memset (&edit->mb_rule, 0, sizeof (edit->mb_rule));
-		if (get_editor_encoding () == FONT_ENCODING_UTF8) {
-		    for (i = -1; i <= byte_index; i++)
-			edit->mb_rule =
-			    apply_mb_rules_going_right_utf8_to_wchar (edit, i, edit->mb_rule);
-		} else {
-		    for (i = -1; i <= byte_index; i++)
-			edit->mb_rule = apply_mb_rules_going_right (edit, i, edit->mb_rule);
-		}
-		break;
-	    }
-	    if (byte_index >= edit->mb_marker->offset) {
-		edit->mb_rule = edit->mb_marker->rule;
-		if (get_editor_encoding () == FONT_ENCODING_UTF8) {
-		    for (i = edit->mb_marker->offset + 1; i <= byte_index; i++)
-			edit->mb_rule =
-			    apply_mb_rules_going_right_utf8_to_wchar (edit, i, edit->mb_rule);
-		} else {
-		    for (i = edit->mb_marker->offset + 1; i <= byte_index; i++)
-			edit->mb_rule = apply_mb_rules_going_right (edit, i, edit->mb_rule);
-		}
-		break;
-	    }
-	    s = edit->mb_marker->next;
-	    free (edit->mb_marker);
-	    edit->mb_marker = s;
-	}
+	edit->mb_rule = apply_mb_rules_going_right_to (edit, i, byte_index, edit->mb_rule);
     }
     edit->last_get_mb_rule = byte_index;
     return edit->mb_rule;
@@ -326,6 +338,91 @@ long edit_get_wide_byte (WEdit * edit, long byte_index)
 }
 
 
+/* returns the count of leading bytes of p that are 7-bit and not a newline */
+static long ascii_run (const unsigned char *p, long len)
+{E_
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8 ('\n');
+    while (len - i >= 16) {
+	__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+	if (_mm_movemask_epi8 (_mm_or_si128 (v, _mm_cmpeq_epi8 (v, nl))))
+	    break;
+	i += 16;
+    }
+#endif
+    while (i < len && p[i] < 0x80 && p[i] != '\n')
+	i++;
+    return i;
+}
+
+/*
+   UTF-8 decoding of a 7-bit byte never depends on what came before,
+   so the state after an ASCII run is known without decoding it. This
+   leaves markers through the run as apply_mb_rules_going_right_to()
+   would have.
+ */
+static void mb_rule_ascii_run (WEdit * edit, const unsigned char *p, long from, long to)
+{E_
+    struct mb_rule r;
+    long i;
+    r = edit->mb_rule;
+    r.end = 0;
+    i = edit->n_mb_markers ? edit->mb_marker[edit->n_mb_markers - 1].offset : 0;
+    for (i += MB_MARKER_DENSITY + 1; i <= to; i += MB_MARKER_DENSITY + 1) {
+	if (i < from)
+	    i = from;
+	r.ch = p[i - from];
+	mb_marker_add (edit, i, r);
+    }
+    r.ch = p[to - from];
+    edit->mb_rule = r;
+    edit->last_get_mb_rule = to;
+}
+
+/*
+   Decodes the text from start into ch[], one entry per byte holding
+   what edit_get_wide_byte() would return for it. Stops after the first
+   newline, or at finish. Returns the offset where decoding stopped.
+   With UTF-8 or 8-bit text, runs of ASCII are copied straight out of
+   the buffers. Only the remaining bytes go through get_mb_rule().
+ */
+long edit_get_wide_text (WEdit * edit, long start, long finish, C_wchar_t * ch)
+{E_
+    enum font_encoding e;
+    const unsigned char *p;
+    long i, n, len;
+    int fast;
+    e = get_editor_encoding ();
+    fast = (e == FONT_ENCODING_UTF8 || e == FONT_ENCODING_8BIT
+#ifdef HAVE_WCHAR_H
+	    || (MB_CUR_MAX == 1 && e == FONT_ENCODING_LOCALE)
+#endif
+	);
+    if (fast && e == FONT_ENCODING_UTF8 && edit->mb_invalidate)
+	mb_markers_invalidate (edit);
+    for (i = start; i < finish;) {
+	if (fast && i >= 0 && i < edit->last_byte) {
+	    p = edit_get_span (edit, i, &len);
+	    if (len > finish - i)
+		len = finish - i;
+	    if ((n = ascii_run (p, len))) {
+		long j;
+		for (j = 0; j < n; j++)
+		    ch[i - start + j] = p[j];
+		if (e == FONT_ENCODING_UTF8)
+		    mb_rule_ascii_run (edit, p, i, i + n - 1);
+		i += n;
+		continue;
+	    }
+	}
+	ch[i - start] = get_mb_rule (edit, i).ch;
+	if (ch[i++ - start] == '\n')
+	    break;
+    }
+    return i;
+}
+
 
 struct widetable {
     C_wchar_t c;